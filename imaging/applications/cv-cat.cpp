@@ -36,9 +36,11 @@
 #include <windows.h>
 #endif
 #include <iostream>
+#include <boost/lexical_cast.hpp>
 #include <boost/program_options.hpp>
 #include <comma/application/signal_flag.h>
 #include <comma/name_value/parser.h>
+#include <snark/imaging/cv_mat/mapped_reader.h>
 #include <snark/imaging/cv_mat/pipeline.h>
 #include <opencv2/highgui/highgui.hpp>
 
@@ -88,6 +90,13 @@ static pair read( snark::cv_mat::serialization& input, rate_limit& rate )
     return input.read( std::cin );
 }
 
+static pair read_log( snark::cv_mat::mapped_reader& log, rate_limit& rate )
+{
+    if( is_shutdown ) { return pair(); }
+    rate.wait();
+    return log.read();
+}
+
 int main( int argc, char** argv )
 {
     try
@@ -98,6 +107,8 @@ int main( int argc, char** argv )
         #endif
 
         std::string name;
+        std::string log_name;
+        std::string seek;
         int device;
         unsigned int discard;
         double fps;
@@ -105,6 +116,9 @@ int main( int argc, char** argv )
         std::string output_options_string;
         unsigned int capacity = 16;
         unsigned int number_of_threads = 0;
+        double latency;
+        std::string drop_policy;
+        double statistics;
         boost::program_options::options_description description( "options" );
         description.add_options()
             ( "help,h", "display help message" )
@@ -112,8 +126,13 @@ int main( int argc, char** argv )
             ( "discard,d", "discard frames, if cannot keep up; same as --buffer=1" )
             ( "camera", "use first available opencv-supported camera" )
             ( "file", boost::program_options::value< std::string >( &name ), "video file name" )
+            ( "log", boost::program_options::value< std::string >( &log_name ), "file of images in --input format (e.g. saved cv-cat output) to read memory-mapped, without copying" )
+            ( "seek", boost::program_options::value< std::string >( &seek ), "with --log: start from given frame number or from the first frame not earlier than given timestamp, e.g. 20140101T000000" )
             ( "id", boost::program_options::value< int >( &device ), "specify specific device by id ( OpenCV-supported camera )" )
             ( "buffer", boost::program_options::value< unsigned int >( &discard )->default_value( 0 ), "maximum buffer size before discarding frames, default: unlimited" )
+            ( "drop-policy", boost::program_options::value< std::string >( &drop_policy )->default_value( "newest-wins" ), "if buffer exceeds --buffer size, newest-wins: discard oldest frames in buffer; oldest-wins: discard incoming frames" )
+            ( "latency", boost::program_options::value< double >( &latency )->default_value( 0 ), "latency budget in milliseconds: discard frames that have been in buffer longer than that; default: 0 (no budget)" )
+            ( "statistics", boost::program_options::value< double >( &statistics )->default_value( 0 ), "print frame counts and per-stage latencies to stderr every given number of seconds; default: 0 (never)" )
             ( "fps", boost::program_options::value< double >( &fps )->default_value( 0 ), "specify max fps ( useful for files, may block if used with cameras ) " )
             ( "input", boost::program_options::value< std::string >( &input_options_string ), "input options, when reading from stdin (see --help --verbose)" )
             ( "output", boost::program_options::value< std::string >( &output_options_string ), "output options (see --help --verbose); default: same as --input" )
@@ -169,8 +188,11 @@ int main( int argc, char** argv )
             std::cerr << std::endl;
             return 1;
         }
-        if( vm.count( "file" ) + vm.count( "camera" ) + vm.count( "id" ) > 1 ) { std::cerr << "cv-cat: --file, --camera, and --id are mutually exclusive" << std::endl; return 1; }
+        if( vm.count( "file" ) + vm.count( "camera" ) + vm.count( "id" ) + vm.count( "log" ) > 1 ) { std::cerr << "cv-cat: --file, --camera, --id, and --log are mutually exclusive" << std::endl; return 1; }
         if( vm.count( "discard" ) ) { discard = 1; }
+        if( drop_policy != "newest-wins" && drop_policy != "oldest-wins" ) { std::cerr << "cv-cat: expected --drop-policy=<newest-wins|oldest-wins>, got: \"" << drop_policy << "\"" << std::endl; return 1; }
+        bursty_reader< pair >::policy policy = drop_policy == "newest-wins" ? bursty_reader< pair >::newest_wins : bursty_reader< pair >::oldest_wins;
+        boost::posix_time::time_duration budget = latency > 0 ? boost::posix_time::microseconds( static_cast< long >( latency * 1000 ) ) : boost::posix_time::time_duration( boost::posix_time::not_a_date_time );
         snark::cv_mat::serialization::options input_options = comma::name_value::parser( ';', '=' ).get< snark::cv_mat::serialization::options >( input_options_string );
         snark::cv_mat::serialization::options output_options = output_options_string.empty()
                                                              ? input_options
@@ -188,23 +210,39 @@ int main( int argc, char** argv )
         cv::VideoCapture video_capture;
         snark::cv_mat::serialization input( input_options );
         snark::cv_mat::serialization output( output_options );
+        boost::scoped_ptr< snark::cv_mat::mapped_reader > log; // should outlive reader
         boost::scoped_ptr< bursty_reader< pair > > reader;
-        if( vm.count( "file" ) )
+        boost::function0< pair > read_function;
+        if( vm.count( "log" ) )
+        {
+            log.reset( new snark::cv_mat::mapped_reader( log_name, input_options ) );
+            if( !seek.empty() )
+            {
+                if( seek.find( 'T' ) == std::string::npos ) { log->seek( boost::lexical_cast< std::size_t >( seek ) ); }
+                else { log->seek( boost::posix_time::from_iso_string( seek ) ); }
+            }
+            read_function = boost::bind( &read_log, boost::ref( *log ), boost::ref( rate ) );
+        }
+        else if( vm.count( "file" ) )
         {
             video_capture.open( name );
-            reader.reset( new bursty_reader< pair >( boost::bind( &capture, boost::ref( video_capture ), boost::ref( rate ) ), discard, capacity ) );
+            read_function = boost::bind( &capture, boost::ref( video_capture ), boost::ref( rate ) );
         }
         else if( vm.count( "camera" ) || vm.count( "id" ) )
         {
             video_capture.open( device );
-            reader.reset( new bursty_reader< pair >( boost::bind( &capture, boost::ref( video_capture ), boost::ref( rate ) ), discard ) );
+            read_function = boost::bind( &capture, boost::ref( video_capture ), boost::ref( rate ) );
+            capacity = 0; // cameras do not block
         }
         else
         {
-            reader.reset( new bursty_reader< pair >( boost::bind( &read, boost::ref( input ), boost::ref( rate ) ), discard, capacity ) );
+            read_function = boost::bind( &read, boost::ref( input ), boost::ref( rate ) );
         }
+        reader.reset( new bursty_reader< pair >( read_function, discard, capacity, policy, budget ) );
         const unsigned int default_delay = vm.count( "file" ) == 0 ? 1 : 200; // HACK to make view work on single files
         snark::imaging::applications::pipeline pipeline( output, snark::cv_mat::filters::make( filters, default_delay ), *reader, number_of_threads );
+        if( log ) { pipeline.on_output( boost::bind( &snark::cv_mat::mapped_reader::release, log.get(), _1 ) ); } // otherwise pages modified by in-place filters accumulate
+        if( statistics > 0 ) { pipeline.statistics( boost::posix_time::microseconds( static_cast< long >( statistics * 1000000 ) ) ); }
         pipeline.run();
         if( vm.count( "stay" ) )
         {
@@ -52,6 +52,10 @@ static void usage()
     std::cerr << std::endl;
     std::cerr << "the map is stored as 2 appended row-major float images," << std::endl;
     std::cerr << "one for the x coordinate, one for y" << std::endl;
+    std::cerr << "or, if --fixed-point, as fixed-point maps (see cv::convertMaps):" << std::endl;
+    std::cerr << "a row-major image of 2 shorts per pixel for integer x,y," << std::endl;
+    std::cerr << "followed by a row-major image of unsigned shorts for interpolation table indices;" << std::endl;
+    std::cerr << "fixed-point maps are smaller and faster to apply, with interpolation error within 1/32 of pixel" << std::endl;
     std::cerr << std::endl;
     std::cerr << "usage: image-undistort-map <file> <options>" << std::endl;
     std::cerr << std::endl;
@@ -61,6 +65,7 @@ static void usage()
     std::cerr << "    --intrinsics <fx,fy,cx,cy>: intrinsic parameters in pixel" << std::endl;
     std::cerr << "    --distortion <k1,k2,p1,p2,k3>: distortion parameters" << std::endl;
     std::cerr << "    --size <width>x<height>: image size in pixel" << std::endl;
+    std::cerr << "    --fixed-point: output fixed-point maps" << std::endl;
     std::cerr << std::endl;
     std::cerr << "example: " << std::endl;
     std::cerr << "    image-undistort-map --intrinsics \"830.2,832.4,308.8,232.6\" --distortion \"-0.42539,0.14800,0.00218,0.00061\" --size 1280x960 bumblebee-undistort-map.bin " << std::endl;
@@ -121,7 +126,16 @@ int main(int argc, char *argv[])
         cv::Mat map2;
         cv::initUndistortRectifyMap( cameraMatrix, distCoeffs, cv::Mat(), cameraMatrix, cv::Size( size.first, size.second ), CV_32FC1, map1, map2 );
 
-        std::vector< std::string > unnamed = options.unnamed( "", "--intrinsics,--distortion,--size" );
+        if( options.exists( "--fixed-point" ) )
+        {
+            cv::Mat fixed1;
+            cv::Mat fixed2;
+            cv::convertMaps( map1, map2, fixed1, fixed2, CV_16SC2 );
+            map1 = fixed1;
+            map2 = fixed2;
+        }
+
+        std::vector< std::string > unnamed = options.unnamed( "--fixed-point", "--intrinsics,--distortion,--size" );
         if( unnamed.empty() ) { std::cerr << "image-undistort-map: please specify output file name" << std::endl; exit( 1 ); }
         std::ostream* os = &std::cout;
         boost::scoped_ptr< std::ofstream > ofs;
@@ -130,8 +144,8 @@ int main(int argc, char *argv[])
             ofs.reset( new std::ofstream( unnamed[0].c_str() ) );
             os = ofs.get();
         }
-        os->write( (char*)map1.data, map1.size().width * map1.size().height * 4 ); // type is CV_32FC1
-        os->write( (char*)map2.data, map2.size().width * map2.size().height * 4 );
+        os->write( (char*)map1.data, map1.size().width * map1.size().height * map1.elemSize() ); // type is CV_32FC1 or, if fixed point, CV_16SC2
+        os->write( (char*)map2.data, map2.size().width * map2.size().height * map2.elemSize() ); // type is CV_32FC1 or, if fixed point, CV_16UC1
         return 0;
     }
     catch( std::exception& e )
@@ -31,15 +31,27 @@
 // IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 
+#include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <iterator>
+#include <map>
 #include <queue>
 #include <sstream>
+#include <sys/stat.h>
 #include <boost/bind.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/optional.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/shared_ptr.hpp>
+#include <tbb/enumerable_thread_specific.h>
 #include <comma/base/exception.h>
 #include <comma/csv/ascii.h>
 #include <comma/string/string.h>
 #include "./filters.h"
+#include "./frame_pool.h"
+#include "./kernels.h"
 #include <Eigen/Core>
 
 #include <opencv2/imgproc/imgproc.hpp>
@@ -49,7 +61,29 @@
 
 namespace snark{ namespace cv_mat {
 
-static filters::value_type cvt_color_impl_( filters::value_type m, unsigned int which )
+/// output frames of a filter, recycled once released downstream,
+/// thus filter output stays in the same memory from frame to frame
+///
+/// a pool per thread, since parallel filters run in several threads
+class filter_outputs_
+{
+    public:
+        typedef boost::shared_ptr< filter_outputs_ > ptr; // filters get copied, outputs shared between the copies
+
+        filter_outputs_() : pools_( frame_pool( 16 ) ) {}
+
+        static ptr make() { return ptr( new filter_outputs_ ); }
+
+        /// return output frame; its contents are undefined
+        cv::Mat get( int rows, int cols, int type ) { return pools_.local().get( rows, cols, type ); }
+
+        cv::Mat get( const cv::Size& size, int type ) { return get( size.height, size.width, type ); }
+
+    private:
+        ::tbb::enumerable_thread_specific< frame_pool > pools_;
+};
+
+static filters::value_type cvt_color_impl_( filters::value_type m, unsigned int which, filter_outputs_::ptr outputs )
 {
     filters::value_type n;
     n.first = m.first;
@@ -59,6 +93,7 @@ static filters::value_type cvt_color_impl_( filters::value_type m, unsigned int
         cv::cvtColor( m.second, grey, CV_RGB2GRAY );
         m.second = grey;
     }
+    n.second = outputs->get( m.second.size(), CV_MAKETYPE( m.second.depth(), 3 ) ); // bayer conversion outputs 3 channels
     cv::cvtColor( m.second, n.second, which + 45u ); // HACK, bayer as unsigned int, but I don't find enum { BG2RGB, GB2BGR ... } more usefull
     return n;
 }
@@ -77,35 +112,39 @@ static filters::value_type crop_tile_impl_( filters::value_type m, unsigned int
     return filters::value_type( m.first, cv::Mat( m.second, cv::Rect( cropX, cropY, tileWidth, tileHeight ) ) );
 }
 
-static filters::value_type flip_impl_( filters::value_type m, int how )
+static filters::value_type flip_impl_( filters::value_type m, int how, filter_outputs_::ptr outputs )
 {
     filters::value_type n;
     n.first = m.first;
+    n.second = outputs->get( m.second.size(), m.second.type() );
     cv::flip( m.second, n.second, how );
     return n;
 }
 
-static filters::value_type resize_impl_( filters::value_type m, unsigned int width, unsigned int height, double w, double h )
+static filters::value_type resize_impl_( filters::value_type m, unsigned int width, unsigned int height, double w, double h, filter_outputs_::ptr outputs )
 {
     filters::value_type n;
     n.first = m.first;
-    cv::resize( m.second, n.second, cv::Size( width ? width : m.second.cols * w, height ? height : m.second.rows * h ) );
+    cv::Size size( width ? width : m.second.cols * w, height ? height : m.second.rows * h );
+    n.second = outputs->get( size, m.second.type() );
+    cv::resize( m.second, n.second, size );
     return n;
 }
 
-static filters::value_type transpose_impl_( filters::value_type m )
+static filters::value_type transpose_impl_( filters::value_type m, filter_outputs_::ptr outputs )
 {
     filters::value_type n;
     n.first = m.first;
+    n.second = outputs->get( m.second.cols, m.second.rows, m.second.type() );
     cv::transpose( m.second, n.second );
     return n;
 }
 
-static filters::value_type split_impl_( filters::value_type m )
+static filters::value_type split_impl_( filters::value_type m, filter_outputs_::ptr outputs )
 {
     filters::value_type n;
     n.first = m.first;
-    n.second = cv::Mat( m.second.rows * 3, m.second.cols, CV_8UC1 ); // todo: check number of channels!
+    n.second = outputs->get( m.second.rows * 3, m.second.cols, CV_8UC1 ); // todo: check number of channels!
     std::vector< cv::Mat > channels;
     channels.reserve( 3 );
     channels.push_back( cv::Mat( n.second, cv::Rect( 0, 0, m.second.cols, m.second.rows ) ) );
@@ -182,15 +221,63 @@ static filters::value_type timestamp_impl_( filters::value_type m )
     return m;
 }
 
-static filters::value_type invert_impl_( filters::value_type m )
+static filters::value_type invert_impl_( filters::value_type m ) // in place
 {
-    unsigned int c = ( m.second.dataend - m.second.datastart ) / ( m.second.rows * m.second.cols );
-    if( c != 3 && c != 1 ) { COMMA_THROW( comma::exception, "expected 1 or 3 channels, got: " << c ); } // quick and dirty
-    filters::value_type n;
-    n.first = m.first;
-    m.second.copyTo( n.second );
-    for( unsigned char* c = n.second.datastart; c < n.second.dataend; *c = 255 - *c, ++c );
-    return n;
+    kernels::invert( m.second );
+    return m;
+}
+
+/// per-pixel filter, in place: images of up to 16 bits go through a lookup table made on the first image of given depth, others through the kernel
+class pixel_impl_
+{
+    public:
+        typedef boost::function< cv::Mat( int ) > make_table_type;
+        typedef boost::function< void( cv::Mat& ) > kernel_type;
+        pixel_impl_( const std::string& name, const make_table_type& make_table, const kernel_type& kernel = kernel_type() ) : name_( name ), make_table_( make_table ), kernel_( kernel ), cache_( new cache_type_ ) {}
+        filters::value_type operator()( filters::value_type m )
+        {
+            switch( m.second.depth() )
+            {
+                case CV_8U: case CV_8S: case CV_16U: case CV_16S: kernels::lut( m.second, table_( m.second.depth() ) ); break;
+                default: if( !kernel_ ) { COMMA_THROW( comma::exception, name_ << ": expected image of 8-bit or 16-bit depth, got image type: " << m.second.type() ); } kernel_( m.second );
+            }
+            return m;
+        }
+
+    private:
+        std::string name_;
+        make_table_type make_table_;
+        kernel_type kernel_;
+        struct cache_type_
+        {
+            boost::mutex mutex;
+            std::map< int, cv::Mat > tables;
+        };
+        boost::shared_ptr< cache_type_ > cache_; // shared between copies of the filter
+        cv::Mat table_( int depth )
+        {
+            boost::mutex::scoped_lock lock( cache_->mutex );
+            std::map< int, cv::Mat >::iterator it = cache_->tables.find( depth );
+            if( it != cache_->tables.end() ) { return it->second; } // tables never change, once made
+            cv::Mat table = make_table_( depth );
+            cache_->tables[ depth ] = table;
+            return table;
+        }
+};
+
+static cv::Mat linear_table_( int depth, double scale, double offset ) { kernels::linear_transform t = { scale, offset }; return kernels::make_lut( depth, t ); }
+
+static cv::Mat threshold_table_( int depth, double threshold, boost::optional< double > max ) { kernels::threshold_transform t = { threshold, max ? *max : kernels::max_of( depth ) }; return kernels::make_lut( depth, t ); }
+
+static void threshold_kernel_( cv::Mat& m, double threshold, boost::optional< double > max ) { kernels::threshold( m, threshold, max ? *max : kernels::max_of( m.depth() ) ); }
+
+static cv::Mat lut_table_( int depth, const std::string& filename, boost::shared_ptr< std::vector< char > > bytes )
+{
+    std::size_t size = depth == CV_8U || depth == CV_8S ? 256 : 65536 * 2;
+    if( bytes->size() != size ) { COMMA_THROW( comma::exception, "lut: expected " << size << " bytes in \"" << filename << "\" for image depth " << depth << ", got " << bytes->size() ); }
+    cv::Mat table( 1, depth == CV_8U || depth == CV_8S ? 256 : 65536, CV_MAKETYPE( depth, 1 ) );
+    std::memcpy( table.ptr(), &( *bytes )[0], size );
+    return table;
 }
 
 static filters::value_type text_impl_( filters::value_type m, const std::string& s, const cv::Point& origin, const cv::Scalar& colour )
@@ -199,76 +286,342 @@ static filters::value_type text_impl_( filters::value_type m, const std::string&
     return m;
 }
 
+/// undistort with remap
+///
+/// map file: either float x and y maps, as written by image-undistort-map,
+/// or fixed-point maps (cv::convertMaps to CV_16SC2 and CV_16UC1), as written by image-undistort-map --fixed-point;
+/// fixed-point maps take 6 bytes instead of 8 per pixel and remap faster, with interpolation error within 1/32 of pixel
+///
+/// if fixed, float maps get converted to fixed point on load; if cache file given,
+/// the converted maps are loaded from it, if it is newer than the map file, or otherwise saved to it
 class undistort_impl_
 {
     public:
-        undistort_impl_( const std::string filename ) : filename_( filename ) {}
+        undistort_impl_( const std::string& filename, bool fixed = false, const std::string& cache = "" ) : filename_( filename ), fixed_( fixed ), cache_( cache ), maps_( new maps_type_ ), outputs_( filter_outputs_::make() ) {}
 
         filters::value_type operator()( filters::value_type m )
         {
-            init_map_( m.second.rows, m.second.cols );
-            filters::value_type n( m.first, cv::Mat( m.second.size(), m.second.type(), cv::Scalar::all(0) ) );
-            cv::remap( m.second, n.second, x_, y_, cv::INTER_LINEAR, cv::BORDER_TRANSPARENT );
+            const maps_type_& maps = init_maps_( m.second.rows, m.second.cols );
+            filters::value_type n( m.first, outputs_->get( m.second.size(), m.second.type() ) );
+            n.second.setTo( cv::Scalar::all( 0 ) );
+            cv::remap( m.second, n.second, maps.x, maps.y, cv::INTER_LINEAR, cv::BORDER_TRANSPARENT );
             return n;
         }
 
     private:
         std::string filename_;
-        std::vector< char > xbuf_;
-        std::vector< char > ybuf_;
-        cv::Mat x_;
-        cv::Mat y_;
-        void init_map_( unsigned int rows, unsigned int cols )
-        {
-            if( !x_.empty() ) { return; }
-            std::ifstream stream( filename_.c_str() );
-            if( !stream ) { COMMA_THROW( comma::exception, "failed to open undistort map in \"" << filename_ << "\"" ); }
-            std::size_t size = rows * cols * 4;
-            xbuf_.resize( size );
-            stream.read( &xbuf_[0], size );
-            if( stream.gcount() < 0 || std::size_t( stream.gcount() ) != size ) { COMMA_THROW( comma::exception, "failed to read \"" << filename_ << "\"" ); }
-            ybuf_.resize( size );
-            stream.read( &ybuf_[0], size );
-            if( stream.gcount() < 0 || std::size_t( stream.gcount() ) != size ) { COMMA_THROW( comma::exception, "failed to read \"" << filename_ << "\"" ); }
-            stream.peek(); // quick and dirty
-            if( !stream.eof() ) { COMMA_THROW( comma::exception, "expected " << ( size * 2 ) << " bytes in \"" << filename_ << "\", got more" ); }
-            x_ = cv::Mat( rows, cols, CV_32FC1, &xbuf_[0] );
-            y_ = cv::Mat( rows, cols, CV_32FC1, &ybuf_[0] );
+        bool fixed_;
+        std::string cache_;
+        struct maps_type_
+        {
+            boost::mutex mutex;
+            cv::Mat x;
+            cv::Mat y;
+        };
+        boost::shared_ptr< maps_type_ > maps_; // shared between copies of the filter, loaded once
+        filter_outputs_::ptr outputs_;
+        const maps_type_& init_maps_( unsigned int rows, unsigned int cols )
+        {
+            boost::mutex::scoped_lock lock( maps_->mutex );
+            if( !maps_->x.empty() ) { return *maps_; }
+            cv::Mat x;
+            cv::Mat y;
+            bool cached = !cache_.empty() && newer_( cache_, filename_ ) && load_( cache_, rows, cols, x, y, false ) && x.type() == CV_16SC2; // any failure to load cache, e.g. for another image size or truncated: regenerate it
+            if( !cached )
+            {
+                if( !load_( filename_, rows, cols, x, y ) ) { COMMA_THROW( comma::exception, "failed to open undistort map in \"" << filename_ << "\"" ); }
+                if( fixed_ && x.type() == CV_32FC1 )
+                {
+                    cv::Mat fx;
+                    cv::Mat fy;
+                    cv::convertMaps( x, y, fx, fy, CV_16SC2 );
+                    x = fx;
+                    y = fy;
+                    if( !cache_.empty() ) { save_( x, y ); }
+                }
+            }
+            maps_->x = x;
+            maps_->y = y;
+            return *maps_;
+        }
+        static bool newer_( const std::string& filename, const std::string& than )
+        {
+            struct stat s;
+            struct stat t;
+            return ::stat( filename.c_str(), &s ) == 0 && ::stat( than.c_str(), &t ) == 0 && s.st_mtime >= t.st_mtime;
+        }
+        static bool load_( const std::string& filename, unsigned int rows, unsigned int cols, cv::Mat& x, cv::Mat& y, bool strict = true ) // return false, if cannot open or, if not strict, on any error
+        {
+            std::ifstream stream( filename.c_str(), std::ios::binary );
+            if( !stream ) { return false; }
+            stream.seekg( 0, std::ios::end );
+            std::size_t size = stream.tellg();
+            stream.seekg( 0, std::ios::beg );
+            std::size_t pixels = std::size_t( rows ) * cols;
+            if( size == pixels * 8 ) { x = cv::Mat( rows, cols, CV_32FC1 ); y = cv::Mat( rows, cols, CV_32FC1 ); }
+            else if( size == pixels * 6 ) { x = cv::Mat( rows, cols, CV_16SC2 ); y = cv::Mat( rows, cols, CV_16UC1 ); }
+            else if( !strict ) { return false; }
+            else { COMMA_THROW( comma::exception, "expected " << ( pixels * 8 ) << " bytes (float maps) or " << ( pixels * 6 ) << " bytes (fixed-point maps) for image of " << cols << "x" << rows << " in \"" << filename << "\", got " << size ); }
+            stream.read( reinterpret_cast< char* >( x.data ), pixels * x.elemSize() );
+            stream.read( reinterpret_cast< char* >( y.data ), pixels * y.elemSize() );
+            if( stream ) { return true; }
+            if( !strict ) { return false; }
+            COMMA_THROW( comma::exception, "failed to read \"" << filename << "\"" );
+        }
+        void save_( const cv::Mat& x, const cv::Mat& y ) const // quick and dirty: write to temporary file and rename, since other processes may read the cache
+        {
+            std::string temporary = cache_ + ".tmp";
+            {
+                std::ofstream stream( temporary.c_str(), std::ios::binary );
+                if( !stream ) { COMMA_THROW( comma::exception, "failed to open \"" << temporary << "\" for writing" ); }
+                stream.write( reinterpret_cast< const char* >( x.data ), x.total() * x.elemSize() );
+                stream.write( reinterpret_cast< const char* >( y.data ), y.total() * y.elemSize() );
+                if( !stream ) { COMMA_THROW( comma::exception, "failed to write \"" << temporary << "\"" ); }
+            }
+            std::remove( cache_.c_str() ); // for windows, where rename does not replace
+            if( std::rename( temporary.c_str(), cache_.c_str() ) != 0 ) { COMMA_THROW( comma::exception, "failed to rename \"" << temporary << "\" to \"" << cache_ << "\"" ); }
         }
 };
 
-class max_impl_ // experimental, to debug
+/// per-pixel max or min over the sliding window of the last frames
+///
+/// the only state is the window; window() updates it in order of frames
+/// and takes a snapshot of it for the output frame, while the per-pixel
+/// work in operator() runs in parallel for several frames
+class max_impl_
 {
     public:
-        max_impl_( unsigned int size, bool is_max ) : size_( size ), is_max_( is_max ) {}
+        max_impl_( unsigned int size, bool is_max ) : size_( size ), is_max_( is_max ), outputs_( filter_outputs_::make() ) {}
 
-        filters::value_type operator()( filters::value_type m )
+        /// serial step: update window, prepare output frame
+        filters::value_type window( filters::value_type m )
+        {
+            if( m.second.empty() ) { return m; }
+            if( window_.size() == size_ ) { window_.pop_front(); }
+            if( owns_data_( m.second ) ) { window_.push_back( m.second ); } // no copy: the frame is not passed downstream and the reader will not reuse it while referenced
+            else { window_.push_back( outputs_->get( m.second.size(), m.second.type() ) ); m.second.copyTo( window_.back() ); } // e.g. camera buffer reused for every frame (gige) or memory-mapped log
+            filters::value_type n( m.first, outputs_->get( m.second.size(), m.second.type() ) );
+            boost::mutex::scoped_lock lock( mutex_ );
+            pending_[ n.second.data ].assign( window_.begin(), window_.end() ); // output frames are unique while in flight
+            return n;
+        }
+
+        /// parallel step: max or min over the window snapshot
+        filters::value_type operator()( filters::value_type n )
         {
-            if( deque_.size() == size_ ) { deque_.pop_front(); }
-            deque_.push_back( filters::value_type() );
-            m.second.copyTo( deque_.back().second );
-            filters::value_type s( m.first, cv::Mat( m.second.rows, m.second.cols, m.second.type() ) );
-            ::memset( m.second.datastart, 0, m.second.dataend - m.second.datastart );
-            static unsigned int count = 0;
-            for( unsigned int i = 0; i < deque_.size(); ++i )
+            if( n.second.empty() ) { return n; }
+            std::vector< cv::Mat > window;
+            {
+                boost::mutex::scoped_lock lock( mutex_ );
+                std::map< const unsigned char*, std::vector< cv::Mat > >::iterator it = pending_.find( n.second.data );
+                if( it == pending_.end() ) { COMMA_THROW( comma::exception, ( is_max_ ? "max" : "min" ) << ": no window for frame; serial_function of the filter must run before filter_function" ); }
+                window.swap( it->second );
+                pending_.erase( it );
+            }
+            window[0].copyTo( n.second );
+            for( std::size_t i = 1; i < window.size(); ++i )
             {
-                unsigned char* p = deque_[i].second.datastart;
-                for( unsigned char* q = s.second.datastart; q < s.second.dataend; *q = is_max_ ? std::max( *p, *q ) : std::min( *p, *q ), ++p, ++q );
+                if( is_max_ ) { cv::max( n.second, window[i], n.second ); } else { cv::min( n.second, window[i], n.second ); }
             }
-            ++count;
-            return s;
+            return n;
         }
 
     private:
         unsigned int size_;
         bool is_max_;
-        std::deque< filters::value_type > deque_; // use vector?
+        static bool owns_data_( const cv::Mat& m ) // data allocated by opencv, i.e. refcounted, rather than wrapping someone else's buffer
+        {
+#if CV_MAJOR_VERSION < 3
+            return m.refcount != NULL;
+#else
+            return m.u != NULL;
+#endif
+        }
+        filter_outputs_::ptr outputs_;
+        std::deque< cv::Mat > window_;
+        boost::mutex mutex_;
+        std::map< const unsigned char*, std::vector< cv::Mat > > pending_; // window snapshots by output frame
 };
 
+static filter max_filter_( unsigned int size, bool is_max )
+{
+    boost::shared_ptr< max_impl_ > m( new max_impl_( size, is_max ) );
+    filter f( boost::bind( &max_impl_::operator(), m, _1 ) );
+    f.serial_function = boost::bind( &max_impl_::window, m, _1 );
+    return f;
+}
+
+/// geometric filter: crop, crop-tile, flip, flop, transpose, or resize, as a map of pixel coordinates
+struct geometry_
+{
+    enum kinds { crop, crop_tile, flip, flop, transpose, resize };
+    kinds kind;
+    unsigned int x, y, w, h; // crop, crop-tile
+    unsigned int width, height; // resize in pixels
+    double fw, fh; // resize as fraction
+
+    geometry_( kinds kind, unsigned int x = 0, unsigned int y = 0, unsigned int w = 0, unsigned int h = 0 ) : kind( kind ), x( x ), y( y ), w( w ), h( h ), width( 0 ), height( 0 ), fw( 0 ), fh( 0 ) {}
+
+    geometry_( unsigned int width, unsigned int height, double fw, double fh ) : kind( resize ), x( 0 ), y( 0 ), w( 0 ), h( 0 ), width( width ), height( height ), fw( fw ), fh( fh ) {}
+
+    /// output size for given input size, same as of the unfused filter
+    cv::Size output( const cv::Size& input ) const
+    {
+        switch( kind )
+        {
+            case crop: return cv::Size( w, h );
+            case crop_tile: return cv::Size( input.width / w, input.height / h );
+            case flip: case flop: return input;
+            case transpose: return cv::Size( input.height, input.width );
+            case resize: return cv::Size( width ? width : input.width * fw, height ? height : input.height * fh );
+        }
+        return input;
+    }
+
+    /// homogeneous map from output pixel coordinates to input pixel coordinates
+    Eigen::Matrix3d map( const cv::Size& input, const cv::Size& output ) const
+    {
+        Eigen::Matrix3d m = Eigen::Matrix3d::Identity();
+        switch( kind )
+        {
+            case crop:
+                if( x + w > ( unsigned int )( input.width ) || y + h > ( unsigned int )( input.height ) ) { COMMA_THROW( comma::exception, "crop " << x << "," << y << "," << w << "," << h << " out of image of size " << input.width << "," << input.height ); }
+                m( 0, 2 ) = x;
+                m( 1, 2 ) = y;
+                break;
+            case crop_tile:
+                m( 0, 2 ) = x * output.width;
+                m( 1, 2 ) = y * output.height;
+                break;
+            case flip:
+                m( 1, 1 ) = -1;
+                m( 1, 2 ) = input.height - 1;
+                break;
+            case flop:
+                m( 0, 0 ) = -1;
+                m( 0, 2 ) = input.width - 1;
+                break;
+            case transpose:
+                m( 0, 0 ) = m( 1, 1 ) = 0;
+                m( 0, 1 ) = m( 1, 0 ) = 1;
+                break;
+            case resize: // same pixel centre alignment as cv::resize
+                m( 0, 0 ) = double( input.width ) / output.width;
+                m( 1, 1 ) = double( input.height ) / output.height;
+                m( 0, 2 ) = m( 0, 0 ) * 0.5 - 0.5;
+                m( 1, 2 ) = m( 1, 1 ) * 0.5 - 0.5;
+                break;
+        }
+        return m;
+    }
+};
+
+/// run of geometric filters fused into a single pass: a single crop, if all
+/// of them are crops, otherwise a single cv::remap with the map composed
+/// from the maps of the filters; maps are cached per input size
+///
+/// the map of crops, flips and transposes is integer, thus nearest neighbour
+/// interpolation gives the same output as the unfused filters; with resize,
+/// output matches cv::resize within the interpolation tolerance
+class geometric_impl_
+{
+    public:
+        geometric_impl_( const std::vector< geometry_ >& geometries ) : geometries_( geometries ), cache_( new cache_type_ ), outputs_( filter_outputs_::make() ) {}
+
+        filters::value_type operator()( filters::value_type m )
+        {
+            const maps_& maps = maps_of_( m.second.size() );
+            if( maps.crop ) { return filters::value_type( m.first, cv::Mat( m.second, maps.roi ) ); }
+            filters::value_type n( m.first, outputs_->get( maps.size, m.second.type() ) );
+            cv::remap( m.second, n.second, maps.x, maps.y, maps.nearest ? cv::INTER_NEAREST : cv::INTER_LINEAR, cv::BORDER_REPLICATE );
+            return n;
+        }
+
+    private:
+        struct maps_
+        {
+            cv::Size size;
+            bool crop;
+            bool nearest;
+            cv::Rect roi;
+            cv::Mat x; // fixed-point maps for faster remap
+            cv::Mat y;
+        };
+        struct cache_type_
+        {
+            boost::mutex mutex;
+            std::map< std::pair< int, int >, maps_ > maps;
+        };
+        std::vector< geometry_ > geometries_;
+        boost::shared_ptr< cache_type_ > cache_; // shared between copies of the filter
+        filter_outputs_::ptr outputs_;
+
+        const maps_& maps_of_( const cv::Size& input )
+        {
+            boost::mutex::scoped_lock lock( cache_->mutex );
+            std::map< std::pair< int, int >, maps_ >::iterator it = cache_->maps.find( std::make_pair( input.width, input.height ) );
+            if( it != cache_->maps.end() ) { return it->second; } // maps never change, once made
+            maps_ maps;
+            Eigen::Matrix3d map = Eigen::Matrix3d::Identity();
+            cv::Size size = input;
+            maps.crop = true;
+            for( std::size_t i = 0; i < geometries_.size(); ++i )
+            {
+                cv::Size output = geometries_[i].output( size );
+                if( output.width <= 0 || output.height <= 0 ) { COMMA_THROW( comma::exception, "got empty output image for input of size " << input.width << "," << input.height ); }
+                map = map * geometries_[i].map( size, output );
+                maps.crop = maps.crop && ( geometries_[i].kind == geometry_::crop || geometries_[i].kind == geometry_::crop_tile );
+                size = output;
+            }
+            maps.size = size;
+            if( maps.crop ) { maps.roi = cv::Rect( map( 0, 2 ), map( 1, 2 ), size.width, size.height ); }
+            else { make_remap_( map, maps ); }
+            return cache_->maps.insert( std::make_pair( std::make_pair( input.width, input.height ), maps ) ).first->second;
+        }
+
+        static void make_remap_( const Eigen::Matrix3d& map, maps_& maps )
+        {
+            const cv::Size& size = maps.size;
+            maps.nearest = true;
+            for( unsigned int i = 0; i < 2; ++i ) { for( unsigned int j = 0; j < 3; ++j ) { maps.nearest = maps.nearest && std::fabs( map( i, j ) - std::floor( map( i, j ) + 0.5 ) ) < 1e-9; } }
+            cv::Mat x( size, CV_32FC1 );
+            cv::Mat y( size, CV_32FC1 );
+            for( int r = 0; r < size.height; ++r )
+            {
+                float* px = x.ptr< float >( r );
+                float* py = y.ptr< float >( r );
+                for( int c = 0; c < size.width; ++c )
+                {
+                    px[c] = map( 0, 0 ) * c + map( 0, 1 ) * r + map( 0, 2 );
+                    py[c] = map( 1, 0 ) * c + map( 1, 1 ) * r + map( 1, 2 );
+                }
+            }
+            cv::convertMaps( x, y, maps.x, maps.y, CV_16SC2, maps.nearest );
+        }
+};
+
+/// replace runs of two or more geometric filters with a fused filter
+static std::vector< filter > fuse_( const std::vector< filter >& f, const std::vector< boost::optional< geometry_ > >& geometries )
+{
+    std::vector< filter > fused;
+    for( std::size_t i = 0; i < f.size(); )
+    {
+        std::size_t end = i;
+        for( ; end < f.size() && geometries[end]; ++end );
+        if( end - i < 2 ) { fused.push_back( f[i++] ); continue; }
+        std::vector< geometry_ > g;
+        bool crop = true;
+        for( ; i < end; ++i ) { g.push_back( *geometries[i] ); crop = crop && ( g.back().kind == geometry_::crop || g.back().kind == geometry_::crop_tile ); }
+        fused.push_back( filter( geometric_impl_( g ), true, crop ) );
+    }
+    return fused;
+}
+
 std::vector< filter > filters::make( const std::string& how, unsigned int default_delay )
 {
     std::vector< std::string > v = comma::split( how, ';' );
     std::vector< filter > f;
+    std::vector< boost::optional< geometry_ > > geometries; // geometric filters to fuse
     if( how == "" ) { return f; }
     std::string name;
     bool modified = false;
@@ -284,7 +637,7 @@ std::vector< filter > filters::make( const std::string& how, unsigned int defaul
         {
             if( modified ) { COMMA_THROW( comma::exception, "cannot covert from bayer after transforms: " << name ); }
             unsigned int which = boost::lexical_cast< unsigned int >( e[1] );
-            f.push_back( filter( boost::bind( &cvt_color_impl_, _1, which ) ) );
+            f.push_back( filter( boost::bind( &cvt_color_impl_, _1, which, filter_outputs_::make() ) ) );
         }
         else if( e[0] == "crop" )
         {
@@ -307,7 +660,9 @@ std::vector< filter > filters::make( const std::string& how, unsigned int defaul
                 default:
                     COMMA_THROW( comma::exception, "expected crop=[x,y,]width,height, got \"" << v[i] << "\"" );
             }
-            f.push_back( filter( boost::bind( &crop_impl_, _1, x, y, w, h ) ) );
+            f.push_back( filter( boost::bind( &crop_impl_, _1, x, y, w, h ), true, true ) );
+            geometries.resize( f.size() );
+            geometries.back() = geometry_( geometry_::crop, x, y, w, h );
         }
         else if( e[0] == "crop-tile" )
         {
@@ -317,7 +672,9 @@ std::vector< filter > filters::make( const std::string& how, unsigned int defaul
             y = boost::lexical_cast< unsigned int >( s[1] );
             w = boost::lexical_cast< unsigned int >( s[2] );
             h = boost::lexical_cast< unsigned int >( s[3] );
-            f.push_back( filter( boost::bind( &crop_tile_impl_, _1, x, y, w, h ) ) );
+            f.push_back( filter( boost::bind( &crop_tile_impl_, _1, x, y, w, h ), true, true ) );
+            geometries.resize( f.size() );
+            geometries.back() = geometry_( geometry_::crop_tile, x, y, w, h );
         }
         else if( e[0] == "cross" )
         {
@@ -330,15 +687,19 @@ std::vector< filter > filters::make( const std::string& how, unsigned int defaul
                 center->x() = boost::lexical_cast< unsigned int >( s[0] );
                 center->y() = boost::lexical_cast< unsigned int >( s[1] );
             }
-            f.push_back( filter( boost::bind( &cross_impl_, _1, center ) ) );
+            f.push_back( filter( boost::bind( &cross_impl_, _1, center ), true, true ) );
         }
         else if( e[0] == "flip" )
         {
-            f.push_back( filter( boost::bind( &flip_impl_, _1, 0 ) ) );
+            f.push_back( filter( boost::bind( &flip_impl_, _1, 0, filter_outputs_::make() ) ) );
+            geometries.resize( f.size() );
+            geometries.back() = geometry_( geometry_::flip );
         }
         else if( e[0] == "flop" )
         {
-            f.push_back( filter( boost::bind( &flip_impl_, _1, 1 ) ) );
+            f.push_back( filter( boost::bind( &flip_impl_, _1, 1, filter_outputs_::make() ) ) );
+            geometries.resize( f.size() );
+            geometries.back() = geometry_( geometry_::flop );
         }
         else if( e[0] == "text" )
         {
@@ -357,7 +718,7 @@ std::vector< filter > filters::make( const std::string& how, unsigned int defaul
                 else if( w[3] == "yellow" ) { s = cv::Scalar( 0, 255, 255 ); }
                 else { COMMA_THROW( comma::exception, "expected colour of text in \"" << v[i] << "\", got '" << w[3] << "'" ); }
             }
-            f.push_back( filter( boost::bind( &text_impl_, _1, w[0], p, s ) ) );
+            f.push_back( filter( boost::bind( &text_impl_, _1, w[0], p, s ), true, true ) );
         }
         else if( e[0] == "resize" )
         {
@@ -380,40 +741,72 @@ std::vector< filter > filters::make( const std::string& how, unsigned int defaul
                 default:
                     COMMA_THROW( comma::exception, "expected resize=<width>,<height>, got: \"" << e[1] << "\"" );
             }
-            f.push_back( filter( boost::bind( &resize_impl_, _1, width, height, w, h ) ) );
+            f.push_back( filter( boost::bind( &resize_impl_, _1, width, height, w, h, filter_outputs_::make() ) ) );
+            geometries.resize( f.size() );
+            geometries.back() = geometry_( width, height, w, h );
         }
-        else if( e[0] == "max" ) // todo: remove this filter; not thread-safe, should be run with --threads=1
+        else if( e[0] == "max" )
         {
-            f.push_back( filter( max_impl_( boost::lexical_cast< unsigned int >( e[1] ), true ), false ) );
+            f.push_back( max_filter_( boost::lexical_cast< unsigned int >( e[1] ), true ) );
         }
-        else if( e[0] == "min" ) // todo: remove this filter; not thread-safe, should be run with --threads=1
+        else if( e[0] == "min" )
         {
-            f.push_back( filter( max_impl_( boost::lexical_cast< unsigned int >( e[1] ), false ), false ) );
+            f.push_back( max_filter_( boost::lexical_cast< unsigned int >( e[1] ), false ) );
         }
         else if( e[0] == "timestamp" )
         {
-            f.push_back( filter( &timestamp_impl_ ) );
+            f.push_back( filter( &timestamp_impl_, true, true ) );
         }
         else if( e[0] == "transpose" )
         {
-            f.push_back( filter( &transpose_impl_ ) );
+            f.push_back( filter( boost::bind( &transpose_impl_, _1, filter_outputs_::make() ) ) );
+            geometries.resize( f.size() );
+            geometries.back() = geometry_( geometry_::transpose );
         }
         else if( e[0] == "split" )
         {
-            f.push_back( filter( &split_impl_ ) );
+            f.push_back( filter( boost::bind( &split_impl_, _1, filter_outputs_::make() ) ) );
         }
         else if( e[0] == "undistort" )
         {
-            f.push_back( filter( undistort_impl_( e[1] ) ) );
+            std::vector< std::string > w = e.size() > 1 ? comma::split( e[1], ',' ) : std::vector< std::string >();
+            if( w.empty() || w[0].empty() || w.size() > 3 || ( w.size() > 1 && w[1] != "fixed" ) ) { COMMA_THROW( comma::exception, "expected undistort=<map file>[,fixed[,<cache file>]], got: \"" << v[i] << "\"" ); }
+            f.push_back( filter( undistort_impl_( w[0], w.size() > 1, w.size() > 2 ? w[2] : std::string() ) ) );
         }
         else if( e[0] == "invert" )
         {
-            f.push_back( filter( &invert_impl_ ) );
+            f.push_back( filter( &invert_impl_, true, true ) );
+        }
+        else if( e[0] == "linear" )
+        {
+            std::vector< std::string > w = e.size() > 1 ? comma::split( e[1], ',' ) : std::vector< std::string >();
+            if( w.size() != 2 ) { COMMA_THROW( comma::exception, "expected linear=<scale>,<offset>, got: \"" << v[i] << "\"" ); }
+            double scale = boost::lexical_cast< double >( w[0] );
+            double offset = boost::lexical_cast< double >( w[1] );
+            f.push_back( filter( pixel_impl_( "linear", boost::bind( &linear_table_, _1, scale, offset ), boost::bind( &kernels::linear, _1, scale, offset ) ), true, true ) );
+        }
+        else if( e[0] == "threshold" )
+        {
+            std::vector< std::string > w = e.size() > 1 ? comma::split( e[1], ',' ) : std::vector< std::string >();
+            if( w.empty() || w.size() > 2 ) { COMMA_THROW( comma::exception, "expected threshold=<threshold>[,<max>], got: \"" << v[i] << "\"" ); }
+            double threshold = boost::lexical_cast< double >( w[0] );
+            boost::optional< double > max;
+            if( w.size() > 1 ) { max = boost::lexical_cast< double >( w[1] ); }
+            f.push_back( filter( pixel_impl_( "threshold", boost::bind( &threshold_table_, _1, threshold, max ), boost::bind( &threshold_kernel_, _1, threshold, max ) ), true, true ) );
+        }
+        else if( e[0] == "lut" )
+        {
+            if( e.size() < 2 ) { COMMA_THROW( comma::exception, "expected lut=<filename>" ); }
+            std::ifstream ifs( e[1].c_str(), std::ios::binary );
+            if( !ifs.is_open() ) { COMMA_THROW( comma::exception, "lut: failed to open \"" << e[1] << "\"" ); }
+            boost::shared_ptr< std::vector< char > > bytes( new std::vector< char >( ( std::istreambuf_iterator< char >( ifs ) ), std::istreambuf_iterator< char >() ) );
+            if( bytes->size() != 256 && bytes->size() != 65536 * 2 ) { COMMA_THROW( comma::exception, "lut: expected 256 entries of 8-bit or 65536 entries of 16-bit values in \"" << e[1] << "\", got " << bytes->size() << " bytes" ); }
+            f.push_back( filter( pixel_impl_( "lut", boost::bind( &lut_table_, _1, e[1], bytes ) ), true, true ) );
         }
         else if( e[0] == "view" )
         {
             unsigned int delay = e.size() == 1 ? default_delay : boost::lexical_cast< unsigned int >( e[1] );
-            f.push_back( filter( boost::bind( &view_impl_, _1, name, delay ), false ) );
+            f.push_back( filter( boost::bind( &view_impl_, _1, name, delay ), false, true ) );
         }
         else if( e[0] == "thumb" )
         {
@@ -425,7 +818,7 @@ std::vector< filter > filters::make( const std::string& how, unsigned int defaul
                 if( v.size() >= 1 ) { cols = boost::lexical_cast< unsigned int >( v[0] ); }
                 if( v.size() >= 2 ) { delay = boost::lexical_cast< unsigned int >( v[1] ); }
             }   
-            f.push_back( filter( boost::bind( &thumb_impl_, _1, name, cols, delay ), false ) );
+            f.push_back( filter( boost::bind( &thumb_impl_, _1, name, cols, delay ), false, true ) );
         }
         else if( e[0] == "encode" )
         {
@@ -438,7 +831,7 @@ std::vector< filter > filters::make( const std::string& how, unsigned int defaul
         {
             if( e.size() < 2 ) { COMMA_THROW( comma::exception, "expected file type like jpg, ppm, etc" ); }
             std::string s = e[1];
-            f.push_back( filter( boost::bind( &file_impl_, _1, s ) ) );
+            f.push_back( filter( boost::bind( &file_impl_, _1, s ), true, true ) );
         }
         else if( e[0] == "null" )
         {
@@ -452,12 +845,17 @@ std::vector< filter > filters::make( const std::string& how, unsigned int defaul
         }
         modified = ( v[i] != "view" && v[i] != "thumb" && v[i] != "split" );
     }
-    return f;
+    geometries.resize( f.size() );
+    return fuse_( f, geometries );
 }
 
 filters::value_type filters::apply( std::vector< filter >& filters, filters::value_type m )
 {
-    for( std::size_t i = 0; i < filters.size(); m = filters[ i++ ].filter_function( m ) );
+    for( std::size_t i = 0; i < filters.size(); ++i )
+    {
+        if( filters[i].serial_function ) { m = filters[i].serial_function( m ); }
+        m = filters[i].filter_function( m );
+    }
     return m;
 }
 
@@ -471,7 +869,12 @@ static std::string usage_impl_()
     oss << "        cross[=<x>,<y>]: draw cross-hair at x,y; default: at image center" << std::endl;
     oss << "        flip: flip vertically" << std::endl;
     oss << "        flop: flip horizontally" << std::endl;
-    oss << "        invert: invert image (to negative)" << std::endl;
+    oss << "        invert: invert image (to negative); integer types: bitwise not, i.e. max - value for unsigned; floating point: 1 - value" << std::endl;
+    oss << "        linear=<scale>,<offset>: value * scale + offset, rounded and saturated for integer types" << std::endl;
+    oss << "        lut=<filename>: look up pixel values in table: binary file of 256 8-bit or 65536 16-bit values, same type as image;" << std::endl;
+    oss << "                        for signed types, entry i is for value i - 128 or i - 32768, respectively" << std::endl;
+    oss << "        max=<n>: per-pixel maximum over the last n frames" << std::endl;
+    oss << "        min=<n>: per-pixel minimum over the last n frames" << std::endl;
     oss << "        split: split r,g,b channels into a 3x1 gray image" << std::endl;
     oss << "        text=<text>[,x,y][,colour]: print text; default x,y: 10,10; default colour: yellow" << std::endl;
     oss << "        null: same as linux /dev/null (since windows does not have it)" << std::endl;
@@ -486,12 +889,19 @@ static std::string usage_impl_()
     oss << "                                          <cols>: image width in pixels; default: 100" << std::endl;
     oss << "                                          <wait-interval>: a hack for now; milliseconds to wait for image display and key press; default: 1" << std::endl;
     oss << "        timestamp: write timestamp on images" << std::endl;
+    oss << "        threshold=<threshold>[,<max>]: value > threshold ? max : 0; default max: max of image type, 1 for floating point" << std::endl;
     oss << "        transpose: transpose the image (swap rows and columns)" << std::endl;
-    oss << "        undistort=<map file>: undistort" << std::endl;
+    oss << "        undistort=<map file>[,fixed[,<cache file>]]: undistort" << std::endl;
+    oss << "            <map file>: float or fixed-point maps, as output by image-undistort-map" << std::endl;
+    oss << "            fixed: convert float maps to fixed point on load: faster, with interpolation error within 1/32 of pixel" << std::endl;
+    oss << "            <cache file>: load fixed-point maps from <cache file>, if it is newer than <map file>; otherwise, convert and save them there" << std::endl;
     oss << "        view[=<wait-interval>]: view image; press <space> to save image (timestamp or system time as filename); <esc>: to close" << std::endl;
     oss << "                                <wait-interval>: a hack for now; milliseconds to wait for image display and key press; default 1" << std::endl;
     oss << "        encode=<format>: encode images to the specified format. <format>: jpg|ppm|png|tiff..., make sure to use --no-header" << std::endl;
     oss << "        file=<format>: write images to files with timestamp as name in the specified format. <format>: jpg|ppm|png|tiff...; if no timestamp, system time used" << std::endl;
+    oss << std::endl;
+    oss << "    runs of geometric filters (crop, crop-tile, flip, flop, transpose, resize) are fused into a single pass over the image;" << std::endl;
+    oss << "    output is the same as of the filters one by one, except for interpolation differences, if resize is in the run" << std::endl;
     return oss.str();
 }
 
@@ -45,9 +45,11 @@ namespace snark{ namespace cv_mat {
 struct filter
 {
     typedef std::pair< boost::posix_time::ptime, cv::Mat > value_type;
-    filter( boost::function< value_type( value_type ) > f, bool p = true ): filter_function( f ), parallel( p ) {}
+    filter( boost::function< value_type( value_type ) > f, bool p = true, bool i = false ): filter_function( f ), parallel( p ), in_place( i ) {}
     boost::function< value_type( value_type ) > filter_function;
     bool parallel;
+    bool in_place; /// filter returns its input (or a part of it, e.g. crop), possibly modified, i.e. the frame stays in the same memory
+    boost::function< value_type( value_type ) > serial_function; /// if not empty, run in order before filter_function, e.g. to update the state of a stateful filter
 };
 
 /// filter pipeline helpers
@@ -0,0 +1,67 @@
+// This file is part of snark, a generic and flexible library for robotics research
+// Copyright (c) 2011 The University of Sydney
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. All advertising materials mentioning features or use of this software
+//    must display the following acknowledgement:
+//    This product includes software developed by the The University of Sydney.
+// 4. Neither the name of the The University of Sydney nor the
+//    names of its contributors may be used to endorse or promote products
+//    derived from this software without specific prior written permission.
+//
+// NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+// GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+// HOLDERS AND CONTRIBUTORS \"AS IS\" AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+// OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+// IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+
+#include "./frame_pool.h"
+
+namespace snark{ namespace cv_mat {
+
+static bool released_( const cv::Mat& m ) // quick and dirty: only the pool refers to the data
+{
+#if CV_MAJOR_VERSION < 3
+    return m.refcount && CV_XADD( m.refcount, 0 ) == 1;
+#else
+    return m.u && CV_XADD( &m.u->refcount, 0 ) == 1;
+#endif
+}
+
+frame_pool::frame_pool( unsigned int capacity ) : capacity_( capacity ), hits_( 0 ), misses_( 0 ) { frames_.reserve( capacity ); }
+
+cv::Mat frame_pool::get( int rows, int cols, int type )
+{
+    for( std::size_t i = 0; i < frames_.size(); ++i )
+    {
+        if( frames_[i].rows == rows && frames_[i].cols == cols && frames_[i].type() == type && released_( frames_[i] ) ) { ++hits_; return frames_[i]; }
+    }
+    ++misses_;
+    cv::Mat m( rows, cols, type );
+    if( capacity_ == 0 ) { return m; }
+    if( frames_.size() < capacity_ ) { frames_.push_back( m ); return m; }
+    for( std::size_t i = 0; i < frames_.size(); ++i ) // evict a released frame of different size, e.g. if image size changed
+    {
+        if( released_( frames_[i] ) ) { frames_[i] = m; return m; }
+    }
+    return m; // all pooled frames in use: not pooled
+}
+
+} }  // namespace snark{ namespace cv_mat {
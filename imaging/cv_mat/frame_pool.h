@@ -0,0 +1,87 @@
+// This file is part of snark, a generic and flexible library for robotics research
+// Copyright (c) 2011 The University of Sydney
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. All advertising materials mentioning features or use of this software
+//    must display the following acknowledgement:
+//    This product includes software developed by the The University of Sydney.
+// 4. Neither the name of the The University of Sydney nor the
+//    names of its contributors may be used to endorse or promote products
+//    derived from this software without specific prior written permission.
+//
+// NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+// GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+// HOLDERS AND CONTRIBUTORS \"AS IS\" AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+// OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+// IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+
+#ifndef SNARK_IMAGING_CVMAT_FRAME_POOL_H_
+#define SNARK_IMAGING_CVMAT_FRAME_POOL_H_
+
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include <comma/base/types.h>
+
+namespace snark{ namespace cv_mat {
+
+/// bounded pool of frames to recycle, keyed by rows, columns and type
+///
+/// a frame handed out by get() goes back to the pool, once all its
+/// users downstream (e.g. pipeline filters and output) release it, i.e.
+/// when the pool holds the only reference to its data
+///
+/// get() should be called from a single thread (e.g. reader thread),
+/// while frames can be released from any thread
+class frame_pool
+{
+    public:
+        /// constructor
+        /// @param capacity max number of pooled frames, 0: no pooling
+        frame_pool( unsigned int capacity = 0 );
+
+        /// return a released pooled frame of given size and type or allocate a new one
+        /// @note frame contents are undefined
+        cv::Mat get( int rows, int cols, int type );
+
+        /// max number of pooled frames
+        unsigned int capacity() const { return capacity_; }
+
+        /// current number of pooled frames
+        std::size_t size() const { return frames_.size(); }
+
+        /// number of get() calls served from the pool
+        comma::uint64 hits() const { return hits_; }
+
+        /// number of get() calls that allocated a frame
+        comma::uint64 misses() const { return misses_; }
+
+        /// release all the pooled frames
+        void clear() { frames_.clear(); }
+
+    private:
+        unsigned int capacity_;
+        std::vector< cv::Mat > frames_;
+        comma::uint64 hits_;
+        comma::uint64 misses_;
+};
+
+} }  // namespace snark{ namespace cv_mat {
+
+#endif // SNARK_IMAGING_CVMAT_FRAME_POOL_H_
@@ -0,0 +1,224 @@
+// This file is part of snark, a generic and flexible library for robotics research
+// Copyright (c) 2011 The University of Sydney
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. All advertising materials mentioning features or use of this software
+//    must display the following acknowledgement:
+//    This product includes software developed by the The University of Sydney.
+// 4. Neither the name of the The University of Sydney nor the
+//    names of its contributors may be used to endorse or promote products
+//    derived from this software without specific prior written permission.
+//
+// NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+// GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+// HOLDERS AND CONTRIBUTORS \"AS IS\" AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+// OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+// IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+
+#include <comma/base/exception.h>
+#include "./kernels.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __i386__ ) ) && ( __GNUC__ > 4 || ( __GNUC__ == 4 && __GNUC_MINOR__ >= 9 ) || defined( __clang__ ) )
+#define SNARK_CV_MAT_KERNELS_AVX2
+#include <immintrin.h>
+#endif
+
+namespace snark{ namespace cv_mat { namespace kernels {
+
+#ifdef SNARK_CV_MAT_KERNELS_AVX2
+static bool has_avx2_() { static const bool b = __builtin_cpu_supports( "avx2" ); return b; }
+#endif
+
+/// apply f( pointer to elements, number of elements ) to the image, row by row or all at once, if continuous
+template < typename T, typename F > static void for_each_row_( cv::Mat& m, F f )
+{
+    std::size_t size = std::size_t( m.cols ) * m.channels();
+    if( m.isContinuous() ) { f( m.ptr< T >(), size * m.rows ); return; }
+    for( int r = 0; r < m.rows; ++r ) { f( m.ptr< T >( r ), size ); }
+}
+
+#ifdef SNARK_CV_MAT_KERNELS_AVX2
+__attribute__(( target( "avx2" ) )) static std::size_t invert_avx2_( unsigned char* p, std::size_t size )
+{
+    const __m256i ones = _mm256_set1_epi8( -1 );
+    std::size_t i = 0;
+    for( ; i + 32 <= size; i += 32 ) { _mm256_storeu_si256( reinterpret_cast< __m256i* >( p + i ), _mm256_xor_si256( _mm256_loadu_si256( reinterpret_cast< const __m256i* >( p + i ) ), ones ) ); }
+    return i;
+}
+
+__attribute__(( target( "avx2" ) )) static std::size_t linear_avx2_( float* p, std::size_t size, float scale, float offset )
+{
+    const __m256 s = _mm256_set1_ps( scale );
+    const __m256 o = _mm256_set1_ps( offset );
+    std::size_t i = 0;
+    for( ; i + 8 <= size; i += 8 ) { _mm256_storeu_ps( p + i, _mm256_add_ps( _mm256_mul_ps( _mm256_loadu_ps( p + i ), s ), o ) ); }
+    return i;
+}
+#endif
+
+static void invert_bytes_( unsigned char* p, std::size_t size )
+{
+    std::size_t i = 0;
+    #ifdef SNARK_CV_MAT_KERNELS_AVX2
+    if( has_avx2_() ) { i = invert_avx2_( p, size ); }
+    #endif
+    #ifdef __SSE2__
+    const __m128i ones = _mm_set1_epi8( -1 );
+    for( ; i + 16 <= size; i += 16 ) { _mm_storeu_si128( reinterpret_cast< __m128i* >( p + i ), _mm_xor_si128( _mm_loadu_si128( reinterpret_cast< const __m128i* >( p + i ) ), ones ) ); }
+    #endif
+    for( ; i < size; ++i ) { p[i] = ~p[i]; }
+}
+
+static void linear_floats_( float* p, std::size_t size, float scale, float offset )
+{
+    std::size_t i = 0;
+    #ifdef SNARK_CV_MAT_KERNELS_AVX2
+    if( has_avx2_() ) { i = linear_avx2_( p, size, scale, offset ); }
+    #endif
+    #ifdef __SSE2__
+    const __m128 s = _mm_set1_ps( scale );
+    const __m128 o = _mm_set1_ps( offset );
+    for( ; i + 4 <= size; i += 4 ) { _mm_storeu_ps( p + i, _mm_add_ps( _mm_mul_ps( _mm_loadu_ps( p + i ), s ), o ) ); }
+    #endif
+    for( ; i < size; ++i ) { p[i] = p[i] * scale + offset; }
+}
+
+static void threshold_floats_( float* p, std::size_t size, float threshold, float max )
+{
+    std::size_t i = 0;
+    #ifdef __SSE2__
+    const __m128 t = _mm_set1_ps( threshold );
+    const __m128 m = _mm_set1_ps( max );
+    for( ; i + 4 <= size; i += 4 ) { _mm_storeu_ps( p + i, _mm_and_ps( _mm_cmpgt_ps( _mm_loadu_ps( p + i ), t ), m ) ); }
+    #endif
+    for( ; i < size; ++i ) { p[i] = p[i] > threshold ? max : 0; }
+}
+
+template < typename T > static void lut_( T* p, std::size_t size, const T* table, int min )
+{
+    const T* t = table - min;
+    std::size_t i = 0;
+    for( ; i + 4 <= size; i += 4 ) // unrolled: lookups are independent
+    {
+        T a = t[ p[i] ];
+        T b = t[ p[i + 1] ];
+        T c = t[ p[i + 2] ];
+        T d = t[ p[i + 3] ];
+        p[i] = a; p[i + 1] = b; p[i + 2] = c; p[i + 3] = d;
+    }
+    for( ; i < size; ++i ) { p[i] = t[ p[i] ]; }
+}
+
+template < typename T > static void linear_( T* p, std::size_t size, double scale, double offset ) { for( std::size_t i = 0; i < size; ++i ) { p[i] = cv::saturate_cast< T >( p[i] * scale + offset ); } }
+
+template < typename T > static void threshold_( T* p, std::size_t size, double threshold, T max ) { for( std::size_t i = 0; i < size; ++i ) { p[i] = p[i] > threshold ? max : T( 0 ); } }
+
+// quick and dirty binders, since no lambdas
+struct invert_bytes_binder_ { void operator()( unsigned char* p, std::size_t size ) const { invert_bytes_( p, size ); } };
+template < typename T > struct invert_floats_binder_ { void operator()( T* p, std::size_t size ) const { for( std::size_t i = 0; i < size; ++i ) { p[i] = 1 - p[i]; } } };
+template < typename T > struct lut_binder_ { const T* table; int min; void operator()( T* p, std::size_t size ) const { lut_( p, size, table, min ); } };
+template < typename T > struct linear_binder_ { double scale; double offset; void operator()( T* p, std::size_t size ) const { linear_( p, size, scale, offset ); } };
+struct linear_floats_binder_ { float scale; float offset; void operator()( float* p, std::size_t size ) const { linear_floats_( p, size, scale, offset ); } };
+template < typename T > struct threshold_binder_ { double threshold; T max; void operator()( T* p, std::size_t size ) const { threshold_( p, size, threshold, max ); } };
+struct threshold_floats_binder_ { float threshold; float max; void operator()( float* p, std::size_t size ) const { threshold_floats_( p, size, threshold, max ); } };
+
+double linear_transform::operator()( double x ) const { return x * scale + offset; }
+
+double threshold_transform::operator()( double x ) const { return x > threshold ? max : 0; }
+
+void invert( cv::Mat& m )
+{
+    switch( m.depth() )
+    {
+        case CV_8U: case CV_8S: case CV_16U: case CV_16S: case CV_32S: // bitwise not, byte by byte
+        {
+            std::size_t size = std::size_t( m.cols ) * m.elemSize();
+            if( m.isContinuous() ) { invert_bytes_( m.ptr(), size * m.rows ); return; }
+            for( int r = 0; r < m.rows; ++r ) { invert_bytes_( m.ptr( r ), size ); }
+            return;
+        }
+        case CV_32F: for_each_row_< float >( m, invert_floats_binder_< float >() ); return;
+        case CV_64F: for_each_row_< double >( m, invert_floats_binder_< double >() ); return;
+        default: COMMA_THROW( comma::exception, "invert: unsupported image type: " << m.type() );
+    }
+}
+
+template < typename T > static void apply_lut_( cv::Mat& m, const cv::Mat& table, int min, int size )
+{
+    if( table.total() != std::size_t( size ) || table.depth() != m.depth() || !table.isContinuous() ) { COMMA_THROW( comma::exception, "lut: expected table of " << size << " entries of type " << m.depth() << ", got " << table.total() << " entries of type " << table.depth() ); }
+    lut_binder_< T > b = { table.ptr< T >(), min };
+    for_each_row_< T >( m, b );
+}
+
+void lut( cv::Mat& m, const cv::Mat& table )
+{
+    switch( m.depth() )
+    {
+        case CV_8U: apply_lut_< unsigned char >( m, table, 0, 256 ); return;
+        case CV_8S: apply_lut_< signed char >( m, table, -128, 256 ); return;
+        case CV_16U: apply_lut_< unsigned short >( m, table, 0, 65536 ); return;
+        case CV_16S: apply_lut_< short >( m, table, -32768, 65536 ); return;
+        default: COMMA_THROW( comma::exception, "lut: expected image of 8-bit or 16-bit depth, got image type: " << m.type() );
+    }
+}
+
+void linear( cv::Mat& m, double scale, double offset )
+{
+    switch( m.depth() )
+    {
+        case CV_32F: { linear_floats_binder_ b = { float( scale ), float( offset ) }; for_each_row_< float >( m, b ); return; }
+        case CV_64F: { linear_binder_< double > b = { scale, offset }; for_each_row_< double >( m, b ); return; }
+        case CV_32S: { linear_binder_< int > b = { scale, offset }; for_each_row_< int >( m, b ); return; }
+        default: break;
+    }
+    linear_transform t = { scale, offset };
+    lut( m, make_lut( m.depth(), t ) );
+}
+
+void threshold( cv::Mat& m, double threshold, double max )
+{
+    switch( m.depth() )
+    {
+        case CV_32F: { threshold_floats_binder_ b = { float( threshold ), float( max ) }; for_each_row_< float >( m, b ); return; }
+        case CV_64F: { threshold_binder_< double > b = { threshold, max }; for_each_row_< double >( m, b ); return; }
+        case CV_32S: { threshold_binder_< int > b = { threshold, cv::saturate_cast< int >( max ) }; for_each_row_< int >( m, b ); return; }
+        default: break;
+    }
+    threshold_transform t = { threshold, max };
+    lut( m, make_lut( m.depth(), t ) );
+}
+
+double max_of( int depth )
+{
+    switch( depth )
+    {
+        case CV_8U: return 255;
+        case CV_8S: return 127;
+        case CV_16U: return 65535;
+        case CV_16S: return 32767;
+        case CV_32S: return 2147483647;
+        default: return 1;
+    }
+}
+
+} } }  // namespace snark{ namespace cv_mat { namespace kernels {
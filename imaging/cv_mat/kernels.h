@@ -0,0 +1,98 @@
+// This file is part of snark, a generic and flexible library for robotics research
+// Copyright (c) 2011 The University of Sydney
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. All advertising materials mentioning features or use of this software
+//    must display the following acknowledgement:
+//    This product includes software developed by the The University of Sydney.
+// 4. Neither the name of the The University of Sydney nor the
+//    names of its contributors may be used to endorse or promote products
+//    derived from this software without specific prior written permission.
+//
+// NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+// GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+// HOLDERS AND CONTRIBUTORS \"AS IS\" AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+// OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+// IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+
+#ifndef SNARK_IMAGING_CVMAT_KERNELS_H_
+#define SNARK_IMAGING_CVMAT_KERNELS_H_
+
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+namespace snark{ namespace cv_mat { namespace kernels {
+
+/// per-pixel kernels, in place, applied to all the channels, row by row (thus submatrices, e.g. after crop, are fine)
+///
+/// integer images of up to 16 bits are transformed through a lookup table
+/// (built on each call; to reuse tables, use make_lut() and lut()), the rest with simd where available;
+/// on x86, the widest of sse2 and avx2 supported by the cpu is chosen at run time
+
+/// invert: integer: bitwise not, i.e. max - value for unsigned types; float: 1 - value
+void invert( cv::Mat& m );
+
+/// apply lookup table of 256 (8-bit images) or 65536 (16-bit images) entries of the image depth;
+/// signed values are looked up at value - min, e.g. value + 128 for 8-bit
+void lut( cv::Mat& m, const cv::Mat& table );
+
+/// value * scale + offset, rounded and saturated for integer types
+void linear( cv::Mat& m, double scale, double offset );
+
+/// value > threshold ? max : 0
+void threshold( cv::Mat& m, double threshold, double max );
+
+/// transforms for make_lut, same as linear() and threshold()
+struct linear_transform { double scale; double offset; double operator()( double x ) const; };
+struct threshold_transform { double threshold; double max; double operator()( double x ) const; };
+
+/// return lookup table of given depth (8 or 16 bits) for a transform, rounded and saturated
+template < typename F > cv::Mat make_lut( int depth, F f );
+
+/// return max value of the depth: for unsigned and signed integers, max of the type, for floats, 1
+double max_of( int depth );
+
+} } }  // namespace snark{ namespace cv_mat { namespace kernels {
+
+namespace snark{ namespace cv_mat { namespace kernels {
+
+template < typename T, typename F > inline cv::Mat make_lut_( int type, int size, int min, F f )
+{
+    cv::Mat table( 1, size, type );
+    T* t = table.ptr< T >();
+    for( int i = 0; i < size; ++i ) { t[i] = cv::saturate_cast< T >( f( double( i + min ) ) ); }
+    return table;
+}
+
+template < typename F > inline cv::Mat make_lut( int depth, F f )
+{
+    switch( depth )
+    {
+        case CV_8U: return make_lut_< unsigned char >( CV_8UC1, 256, 0, f );
+        case CV_8S: return make_lut_< signed char >( CV_8SC1, 256, -128, f );
+        case CV_16U: return make_lut_< unsigned short >( CV_16UC1, 65536, 0, f );
+        case CV_16S: return make_lut_< short >( CV_16SC1, 65536, -32768, f );
+        default: return cv::Mat();
+    }
+}
+
+} } }  // namespace snark{ namespace cv_mat { namespace kernels {
+
+#endif // SNARK_IMAGING_CVMAT_KERNELS_H_
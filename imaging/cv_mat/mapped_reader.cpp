@@ -0,0 +1,104 @@
+// This file is part of snark, a generic and flexible library for robotics research
+// Copyright (c) 2011 The University of Sydney
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. All advertising materials mentioning features or use of this software
+//    must display the following acknowledgement:
+//    This product includes software developed by the The University of Sydney.
+// 4. Neither the name of the The University of Sydney nor the
+//    names of its contributors may be used to endorse or promote products
+//    derived from this software without specific prior written permission.
+//
+// NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+// GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+// HOLDERS AND CONTRIBUTORS \"AS IS\" AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+// OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+// IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+
+#include <algorithm>
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+#include <comma/base/exception.h>
+#include "./mapped_reader.h"
+
+namespace snark{ namespace cv_mat {
+
+static bool earlier_( const serialization::header& h, const boost::posix_time::ptime& t ) { return h.timestamp < t; }
+
+mapped_reader::mapped_reader( const std::string& filename, const serialization::options& options )
+    : mapping_( filename.c_str(), boost::interprocess::read_only )
+    , region_( mapping_, boost::interprocess::copy_on_write )
+    , serialization_( options )
+    , position_( 0 )
+    , released_( 0 )
+{
+    const char* begin = reinterpret_cast< const char* >( region_.get_address() );
+    std::size_t size = region_.get_size();
+    std::size_t header_size = serialization_.header_size();
+    for( std::size_t offset = 0; offset + header_size <= size; )
+    {
+        serialization::header h = serialization_.get_header( begin + offset );
+        std::size_t frame_size = header_size + std::size_t( h.rows ) * h.cols * CV_ELEM_SIZE( h.type );
+        if( frame_size == 0 ) { COMMA_THROW( comma::exception, "\"" << filename << "\": got empty frame at offset " << offset << "; wrong header fields?" ); }
+        if( offset + frame_size > size ) { break; } // incomplete last frame, e.g. file still being written
+        offsets_.push_back( offset );
+        headers_.push_back( h );
+        offset += frame_size;
+    }
+    region_.advise( boost::interprocess::mapped_region::advice_sequential );
+}
+
+mapped_reader::pair mapped_reader::operator[]( std::size_t i ) const
+{
+    const serialization::header& h = headers_[i];
+    char* data = reinterpret_cast< char* >( region_.get_address() ) + offsets_[i] + serialization_.header_size();
+    return std::make_pair( h.timestamp, cv::Mat( h.rows, h.cols, h.type, data ) );
+}
+
+std::size_t mapped_reader::find( const boost::posix_time::ptime& t ) const
+{
+    return std::lower_bound( headers_.begin(), headers_.end(), t, earlier_ ) - headers_.begin();
+}
+
+mapped_reader::pair mapped_reader::read()
+{
+    if( position_ >= offsets_.size() ) { return pair(); }
+    return operator[]( position_++ );
+}
+
+void mapped_reader::release( const void* data )
+{
+    #ifndef WIN32
+    char* begin = reinterpret_cast< char* >( region_.get_address() );
+    const char* p = reinterpret_cast< const char* >( data );
+    if( offsets_.empty() || p < begin || p >= begin + region_.get_size() ) { return; } // not ours
+    std::size_t i = std::upper_bound( offsets_.begin(), offsets_.end(), std::size_t( p - begin ) ) - offsets_.begin() - 1;
+    const serialization::header& h = headers_[i];
+    std::size_t end = offsets_[i] + serialization_.header_size() + std::size_t( h.rows ) * h.cols * CV_ELEM_SIZE( h.type );
+    std::size_t page_size = boost::interprocess::mapped_region::get_page_size();
+    end = end / page_size * page_size; // the last page may be shared with the next frame
+    if( end <= released_ ) { return; }
+    ::madvise( begin + released_, end - released_, MADV_DONTNEED ); // for private mapping, drops modified copies, too; pages would be read again from file, if accessed
+    released_ = end;
+    #endif
+}
+
+} }  // namespace snark{ namespace cv_mat {
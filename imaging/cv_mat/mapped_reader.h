@@ -0,0 +1,104 @@
+// This file is part of snark, a generic and flexible library for robotics research
+// Copyright (c) 2011 The University of Sydney
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. All advertising materials mentioning features or use of this software
+//    must display the following acknowledgement:
+//    This product includes software developed by the The University of Sydney.
+// 4. Neither the name of the The University of Sydney nor the
+//    names of its contributors may be used to endorse or promote products
+//    derived from this software without specific prior written permission.
+//
+// NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+// GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+// HOLDERS AND CONTRIBUTORS \"AS IS\" AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+// OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+// IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+
+#ifndef SNARK_IMAGING_CVMAT_MAPPED_READER_H_
+#define SNARK_IMAGING_CVMAT_MAPPED_READER_H_
+
+#include <string>
+#include <vector>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/noncopyable.hpp>
+#include <opencv2/core/core.hpp>
+#include <snark/imaging/cv_mat/serialization.h>
+
+namespace snark{ namespace cv_mat {
+
+/// memory-mapped reader of a file of images in serialization format (e.g. output of cv-cat)
+///
+/// on construction, walks the headers to build the index of frame offsets;
+/// frames are cv::Mat headers pointing straight into the mapping, i.e. no
+/// copying and no allocation; the mapping is copy-on-write, thus in-place
+/// filters work, but do not change the file
+///
+/// @note frames are valid only as long as the reader exists
+class mapped_reader : public boost::noncopyable
+{
+    public:
+        typedef std::pair< boost::posix_time::ptime, cv::Mat > pair;
+
+        /// constructor
+        mapped_reader( const std::string& filename, const serialization::options& options = serialization::options() );
+
+        /// number of frames
+        std::size_t size() const { return offsets_.size(); }
+
+        /// return frame by number
+        pair operator[]( std::size_t i ) const;
+
+        /// return number of the first frame not earlier than t, or size(), if none
+        /// @note timestamps should be non-decreasing
+        std::size_t find( const boost::posix_time::ptime& t ) const;
+
+        /// return next frame, or empty frame at the end
+        pair read();
+
+        /// set next frame to read by number
+        void seek( std::size_t i ) { position_ = i; }
+
+        /// set next frame to read by timestamp
+        void seek( const boost::posix_time::ptime& t ) { position_ = find( t ); }
+
+        /// number of the next frame to read
+        std::size_t position() const { return position_; }
+
+        /// release memory of the frames up to and including the one with given data, e.g. once it has been output;
+        /// the mapping is copy-on-write, thus the pages modified by in-place filters are private copies,
+        /// which otherwise would stay resident until the reader is destroyed; released frames must not be used any more
+        void release( const void* data );
+
+    private:
+        boost::interprocess::file_mapping mapping_;
+        boost::interprocess::mapped_region region_;
+        serialization serialization_;
+        std::vector< std::size_t > offsets_;
+        std::vector< serialization::header > headers_;
+        std::size_t position_;
+        std::size_t released_; /// bytes released from the beginning of the mapping
+};
+
+} }  // namespace snark{ namespace cv_mat {
+
+#endif // SNARK_IMAGING_CVMAT_MAPPED_READER_H_
@@ -31,12 +31,79 @@
 // IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
 #include <snark/imaging/cv_mat/pipeline.h>
 #include <tbb/tbb_thread.h>
 #include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <comma/base/exception.h>
 
 namespace snark{ namespace imaging { namespace applications {
 
+/// filters run in a single stage
+struct chain_
+{
+    std::vector< boost::function< pipeline::pair( pipeline::pair ) > > functions;
+    pipeline::pair operator()( pipeline::pair p ) const { for( std::size_t i = 0; i < functions.size(); ++i ) { p = functions[i]( p ); } return p; }
+};
+
+/// flow graph node body for a stage
+/// on exception, pass empty frame on to keep the sequence of frames complete and to stop the reader at output
+struct stage_
+{
+    chain_ chain;
+    boost::function< void( const std::string& ) > error;
+    boost::shared_ptr< pipeline::latency_histogram > latency;
+    pipeline::indexed operator()( pipeline::indexed p ) const
+    {
+        if( p.value.second.empty() ) { return p; }
+        boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+        try { p.value = chain( p.value ); }
+        catch( std::exception& ex ) { error( ex.what() ); p.value = pipeline::pair(); }
+        catch( ... ) { error( "unknown exception" ); p.value = pipeline::pair(); }
+        latency->add( boost::posix_time::microsec_clock::universal_time() - start );
+        return p;
+    }
+};
+
+struct sequence_ { std::size_t operator()( const pipeline::indexed& p ) const { return p.index; } };
+
+pipeline::latency_histogram::latency_histogram( const std::string& name ) : name_( name ), buckets_( 32, 0 ), count_( 0 ), sum_( 0 ), max_( 0 ) {}
+
+void pipeline::latency_histogram::add( const boost::posix_time::time_duration& d )
+{
+    boost::int64_t microseconds = std::max( d.total_microseconds(), boost::int64_t( 0 ) );
+    std::size_t i = 0;
+    for( boost::int64_t m = microseconds; m > 0 && i + 1 < buckets_.size(); m >>= 1, ++i );
+    boost::mutex::scoped_lock lock( mutex_ );
+    ++buckets_[i];
+    ++count_;
+    sum_ += microseconds;
+    if( microseconds > max_ ) { max_ = microseconds; }
+}
+
+double pipeline::latency_histogram::percentile_( double p ) const // quick and dirty: upper bound of the bucket
+{
+    std::size_t sum = 0;
+    for( std::size_t i = 0; i < buckets_.size(); ++i ) { sum += buckets_[i]; if( sum >= p * count_ ) { return double( boost::int64_t( 1 ) << i ); } }
+    return double( boost::int64_t( 1 ) << ( buckets_.size() - 1 ) );
+}
+
+std::string pipeline::latency_histogram::summary( bool reset )
+{
+    boost::mutex::scoped_lock lock( mutex_ );
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision( 3 ) << name_ << ": frames: " << count_;
+    if( count_ > 0 ) { oss << " mean: " << sum_ / count_ / 1000 << "ms p50: <" << percentile_( 0.5 ) / 1000 << "ms p90: <" << percentile_( 0.9 ) / 1000 << "ms p99: <" << percentile_( 0.99 ) / 1000 << "ms max: " << double( max_ ) / 1000 << "ms"; }
+    if( reset ) { std::fill( buckets_.begin(), buckets_.end(), 0 ); count_ = 0; sum_ = 0; max_ = 0; }
+    return oss.str();
+}
+
 /// constructor
 /// @param fields csv output fields
 /// @param format csv output format
@@ -50,7 +117,11 @@ pipeline::pipeline( cv_mat::serialization& output
     : m_output( output )
     , m_filters( snark::cv_mat::filters::make( filters ) )
     , m_reader( reader )
-    , m_pipeline( number_of_threads )
+    , m_threads( number_of_threads == 0 ? ::tbb::task_scheduler_init::default_num_threads() : number_of_threads )
+    , m_init( ::tbb::task_scheduler_init::default_num_threads() + 1 ) // the calling thread only feeds the graph and mostly blocks
+    , m_input( NULL )
+    , m_unreleased( NULL )
+    , m_period( boost::posix_time::not_a_date_time )
 {
     setup_pipeline_();
 }
@@ -62,7 +133,11 @@ pipeline::pipeline( cv_mat::serialization& output
     : m_output( output )
     , m_filters( filters )
     , m_reader( reader )
-    , m_pipeline( number_of_threads )
+    , m_threads( number_of_threads == 0 ? ::tbb::task_scheduler_init::default_num_threads() : number_of_threads )
+    , m_init( ::tbb::task_scheduler_init::default_num_threads() + 1 ) // the calling thread only feeds the graph and mostly blocks
+    , m_input( NULL )
+    , m_unreleased( NULL )
+    , m_period( boost::posix_time::not_a_date_time )
 {
     setup_pipeline_();
 }
@@ -75,11 +150,16 @@ void pipeline::write_( pair p )
         m_reader.stop();
         return;
     }
+    #ifdef WIN32
     if( std::cout.bad() || !std::cout.good() ) // if( std::cout.bad() || !std::cout.good() || is_shutdown_ )
     {
         m_reader.stop();
     }
     m_output.write( std::cout, p );
+    #else
+    boost::mutex::scoped_lock lock( m_output_mutex );
+    if( !m_output.write( 1, p ) ) { m_reader.stop(); } // gathered write straight from image memory; nothing else should write to std::cout
+    #endif
 }
 
 void pipeline::null_( pair p )
@@ -90,35 +170,183 @@ void pipeline::null_( pair p )
     }
 }
 
+::tbb::flow::continue_msg pipeline::output_( const indexed& p, bool null )
+{
+    boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+    try { if( null ) { null_( p.value ); } else { write_( p.value ); } }
+    catch( std::exception& ex ) { error_( ex.what() ); }
+    catch( ... ) { error_( "unknown exception" ); }
+    if( m_on_output ) { boost::mutex::scoped_lock lock( m_output_mutex ); release_( p.input ); }
+    boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+    m_latencies[ m_latencies.size() - 2 ]->add( now - start );
+    m_latencies.back()->add( now - p.queued );
+    if( !m_period.is_not_a_date_time() && now - m_last_report >= m_period ) { report_(); m_last_report = now; }
+    ++m_tokens;
+    return ::tbb::flow::continue_msg();
+}
+
+void pipeline::error_( const std::string& what )
+{
+    boost::mutex::scoped_lock lock( m_mutex );
+    if( m_error.empty() ) { m_error = what; } // the first one is the one that matters
+    m_reader.stop();
+}
+
+/// stop thread on scope exit, e.g. on exception
+struct stop_on_exit_
+{
+    boost::scoped_ptr< boost::thread >& thread;
+    stop_on_exit_( boost::scoped_ptr< boost::thread >& thread ) : thread( thread ) {}
+    ~stop_on_exit_() { stop(); }
+    void stop() { if( !thread ) { return; } thread->interrupt(); thread->join(); thread.reset(); }
+};
+
+/// flush output on timer, since after a burst, the last frames otherwise would wait for the next frame
+void pipeline::flush_thread_()
+{
+    #ifndef WIN32
+    boost::posix_time::time_duration tick = m_output.flush_period() / 4;
+    if( tick < boost::posix_time::milliseconds( 1 ) ) { tick = boost::posix_time::milliseconds( 1 ); }
+    while( true )
+    {
+        boost::this_thread::sleep( tick ); // interruption point
+        boost::mutex::scoped_lock lock( m_output_mutex );
+        if( !m_output.flush_if_due( 1 ) ) { m_reader.stop(); }
+        release_( NULL );
+    }
+    #endif
+}
+
+/// pass input data of the last output frame to m_on_output, unless output still holds frames; call with m_output_mutex locked
+void pipeline::release_( const unsigned char* input )
+{
+    if( input ) { m_unreleased = input; }
+    if( !m_on_output || !m_unreleased ) { return; }
+    #ifndef WIN32
+    if( m_output.pending() ) { return; } // frames held for gathered write still refer to their memory
+    #endif
+    m_on_output( m_unreleased );
+    m_unreleased = NULL;
+}
+
+void pipeline::statistics( const boost::posix_time::time_duration& period )
+{
+    m_period = period;
+    m_last_report = boost::posix_time::microsec_clock::universal_time();
+}
+
+void pipeline::report_()
+{
+    tbb::bursty_reader< pair >::statistics_type s = m_reader.statistics();
+    std::cerr << "pipeline: frames: read: " << s.read << " dropped: " << s.dropped << " expired: " << s.expired << std::endl;
+    for( std::size_t i = 0; i < m_latencies.size(); ++i ) { std::cerr << "pipeline: latency: " << m_latencies[i]->summary() << std::endl; }
+}
+
 /// setup the pipeline
 /// @param filters name-value string describing the filters
 void pipeline::setup_pipeline_()
 {
-    if( m_filters.empty() )
+    bool has_null = false;
+    std::vector< chain_ > stages;
+    std::vector< bool > parallel;
+    std::vector< std::string > names; // for statistics, filters are numbered from 1
+    std::size_t first = 0;
+    for( std::size_t i = 0; i < m_filters.size(); ++i )
     {
-        m_filter = ::tbb::filter_t< pair, void >( ::tbb::filter::serial_in_order, boost::bind( &pipeline::write_, this, _1 ) );
-    }
-    else
-    {
-        ::tbb::filter_t< pair, pair > all_filters;
-        bool has_null = false;
-        for( std::size_t i = 0; i < m_filters.size(); ++i )
+        std::string number = boost::lexical_cast< std::string >( i + 1 );
+        if( !m_filters[i].filter_function ) { has_null = true; break; }
+        if( m_filters[i].serial_function ) // state update in order of frames, its own stage
+        {
+            stages.push_back( chain_() );
+            stages.back().functions.push_back( m_filters[i].serial_function );
+            parallel.push_back( false );
+            names.push_back( "filter " + number + " (serial)" );
+            stages.push_back( chain_() );
+            stages.back().functions.push_back( m_filters[i].filter_function );
+            parallel.push_back( m_filters[i].parallel );
+            names.push_back( "filter " + number );
+            first = i;
+            continue;
+        }
+        if( !stages.empty() && m_filters[i].in_place && m_filters[i].parallel == parallel.back() ) // frame stays in the same memory: keep it in the same stage, i.e. same thread and cache
         {
-            ::tbb::filter::mode mode = ::tbb::filter::serial_in_order;
-            if( m_filters[i].parallel )
-            {
-                mode = ::tbb::filter::parallel;
-            }
-            if( !m_filters[i].filter_function ) { has_null = true; break; }
-            ::tbb::filter_t< pair, pair > filter( mode, boost::bind( m_filters[i].filter_function, _1 ) );
-            all_filters = i == 0 ? filter : ( all_filters & filter );
+            stages.back().functions.push_back( m_filters[i].filter_function );
+            names.back() = "filters " + boost::lexical_cast< std::string >( first + 1 ) + "-" + number;
+            continue;
         }
-        m_filter = all_filters & ::tbb::filter_t< pair, void >( ::tbb::filter::serial_in_order, boost::bind( has_null ? &pipeline::null_ : &pipeline::write_, this, _1 ) );
+        stages.push_back( chain_() );
+        stages.back().functions.push_back( m_filters[i].filter_function );
+        parallel.push_back( m_filters[i].parallel );
+        names.push_back( "filter " + number );
+        first = i;
     }
+    m_latencies.push_back( boost::shared_ptr< latency_histogram >( new latency_histogram( "queue" ) ) );
+    for( std::size_t i = 0; i < names.size(); ++i ) { m_latencies.push_back( boost::shared_ptr< latency_histogram >( new latency_histogram( names[i] ) ) ); }
+    m_latencies.push_back( boost::shared_ptr< latency_histogram >( new latency_histogram( "output" ) ) );
+    m_latencies.push_back( boost::shared_ptr< latency_histogram >( new latency_histogram( "total" ) ) );
+    ::tbb::flow::function_node< indexed, indexed >* previous = NULL;
+    ::tbb::flow::sequencer_node< indexed >* sequencer = NULL; // if not null, frames come through it in order
+    bool ordered = true; // frames come in order, until a parallel stage
+    for( std::size_t i = 0; i < stages.size(); ++i )
+    {
+        if( !parallel[i] && !ordered ) { sequencer = sequence_after_( previous ); ordered = true; }
+        stage_ stage;
+        stage.chain = stages[i];
+        stage.error = boost::bind( &pipeline::error_, this, _1 );
+        stage.latency = m_latencies[ i + 1 ];
+        ::tbb::flow::function_node< indexed, indexed >* node = new ::tbb::flow::function_node< indexed, indexed >( m_graph, parallel[i] ? ::tbb::flow::unlimited : ::tbb::flow::serial, stage );
+        m_nodes.push_back( boost::shared_ptr< ::tbb::flow::graph_node >( node ) );
+        if( sequencer ) { ::tbb::flow::make_edge( *sequencer, *node ); } else if( previous ) { ::tbb::flow::make_edge( *previous, *node ); } else { m_input = node; }
+        previous = node;
+        sequencer = NULL;
+        ordered = ordered && !parallel[i];
+    }
+    if( !ordered ) { sequencer = sequence_after_( previous ); }
+    ::tbb::flow::function_node< indexed, ::tbb::flow::continue_msg >* output = new ::tbb::flow::function_node< indexed, ::tbb::flow::continue_msg >( m_graph, ::tbb::flow::serial, boost::bind( &pipeline::output_, this, _1, has_null ) );
+    m_nodes.push_back( boost::shared_ptr< ::tbb::flow::graph_node >( output ) );
+    if( sequencer ) { ::tbb::flow::make_edge( *sequencer, *output ); } else if( previous ) { ::tbb::flow::make_edge( *previous, *output ); } else { m_input = output; }
 }
 
-/// run the pipeline
-void pipeline::run() { m_pipeline.run( m_reader, m_filter ); }
+::tbb::flow::sequencer_node< pipeline::indexed >* pipeline::sequence_after_( ::tbb::flow::function_node< indexed, indexed >* node )
+{
+    ::tbb::flow::sequencer_node< indexed >* sequencer = new ::tbb::flow::sequencer_node< indexed >( m_graph, sequence_() );
+    m_nodes.push_back( boost::shared_ptr< ::tbb::flow::graph_node >( sequencer ) );
+    ::tbb::flow::make_edge( *node, *sequencer );
+    return sequencer;
+}
+
+/// run the pipeline: feed frames to the flow graph, as long as there are no more than m_threads frames in flight
+/// a frame is popped from the reader only when there is room for it in the graph, thus the latency budget of the reader
+/// bounds the time from queueing to entering the graph
+void pipeline::run()
+{
+    for( unsigned int i = 0; i < m_threads; ++i ) { ++m_tokens; }
+    boost::scoped_ptr< boost::thread > flush_thread;
+    stop_on_exit_ stop( flush_thread );
+    #ifndef WIN32
+    if( m_output.flush_period().total_microseconds() > 0 ) { flush_thread.reset( new boost::thread( boost::bind( &pipeline::flush_thread_, this ) ) ); }
+    #endif
+    pair p;
+    boost::posix_time::ptime queued;
+    for( std::size_t index = 0; ; ++index )
+    {
+        --m_tokens; // blocks, if too many frames in flight; before pop, so that frames wait in the reader queue, where latency budget applies
+        { boost::mutex::scoped_lock lock( m_mutex ); if( !m_error.empty() ) { break; } }
+        if( !m_reader.pop( p, queued ) ) { break; }
+        m_latencies[0]->add( boost::posix_time::microsec_clock::universal_time() - queued );
+        m_input->try_put( indexed( index, queued, p ) );
+    }
+    m_graph.wait_for_all();
+    stop.stop();
+    if( !m_period.is_not_a_date_time() ) { report_(); }
+    #ifdef WIN32
+    std::cout.flush();
+    #else
+    m_output.flush( 1 );
+    #endif
+    release_( NULL );
+    if( !m_error.empty() ) { COMMA_THROW( comma::exception, m_error ); }
+}
 
 } } }
 
@@ -39,8 +39,14 @@
 #endif
 
 //#include <comma/application/signal_flag.h>
+#include <string>
+#include <vector>
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <tbb/flow_graph.h>
+#include <tbb/task_scheduler_init.h>
 #include <snark/tbb/bursty_reader.h>
-#include <snark/imaging/cv_mat/bursty_pipeline.h>
 #include <snark/imaging/cv_mat/serialization.h>
 #include <snark/imaging/cv_mat/filters.h>
 
@@ -59,6 +65,10 @@ struct bursty_reader_traits< std::pair< boost::posix_time::ptime, cv::Mat > >
 namespace imaging { namespace applications {
 
 /// base class for video processing, capture images in a serarate thread, apply filters, serialize to stdout
+///
+/// filters run on a flow graph that persists between bursts of frames: each stage
+/// is a node, running frames in parallel or, for stateful filters, one at a time in order;
+/// frames get sequenced before serial stages and before output
 class pipeline
 {
     public:
@@ -76,16 +86,71 @@ class pipeline
 
         void run();
 
+        /// print reader counts and latencies to stderr every given period; not_a_date_time: never (default)
+        /// counts are since start, latencies since the last print
+        void statistics( const boost::posix_time::time_duration& period );
+
+        /// call given function with the data of each input frame, once the frame has been written out,
+        /// e.g. to release memory of memory-mapped input (see cv_mat::mapped_reader::release())
+        void on_output( const boost::function< void( const unsigned char* ) >& f ) { m_on_output = f; }
+
+        /// frame with its number in order of input and the time it was queued by the reader
+        struct indexed
+        {
+            indexed() : index( 0 ), input( NULL ) {}
+            indexed( std::size_t index, const boost::posix_time::ptime& queued, const pair& value ) : index( index ), queued( queued ), value( value ), input( value.second.data ) {}
+            std::size_t index;
+            boost::posix_time::ptime queued;
+            pair value;
+            const unsigned char* input; /// data of the frame as read, before filters
+        };
+
+        /// latency histogram with buckets of powers of 2 microseconds, thread-safe
+        class latency_histogram
+        {
+            public:
+                latency_histogram( const std::string& name );
+                void add( const boost::posix_time::time_duration& d );
+                std::string summary( bool reset = true ); /// return summary, e.g. "queue: frames: 250 mean: 1.200ms p50: <1.024ms p90: <2.048ms p99: <4.096ms max: 3.100ms"
+
+            private:
+                std::string name_;
+                boost::mutex mutex_;
+                std::vector< std::size_t > buckets_; /// bucket i: less than 2^i microseconds
+                std::size_t count_;
+                double sum_;
+                boost::int64_t max_;
+                double percentile_( double p ) const;
+        };
+
     protected:
         void write_( pair p );
         void null_( pair p );
         void setup_pipeline_();
+        ::tbb::flow::continue_msg output_( const indexed& p, bool null );
+        ::tbb::flow::sequencer_node< indexed >* sequence_after_( ::tbb::flow::function_node< indexed, indexed >* node );
+        void error_( const std::string& what );
+        void report_();
+        void flush_thread_();
+        void release_( const unsigned char* input );
 
         cv_mat::serialization& m_output;
-        ::tbb::filter_t< pair, void > m_filter;
         std::vector< cv_mat::filter > m_filters;
         tbb::bursty_reader< pair >& m_reader;
-        tbb::bursty_pipeline< pair > m_pipeline;
+        unsigned int m_threads; /// max number of frames in flight
+        ::tbb::task_scheduler_init m_init;
+        ::tbb::flow::graph m_graph;
+        std::vector< boost::shared_ptr< ::tbb::flow::graph_node > > m_nodes;
+        ::tbb::flow::receiver< indexed >* m_input;
+        tbb::counter m_tokens;
+        boost::mutex m_mutex;
+        boost::mutex m_output_mutex; /// output is written by the output node and flushed on timer
+        boost::function< void( const unsigned char* ) > m_on_output;
+        const unsigned char* m_unreleased; /// input data of the last frame output, but not yet passed to m_on_output
+        std::string m_error;
+        boost::posix_time::time_duration m_period;
+        boost::posix_time::ptime m_last_report;
+        std::vector< boost::shared_ptr< latency_histogram > > m_latencies; /// queue, stages, output, total
         //comma::signal_flag is_shutdown_; // todo: tear it down, if cv-cat, gige-cat, and fire-cat work
     };
 
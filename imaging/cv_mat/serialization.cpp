@@ -31,7 +31,14 @@
 // IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 
+#include <algorithm>
 #include <sstream>
+#ifndef WIN32
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
 #include <comma/base/exception.h>
 #include <comma/csv/binary.h>
 #include <comma/string/string.h>
@@ -62,8 +69,9 @@ serialization::header::header( const std::pair< boost::posix_time::ptime, cv::Ma
 serialization::serialization() :
     m_binary( new comma::csv::binary< header >( comma::csv::format::value< header >(), "", false ) ),
     m_buffer( m_binary->format().size() ),
-    m_headerOnly( false )
-    
+    m_headerOnly( false ),
+    m_flush_size( 0 ),
+    m_unflushed_size( 0 )
 {
 
 }
@@ -71,7 +79,9 @@ serialization::serialization() :
 serialization::serialization( const std::string& fields, const comma::csv::format& format, bool headerOnly, const header& default_header ):
     m_buffer( format.size() ),
     m_headerOnly( headerOnly ),
-    m_header( default_header )
+    m_header( default_header ),
+    m_flush_size( 0 ),
+    m_unflushed_size( 0 )
 {
     if( !fields.empty() )
     {
@@ -80,6 +90,10 @@ serialization::serialization( const std::string& fields, const comma::csv::forma
 }
 
 serialization::serialization( const serialization::options& options )
+    : m_pool( options.pool_size )
+    , m_flush_period( boost::posix_time::microseconds( static_cast< comma::int64 >( options.flush_period * 1000000 ) ) )
+    , m_flush_size( options.flush_size )
+    , m_unflushed_size( 0 )
 {
     if( options.no_header && options.header_only ) { COMMA_THROW( comma::exception, "cannot have no-header and header-only at the same time" ); }
     std::string fields = options.fields.empty() ? std::string( "t,rows,cols,type" ) : options.fields;
@@ -142,6 +156,11 @@ serialization::header serialization::get_header( const char* buf ) const
     }
 }
 
+std::size_t serialization::header_size() const
+{
+    return m_binary ? m_binary->format().size() : 0;
+}
+
 std::size_t serialization::size( const cv::Mat& m ) const
 {
     unsigned int headerSize = 0;
@@ -174,7 +193,7 @@ std::pair< boost::posix_time::ptime, cv::Mat > serialization::read( std::istream
         h = m_header;
     }
     p.first = h.timestamp;
-    p.second = cv::Mat( h.rows, h.cols, h.type );
+    p.second = m_pool.get( h.rows, h.cols, h.type );
     std::size_t size = p.second.dataend - p.second.datastart;
     is.read( reinterpret_cast< char* >( p.second.datastart ), size );
     int count = is.gcount();
@@ -197,9 +216,78 @@ void serialization::write( std::ostream& os, const std::pair< boost::posix_time:
     {
         os.write( reinterpret_cast< const char* >( m.second.datastart ), m.second.dataend - m.second.datastart );
     }
-    os.flush();
+    m_unflushed_size += m_headerOnly ? m_buffer.size() : size( m );
+    if( flush_due_() ) { os.flush(); m_unflushed_size = 0; m_unflushed_since = boost::posix_time::not_a_date_time; }
+}
+
+bool serialization::flush_due_()
+{
+    if( m_flush_size == 0 && m_flush_period.total_microseconds() == 0 ) { return true; }
+    if( m_flush_size > 0 && m_unflushed_size >= m_flush_size ) { return true; }
+    if( m_flush_period.total_microseconds() == 0 ) { return false; }
+    boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+    if( m_unflushed_since.is_not_a_date_time() ) { m_unflushed_since = now; }
+    return now >= m_unflushed_since + m_flush_period;
+}
+
+#ifndef WIN32
+
+bool serialization::write( int fd, const std::pair< boost::posix_time::ptime, cv::Mat >& m )
+{
+    if( m_binary )
+    {
+        header h( m );
+        m_pending_headers.resize( m_pending_headers.size() + m_buffer.size() );
+        m_binary->put( h, &m_pending_headers[ m_pending_headers.size() - m_buffer.size() ] );
+    }
+    m_pending.push_back( m_headerOnly ? cv::Mat() : m.second ); // hold reference to the image until flushed
+    m_unflushed_size += m_headerOnly ? m_buffer.size() : size( m );
+    if( !flush_due_() && m_pending.size() * 2 < IOV_MAX ) { return true; }
+    return flush( fd );
 }
 
+bool serialization::flush( int fd )
+{
+    std::vector< ::iovec > iov;
+    iov.reserve( m_pending.size() * 2 );
+    for( std::size_t i = 0; i < m_pending.size(); ++i )
+    {
+        if( m_binary ) { ::iovec v = { &m_pending_headers[ i * m_buffer.size() ], m_buffer.size() }; iov.push_back( v ); }
+        const cv::Mat& image = m_pending[i];
+        if( image.empty() ) { continue; }
+        if( image.isContinuous() ) { ::iovec v = { image.data, image.rows * image.cols * image.elemSize() }; iov.push_back( v ); continue; }
+        for( int r = 0; r < image.rows; ++r ) { ::iovec v = { const_cast< uchar* >( image.ptr( r ) ), image.cols * image.elemSize() }; iov.push_back( v ); }
+    }
+    std::size_t begin = 0;
+    bool ok = true;
+    while( begin < iov.size() )
+    {
+        ssize_t written = ::writev( fd, &iov[begin], std::min( iov.size() - begin, std::size_t( IOV_MAX ) ) );
+        if( written < 0 )
+        {
+            if( errno == EINTR ) { continue; }
+            ok = false;
+            break;
+        }
+        for( ; begin < iov.size() && std::size_t( written ) >= iov[begin].iov_len; written -= iov[begin].iov_len, ++begin );
+        if( written > 0 ) { iov[begin].iov_base = static_cast< char* >( iov[begin].iov_base ) + written; iov[begin].iov_len -= written; } // partial write
+    }
+    m_pending.clear();
+    m_pending_headers.clear();
+    m_unflushed_size = 0;
+    m_unflushed_since = boost::posix_time::not_a_date_time;
+    return ok;
+}
+
+bool serialization::flush_if_due( int fd )
+{
+    if( m_pending.empty() || m_flush_period.total_microseconds() == 0 || m_unflushed_since.is_not_a_date_time() ) { return true; }
+    if( boost::posix_time::microsec_clock::universal_time() < m_unflushed_since + m_flush_period ) { return true; }
+    return flush( fd );
+}
+
+#endif // #ifndef WIN32
+
 static const std::string cvmat_usage_impl_()
 {
     std::ostringstream oss;
@@ -298,6 +386,9 @@ std::string serialization::options::usage()
     stream << "    rows=<rows>: default number of rows (input only)" << std::endl;
     stream << "    cols=<cols>: default number of columns (input only)" << std::endl;
     stream << "    type=<type>: default image type (input only)" << std::endl;
+    stream << "    pool=<n>: max number of frames to recycle once released downstream, 0: allocate each frame; default: 32 (input only)" << std::endl;
+    stream << "    flush-period=<seconds>: flush output, when oldest unflushed frame is that old (checked on the next frame and, in cv-cat and other pipelines, on timer); default: flush every frame (output only)" << std::endl;
+    stream << "    flush-size=<bytes>: flush output, when unflushed data reaches that size; default: flush every frame (output only)" << std::endl;
     stream << type_usage();
     return stream.str();
 }
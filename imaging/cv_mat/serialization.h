@@ -36,11 +36,14 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
+#include <boost/scoped_ptr.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <opencv2/core/core.hpp>
 #include <comma/base/types.h>
 #include <comma/csv/binary.h>
 #include <comma/visiting/traits.h>
+#include <snark/imaging/cv_mat/frame_pool.h>
 
 
 namespace snark{ namespace cv_mat {
@@ -71,8 +74,11 @@ class serialization
             std::string type;
             bool no_header;
             bool header_only;
+            comma::uint32 pool_size;
+            double flush_period;
+            comma::uint32 flush_size;
             
-            options() : no_header( false ), header_only( false ) {}
+            options() : no_header( false ), header_only( false ), pool_size( 32 ), flush_period( 0 ), flush_size( 0 ) {}
             header get_header() const; /// make header (to be used as default)
             static std::string usage();
             static std::string type_usage();
@@ -103,6 +109,9 @@ class serialization
         /// return usage
         static const std::string& usage();
 
+        /// return header size in buffer, 0 if no header
+        std::size_t header_size() const;
+
         /// return necessary buffer size
         std::size_t size( const cv::Mat& m ) const;
 
@@ -112,14 +121,47 @@ class serialization
         /// read from stream, if eof, return empty cv::Mat
         std::pair< boost::posix_time::ptime, cv::Mat > read( std::istream& is );
 
-        /// write to stream
+        /// write to stream, flush according to flush policy (by default, every frame)
         void write( std::ostream& os, const std::pair< boost::posix_time::ptime, cv::Mat >& m );
 
+        #ifndef WIN32
+        /// write to file descriptor with writev straight from image memory, without copying to stream buffer;
+        /// frames are held until flushed according to flush policy (by default, every frame)
+        /// @return false on write error (e.g. broken pipe)
+        bool write( int fd, const std::pair< boost::posix_time::ptime, cv::Mat >& m );
+
+        /// write all the frames held by write( fd, m )
+        /// @return false on write error (e.g. broken pipe)
+        bool flush( int fd );
+
+        /// write the frames held by write( fd, m ), if the oldest of them is at least flush period old;
+        /// call it periodically, e.g. from a timer, to flush the last frames of a burst without waiting for the next frame
+        /// @return false on write error (e.g. broken pipe)
+        bool flush_if_due( int fd );
+
+        /// true, if write( fd, m ) holds frames
+        bool pending() const { return !m_pending.empty(); }
+        #endif
+
+        /// flush period, zero if none
+        const boost::posix_time::time_duration& flush_period() const { return m_flush_period; }
+
+        /// pool of frames for read(), e.g. for hit/miss statistics
+        const frame_pool& pool() const { return m_pool; }
+
     private:
         boost::scoped_ptr< comma::csv::binary< header > > m_binary;
         std::vector< char > m_buffer;
         bool m_headerOnly;
         header m_header; /// default header
+        frame_pool m_pool; /// recycled frames for read()
+        boost::posix_time::time_duration m_flush_period; /// if not zero, flush, when oldest unflushed frame is at least that old
+        std::size_t m_flush_size; /// if not zero, flush, when unflushed bytes reach that size
+        std::size_t m_unflushed_size;
+        boost::posix_time::ptime m_unflushed_since;
+        std::vector< cv::Mat > m_pending; /// frames held by write( fd, m )
+        std::vector< char > m_pending_headers; /// headers of frames held by write( fd, m )
+        bool flush_due_();
 };
 
 } }  // namespace snark{ namespace cv_mat {
@@ -160,6 +202,9 @@ template <> struct traits< snark::cv_mat::serialization::options >
         v.apply( "type", h.type );
         v.apply( "no-header", h.no_header );
         v.apply( "header-only", h.header_only );
+        v.apply( "pool", h.pool_size );
+        v.apply( "flush-period", h.flush_period );
+        v.apply( "flush-size", h.flush_size );
     }
 
     template < typename K, typename V >
@@ -171,6 +216,9 @@ template <> struct traits< snark::cv_mat::serialization::options >
         v.apply( "type", h.type );
         v.apply( "no-header", h.no_header );
         v.apply( "header-only", h.header_only );
+        v.apply( "pool", h.pool_size );
+        v.apply( "flush-period", h.flush_period );
+        v.apply( "flush-size", h.flush_size );
     }
 };
     
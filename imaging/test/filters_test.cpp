@@ -0,0 +1,119 @@
+// This file is part of snark, a generic and flexible library for robotics research
+// Copyright (c) 2011 The University of Sydney
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. All advertising materials mentioning features or use of this software
+//    must display the following acknowledgement:
+//    This product includes software developed by the The University of Sydney.
+// 4. Neither the name of the The University of Sydney nor the
+//    names of its contributors may be used to endorse or promote products
+//    derived from this software without specific prior written permission.
+//
+// NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+// GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+// HOLDERS AND CONTRIBUTORS \"AS IS\" AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+// OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+// IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include <opencv2/core/core.hpp>
+#include <comma/string/string.h>
+#include <snark/imaging/cv_mat/filters.h>
+
+namespace snark { namespace test {
+
+/// non-continuous submatrix of odd size of a smooth image, i.e. pixel value changes by not more than 2 between neighbours
+static cv::Mat image( int type )
+{
+    cv::Mat m( 53, 67, type );
+    for( int r = 0; r < m.rows; ++r )
+    {
+        for( int i = 0; i < m.cols * m.channels(); ++i )
+        {
+            int c = i / m.channels();
+            double v = 2 * r + c + 10 * ( i % m.channels() );
+            switch( m.depth() )
+            {
+                case CV_8U: m.ptr< unsigned char >( r )[i] = v; break;
+                case CV_16U: m.ptr< unsigned short >( r )[i] = v; break;
+                case CV_32F: m.ptr< float >( r )[i] = v; break;
+            }
+        }
+    }
+    return cv::Mat( m, cv::Rect( 3, 2, 61, 47 ) );
+}
+
+static cv::Mat apply( const std::string& how, const cv::Mat& m )
+{
+    std::vector< cv_mat::filter > f = cv_mat::filters::make( how );
+    return cv_mat::filters::apply( f, cv_mat::filters::value_type( boost::posix_time::ptime(), m ) ).second.clone(); // clone, since outputs of filters may be reused
+}
+
+static cv::Mat apply_one_by_one( const std::string& how, const cv::Mat& m )
+{
+    std::vector< std::string > v = comma::split( how, ';' );
+    cv::Mat n = m;
+    for( std::size_t i = 0; i < v.size(); ++i ) { n = apply( v[i], n ); }
+    return n;
+}
+
+static void expect_fused( const std::string& how, int type, double tolerance )
+{
+    SCOPED_TRACE( how );
+    cv::Mat m = image( type );
+    ASSERT_FALSE( m.isContinuous() );
+    EXPECT_EQ( 1u, cv_mat::filters::make( how ).size() );
+    cv::Mat expected = apply_one_by_one( how, m );
+    cv::Mat fused = apply( how, m );
+    ASSERT_EQ( expected.size(), fused.size() );
+    ASSERT_EQ( expected.type(), fused.type() );
+    EXPECT_LE( cv::norm( expected, fused, cv::NORM_INF ), tolerance );
+}
+
+TEST( filters, fused_geometry_exact )
+{
+    static const char* chains[] = { "crop=2,3,31,23;flip;transpose"
+                                  , "flop;transpose;flip"
+                                  , "transpose;crop=5,4,17,29;flop"
+                                  , "crop-tile=1,2,3,4;flip;flop"
+                                  , "crop=1,1,51,41;crop=3,5,21,13"
+                                  , "flip;crop-tile=0,1,2,3;transpose" };
+    static const int types[] = { CV_8UC1, CV_8UC3, CV_16UC1, CV_32FC1 };
+    for( unsigned int i = 0; i < sizeof( chains ) / sizeof( chains[0] ); ++i )
+    {
+        for( unsigned int j = 0; j < sizeof( types ) / sizeof( types[0] ); ++j ) { expect_fused( chains[i], types[j], 0 ); }
+    }
+}
+
+TEST( filters, fused_geometry_resize )
+{
+    static const char* chains[] = { "crop=2,3,31,23;resize=0.7"
+                                  , "flip;resize=50,40;transpose"
+                                  , "resize=1.5;crop=10,10,33,21"
+                                  , "transpose;resize=0.5,27;flop" };
+    for( unsigned int i = 0; i < sizeof( chains ) / sizeof( chains[0] ); ++i )
+    {
+        expect_fused( chains[i], CV_8UC1, 2 );
+        expect_fused( chains[i], CV_8UC3, 2 );
+        expect_fused( chains[i], CV_32FC1, 0.1 );
+    }
+}
+
+} } // namespace snark { namespace test {
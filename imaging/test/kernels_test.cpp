@@ -0,0 +1,173 @@
+// This file is part of snark, a generic and flexible library for robotics research
+// Copyright (c) 2011 The University of Sydney
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. All advertising materials mentioning features or use of this software
+//    must display the following acknowledgement:
+//    This product includes software developed by the The University of Sydney.
+// 4. Neither the name of the The University of Sydney nor the
+//    names of its contributors may be used to endorse or promote products
+//    derived from this software without specific prior written permission.
+//
+// NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+// GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+// HOLDERS AND CONTRIBUTORS \"AS IS\" AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+// OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+// IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <cmath>
+#include <cstdlib>
+#include <gtest/gtest.h>
+#include <opencv2/core/core.hpp>
+#include <snark/imaging/cv_mat/kernels.h>
+
+namespace snark { namespace test {
+
+// scalar references of the kernels
+
+template < typename T > static T invert( T v ) { return T( ~v ); }
+static float invert( float v ) { return 1 - v; }
+static double invert( double v ) { return 1 - v; }
+
+template < typename T > static T linear( T v, double scale, double offset ) { return cv::saturate_cast< T >( v * scale + offset ); }
+static float linear( float v, double scale, double offset ) { return v * float( scale ) + float( offset ); }
+static double linear( double v, double scale, double offset ) { return v * scale + offset; }
+
+template < typename T > static T threshold( T v, double threshold, double max ) { return v > threshold ? cv::saturate_cast< T >( max ) : T( 0 ); }
+
+template < typename T > static T random_value() { return T( std::rand() ); } // wraps over the whole range of integer types
+template <> float random_value< float >() { return float( std::rand() ) / RAND_MAX * 4 - 2; }
+template <> double random_value< double >() { return double( std::rand() ) / RAND_MAX * 4 - 2; }
+
+struct invert_kernel
+{
+    void operator()( cv::Mat& m ) const { cv_mat::kernels::invert( m ); }
+    template < typename T > T operator()( T v ) const { return invert( v ); }
+};
+
+struct linear_kernel
+{
+    double scale;
+    double offset;
+    void operator()( cv::Mat& m ) const { cv_mat::kernels::linear( m, scale, offset ); }
+    template < typename T > T operator()( T v ) const { return linear( v, scale, offset ); }
+};
+
+struct threshold_kernel
+{
+    double threshold;
+    double max;
+    void operator()( cv::Mat& m ) const { cv_mat::kernels::threshold( m, threshold, max ); }
+    template < typename T > T operator()( T v ) const { return test::threshold( v, threshold, max ); }
+};
+
+struct lut_kernel // table of -value + 3: entries are at value - min, e.g. value + 128 for 8-bit signed images
+{
+    cv::Mat table;
+    lut_kernel( int depth ) { cv_mat::kernels::linear_transform t = { -1, 3 }; table = cv_mat::kernels::make_lut( depth, t ); }
+    void operator()( cv::Mat& m ) const { cv_mat::kernels::lut( m, table ); }
+    template < typename T > T operator()( T v ) const { return cv::saturate_cast< T >( -double( v ) + 3 ); }
+};
+
+/// apply kernel to images of sizes that are not multiples of simd width, continuous and submatrices,
+/// and compare with the scalar reference; pixels outside of submatrix must stay the same
+template < typename T, typename K >
+static void expect_kernel( int depth, const K& kernel, double tolerance = 0 )
+{
+    static const int sizes[][3] = { { 1, 1, 1 }, { 1, 31, 1 }, { 3, 33, 1 }, { 5, 67, 3 }, { 2, 100, 4 }, { 4, 129, 1 } }; // rows, cols, channels
+    for( unsigned int s = 0; s < sizeof( sizes ) / sizeof( sizes[0] ); ++s )
+    {
+        for( unsigned int submatrix = 0; submatrix < 2; ++submatrix )
+        {
+            int rows = sizes[s][0];
+            int cols = sizes[s][1];
+            int channels = sizes[s][2];
+            SCOPED_TRACE( testing::Message() << "depth: " << depth << " size: " << rows << "x" << cols << "x" << channels << ( submatrix ? " submatrix" : "" ) );
+            int border = submatrix ? 3 : 0;
+            cv::Mat image( rows + 2 * border, cols + 2 * border, CV_MAKETYPE( depth, channels ) );
+            for( int r = 0; r < image.rows; ++r ) { for( int i = 0; i < image.cols * channels; ++i ) { image.ptr< T >( r )[i] = random_value< T >(); } }
+            cv::Mat before = image.clone();
+            cv::Mat m( image, cv::Rect( border, border, cols, rows ) );
+            ASSERT_EQ( !submatrix || rows == 1, m.isContinuous() );
+            kernel( m );
+            for( int r = 0; r < image.rows; ++r )
+            {
+                for( int i = 0; i < image.cols * channels; ++i )
+                {
+                    bool inside = r >= border && r < border + rows && i >= border * channels && i < ( border + cols ) * channels;
+                    T v = before.ptr< T >( r )[i];
+                    T expected = inside ? kernel( v ) : v;
+                    T actual = image.ptr< T >( r )[i];
+                    if( std::fabs( double( expected ) - double( actual ) ) > tolerance ) { ADD_FAILURE() << "at row " << r << " element " << i << " of " << double( v ) << ": expected " << double( expected ) << ", got " << double( actual ); return; }
+                }
+            }
+        }
+    }
+}
+
+TEST( kernels, invert )
+{
+    std::srand( 1 );
+    invert_kernel k;
+    expect_kernel< unsigned char >( CV_8U, k );
+    expect_kernel< signed char >( CV_8S, k );
+    expect_kernel< unsigned short >( CV_16U, k );
+    expect_kernel< short >( CV_16S, k );
+    expect_kernel< float >( CV_32F, k );
+    expect_kernel< double >( CV_64F, k );
+}
+
+TEST( kernels, linear )
+{
+    std::srand( 2 );
+    linear_kernel k = { 1.7, -20 }; // saturates both ways for integer types
+    expect_kernel< unsigned char >( CV_8U, k );
+    expect_kernel< signed char >( CV_8S, k );
+    expect_kernel< unsigned short >( CV_16U, k );
+    expect_kernel< short >( CV_16S, k );
+    linear_kernel f = { 1.7, -0.3 };
+    expect_kernel< float >( CV_32F, f, 1e-5 );
+    expect_kernel< double >( CV_64F, f );
+}
+
+TEST( kernels, threshold )
+{
+    std::srand( 3 );
+    threshold_kernel k8u = { 100, 200 };
+    expect_kernel< unsigned char >( CV_8U, k8u );
+    threshold_kernel k8s = { -3, cv_mat::kernels::max_of( CV_8S ) };
+    expect_kernel< signed char >( CV_8S, k8s );
+    threshold_kernel k16u = { 30000, cv_mat::kernels::max_of( CV_16U ) };
+    expect_kernel< unsigned short >( CV_16U, k16u );
+    threshold_kernel k16s = { -100, 1000 };
+    expect_kernel< short >( CV_16S, k16s );
+    threshold_kernel f = { 0.25, 1 };
+    expect_kernel< float >( CV_32F, f );
+    expect_kernel< double >( CV_64F, f );
+}
+
+TEST( kernels, lut )
+{
+    std::srand( 4 );
+    expect_kernel< unsigned char >( CV_8U, lut_kernel( CV_8U ) );
+    expect_kernel< signed char >( CV_8S, lut_kernel( CV_8S ) );
+    expect_kernel< unsigned short >( CV_16U, lut_kernel( CV_16U ) );
+    expect_kernel< short >( CV_16S, lut_kernel( CV_16S ) );
+}
+
+} } // namespace snark { namespace test {
@@ -39,15 +39,27 @@
 #include <fcntl.h>
 #include <io.h>
 #endif
+#include <algorithm>
 #include <cmath>
 #include <string.h>
 #include <fstream>
+#include <vector>
+#include <tbb/concurrent_queue.h>
+#include <tbb/pipeline.h>
+#include <tbb/task_scheduler_init.h>
 #include <boost/array.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 #include <boost/optional.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <comma/base/exception.h>
 #include <comma/application/command_line_options.h>
 #include <comma/application/signal_flag.h>
 #include <comma/base/types.h>
 #include <comma/csv/stream.h>
+#include <comma/io/select.h>
 #include <comma/math/compare.h>
 #include <comma/string/string.h>
 #include <comma/visiting/traits.h>
@@ -63,12 +75,21 @@ void usage( bool long_help = false )
     std::cerr << "load a point cloud in polar from file; for each point on stdin output whether it is blocked in the ray or not by points of the point cloud" << std::endl;
     std::cerr << std::endl;
     std::cerr << "usage: cat points.csv | points-detect-change reference_points.csv [<options>] > points.marked-as-blocked.csv" << std::endl;
+    std::cerr << "       points-detect-change reference_points.csv --save-index=reference.index [<options>]" << std::endl;
+    std::cerr << "       cat points.csv | points-detect-change --index=reference.index [<options>] > points.marked-as-blocked.csv" << std::endl;
     std::cerr << std::endl;
     std::cerr << "options" << std::endl;
     std::cerr << "    --long-help: more help" << std::endl;
+    std::cerr << "    --index=<filename>: use reference index saved with --save-index instead of reference point cloud" << std::endl;
+    std::cerr << "                        the index is memory-mapped, i.e. it takes no time to load" << std::endl;
+    std::cerr << "    --save-index=<filename>: load reference point cloud, save its index to file and exit" << std::endl;
+    std::cerr << "                             the index file has native byte order and depends on --angle-threshold and input format" << std::endl;
     std::cerr << "    --range-threshold,-r=<value>: if present, output only the points" << std::endl;
     std::cerr << "                                  that have reference points nearer than range + range-threshold" << std::endl;
-    std::cerr << "    --angle-threshold,-a=<value>: angular radius in radians" << std::endl;
+    std::cerr << "    --angle-threshold,-a=<value>: angular radius in radians; optional with --index" << std::endl;
+    std::cerr << "    --batch-size=<n>: max number of input points processed as one batch; default: 4096" << std::endl;
+    std::cerr << "                      batches are processed in parallel, output is in the order of input" << std::endl;
+    std::cerr << "    --latency=<seconds>: output a batch before it is full, if no input comes for given time; default: 0.01" << std::endl;
     std::cerr << "    --verbose,-v: more debug output" << std::endl;
     std::cerr << std::endl;
     std::cerr << "fields: r,b,e: range, bearing, elevation; default: r,b,e" << std::endl;
@@ -114,138 +135,368 @@ static double bearing_max_( double m, double b )
 static bool verbose;
 snark::voxel_map< int, 2 >::point_type resolution;
 
-struct cell
+typedef snark::voxel_map< int, 2 > grid_t; // for indexing only
+
+/// flat bearing-elevation index of the reference point cloud with its raw records
+///
+/// each reference point is added to the cell it falls into and to the 8 neighbouring cells;
+/// cells are sorted by key, so that the whole index is a few plain arrays, which can be
+/// saved to file once and then memory-mapped, without reloading the reference point cloud
+///
+/// entries of each cell are sorted by range (points of the same range in the order they were loaded),
+/// which lets trace() skip to the range band it is interested in and stop as soon as the result is known
+///
+/// file layout (native byte order, each section padded to 8 bytes):
+///     header
+///     points: point_t[size]
+///     record offsets: uint64[size+1]
+///     cell keys: int32[cells][2]
+///     cell offsets: uint64[cells+1]
+///     entry ranges: double[entries]
+///     entries: uint64[entries], i.e. indices of points in each cell
+///     records: char[record offsets[size]]
+class reference_index
+{
+    public:
+        typedef grid_t::index_type key_type;
+
+        struct header_type
+        {
+            char magic[8];
+            comma::uint32 version;
+            comma::uint32 binary;
+            double threshold;
+            comma::uint64 size;
+            comma::uint64 cells;
+            comma::uint64 entries;
+            comma::uint64 records;
+        };
+
+        /// entries of a cell
+        struct cell
+        {
+            const comma::uint64* begin;
+            const comma::uint64* end;
+        };
+
+        reference_index() : points_( NULL ), record_offsets_( NULL ), keys_( NULL ), cell_offsets_( NULL ), ranges_( NULL ), entries_( NULL ), records_( NULL ) { ::memset( &header_, 0, sizeof( header_type ) ); }
+
+        /// load reference points from stream
+        void build( comma::csv::input_stream< point_t >& istream, const comma::csv::options& csv, double threshold, const comma::signal_flag& is_shutdown );
+
+        /// memory-map index saved with save()
+        void load( const std::string& filename );
+
+        /// save index to file
+        void save( const std::string& filename ) const;
+
+        std::size_t size() const { return header_.size; }
+        std::size_t cells() const { return header_.cells; }
+        double threshold() const { return header_.threshold; }
+        bool binary() const { return header_.binary; }
+        const point_t& point( comma::uint64 i ) const { return points_[i]; }
+        const char* record( comma::uint64 i ) const { return records_ + record_offsets_[i]; }
+        std::size_t record_size( comma::uint64 i ) const { return record_offsets_[ i + 1 ] - record_offsets_[i]; }
+
+        /// @return cell in which the given bearing and elevation fall, or null, if it is empty
+        boost::optional< cell > find( double bearing, double elevation ) const;
+
+        /// @return index of the nearest reference point blocking the ray to given point, or null
+        const comma::uint64* trace( const cell& c, const point_t& p, boost::optional< double > range_threshold ) const;
+
+    private:
+        header_type header_;
+        const point_t* points_;
+        const comma::uint64* record_offsets_;
+        const key_type* keys_;
+        const comma::uint64* cell_offsets_;
+        const double* ranges_;
+        const comma::uint64* entries_;
+        const char* records_;
+        std::vector< point_t > points_buffer_;
+        std::vector< comma::uint64 > record_offsets_buffer_;
+        std::vector< key_type > keys_buffer_;
+        std::vector< comma::uint64 > cell_offsets_buffer_;
+        std::vector< double > ranges_buffer_;
+        std::vector< comma::uint64 > entries_buffer_;
+        std::vector< char > records_buffer_;
+        boost::scoped_ptr< boost::interprocess::file_mapping > mapping_;
+        boost::scoped_ptr< boost::interprocess::mapped_region > region_;
+
+        static const char* magic_() { return "snarkdci"; }
+        enum { version_ = 2 };
+        static std::size_t padded_( std::size_t size ) { return ( size + 7 ) & ~std::size_t( 7 ); }
+};
+
+inline void reference_index::build( comma::csv::input_stream< point_t >& istream, const comma::csv::options& csv, double threshold, const comma::signal_flag& is_shutdown )
 {
-    struct entry
+    struct entry_t
     {
-        point_t point;
+        key_type key;
+        double range;
         comma::uint64 index;
-        entry() {}
-        entry( const point_t& point, comma::uint64 index ) : point( point ), index( index ) {}
+        entry_t( const key_type& key, double range, comma::uint64 index ) : key( key ), range( range ), index( index ) {}
+        bool operator<( const entry_t& rhs ) const { return key < rhs.key || ( key == rhs.key && ( range < rhs.range || ( range == rhs.range && index < rhs.index ) ) ); }
     };
+    std::vector< entry_t > entries;
+    record_offsets_buffer_.push_back( 0 );
+    while( !is_shutdown )
+    {
+        const point_t* p = istream.read();
+        if( !p ) { break; }
+        comma::uint64 index = points_buffer_.size();
+        for( int i = -1; i < 2; ++i )
+        {
+            for( int j = -1; j < 2; ++j )
+            {
+                double bearing = p->bearing() + threshold * i;
+                if( bearing < -M_PI ) { bearing += ( M_PI * 2 ); }
+                else if( bearing >= M_PI ) { bearing -= ( M_PI * 2 ); }
+                double elevation = p->elevation() + threshold * j;
+                entries.push_back( entry_t( grid_t::index_of( grid_t::point_type( bearing, elevation ), resolution ), p->range(), index ) );
+            }
+        }
+        points_buffer_.push_back( *p );
+        if( csv.binary() )
+        {
+            const char* begin = istream.binary().last();
+            records_buffer_.insert( records_buffer_.end(), begin, begin + csv.format().size() );
+        }
+        else
+        {
+            const std::string& s = comma::join( istream.ascii().last(), csv.delimiter );
+            records_buffer_.insert( records_buffer_.end(), s.begin(), s.end() );
+        }
+        record_offsets_buffer_.push_back( records_buffer_.size() );
+    }
+    std::sort( entries.begin(), entries.end() );
+    ranges_buffer_.reserve( entries.size() );
+    entries_buffer_.reserve( entries.size() );
+    for( std::size_t i = 0; i < entries.size(); ++i )
+    {
+        if( i == 0 || entries[i].key != entries[ i - 1 ].key )
+        {
+            keys_buffer_.push_back( entries[i].key );
+            cell_offsets_buffer_.push_back( i );
+        }
+        ranges_buffer_.push_back( entries[i].range );
+        entries_buffer_.push_back( entries[i].index );
+    }
+    cell_offsets_buffer_.push_back( entries.size() );
+    ::memcpy( header_.magic, magic_(), sizeof( header_.magic ) );
+    header_.version = version_;
+    header_.binary = csv.binary();
+    header_.threshold = threshold;
+    header_.size = points_buffer_.size();
+    header_.cells = keys_buffer_.size();
+    header_.entries = entries_buffer_.size();
+    header_.records = records_buffer_.size();
+    points_ = points_buffer_.empty() ? NULL : &points_buffer_[0];
+    record_offsets_ = &record_offsets_buffer_[0];
+    keys_ = keys_buffer_.empty() ? NULL : &keys_buffer_[0];
+    cell_offsets_ = &cell_offsets_buffer_[0];
+    ranges_ = ranges_buffer_.empty() ? NULL : &ranges_buffer_[0];
+    entries_ = entries_buffer_.empty() ? NULL : &entries_buffer_[0];
+    records_ = records_buffer_.empty() ? NULL : &records_buffer_[0];
+}
 
-    std::vector< entry > points;
+static void write_padded_( std::ofstream& ofs, const void* buf, std::size_t size )
+{
+    static const char zeroes[8] = { 0 };
+    if( size > 0 ) { ofs.write( reinterpret_cast< const char* >( buf ), size ); }
+    if( size % 8 ) { ofs.write( zeroes, 8 - size % 8 ); }
+}
 
-//     typedef snark::voxel_map< cell, 2 > grid_t;
-//
-//     enum { factor = 4 };
-//
-//     boost::array< boost::array< std::vector< entry >, 3 * factor >, 3 * factor > grid;
-//
-//     static grid_t::Index index( double b, double e )
-//     {
-//         grid_t::point_t p( b, e );
-//         static grid_t::point_t finer_resolution = resolution / factor; // quick and dirty
-//         const grid_t::Index& ri = grid_t::index_of( p, resolution );
-//         const grid_t::Index& fi = grid_t::index_of( p, finer_resolution );
-//         grid_t::Index i;
-//         i[0] = fi[0] - ri[0] * factor;
-//         i[1] = fi[1] - ri[1] * factor;
-//         return i;
-//     }
-//
-//     void add_to_grid( const entry& p )
-//     {
-//         const grid_t::Index& i = index( p.point.bearing, p.point.elevation );
-//         std::vector< entry >& v = grid[i[0]][i[1]];
-//         if( v.size() == v.capacity() ) { v.reserve( 512 ); } // quick and dirty
-//         v.push_back( p );
-//     }
-//
-//     const entry* trace_in_grid( const point_t& p, double threshold, boost::optional< double > range_threshold ) const
-//     {
-//         static const double threshold_square = threshold * threshold; // static: quick and dirty
-//         const entry* entry = NULL;
-//         boost::optional< point_t > min; // todo: quick and dirty, fix point_tRBE and use extents
-//         boost::optional< point_t > max; // todo: quick and dirty, fix point_tRBE and use extents
-//         const grid_t::Index& begin = index( p.bearing - threshold, p.elevation - threshold );
-//         const grid_t::Index& end = index( p.bearing + threshold, p.elevation + threshold );
-//         for( unsigned int b = begin[0]; b < ( unsigned int )( end[0] ); ++b )
-//         {
-//             for( unsigned int e = begin[1]; e < ( unsigned int )( end[1] ); ++b )
-//             {
-//                 const std::vector< entry >& v = grid[b][e];
-//                 for( std::size_t i = 0; i < v.size(); ++i )
-//                 {
-//                     double db = abs_bearing_distance_( p.bearing, v[i].point.bearing );
-//                     double de = p.elevation - v[i].point.elevation;
-//                     if( ( db * db + de * de ) > threshold_square ) { continue; }
-//                     if( range_threshold && v[i].point.range < ( p.range + *range_threshold ) ) { return NULL; }
-//                     if( !min || v[i].point.range < min->range ) { entry = &v[i]; }
-//                     if( min ) // todo: quick and dirty, fix point_tRBE and use extents
-//                     {
-//                         min->range = std::min( min->range, v[i].point.range );
-//                         min->bearing = bearing_min_( min->bearing, v[i].point.bearing );
-//                         min->elevation = std::min( min->elevation, v[i].point.elevation );
-//                         max->range = std::max( max->range, v[i].point.range );
-//                         max->bearing = bearing_max_( max->bearing, v[i].point.bearing );
-//                         max->elevation = std::max( max->elevation, v[i].point.elevation );
-//                     }
-//                     else
-//                     {
-//                         min = max = v[i].point;
-//                     }
-//                 }
-//             }
-//         }
-//         return    !min
-//                || !bearing_between_( p.bearing, min->bearing, max->bearing )
-//                || comma::math::less( p.elevation, min->elevation )
-//                || !comma::math::less( p.elevation, max->elevation ) ? NULL : entry;
-//     }
-
-    void add( const entry& p )
+inline void reference_index::save( const std::string& filename ) const
+{
+    std::ofstream ofs( filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc );
+    if( !ofs.is_open() ) { COMMA_THROW( comma::exception, "failed to open \"" << filename << "\" for writing" ); }
+    write_padded_( ofs, &header_, sizeof( header_type ) );
+    write_padded_( ofs, points_, header_.size * sizeof( point_t ) );
+    write_padded_( ofs, record_offsets_, ( header_.size + 1 ) * sizeof( comma::uint64 ) );
+    write_padded_( ofs, keys_, header_.cells * sizeof( key_type ) );
+    write_padded_( ofs, cell_offsets_, ( header_.cells + 1 ) * sizeof( comma::uint64 ) );
+    write_padded_( ofs, ranges_, header_.entries * sizeof( double ) );
+    write_padded_( ofs, entries_, header_.entries * sizeof( comma::uint64 ) );
+    write_padded_( ofs, records_, header_.records );
+    if( !ofs.good() ) { COMMA_THROW( comma::exception, "failed to write \"" << filename << "\"" ); }
+}
+
+inline void reference_index::load( const std::string& filename )
+{
+    mapping_.reset( new boost::interprocess::file_mapping( filename.c_str(), boost::interprocess::read_only ) );
+    region_.reset( new boost::interprocess::mapped_region( *mapping_, boost::interprocess::read_only ) );
+    const char* begin = reinterpret_cast< const char* >( region_->get_address() );
+    std::size_t size = region_->get_size();
+    if( size < sizeof( header_type ) ) { COMMA_THROW( comma::exception, "\"" << filename << "\" is not a reference index: file too short" ); }
+    ::memcpy( &header_, begin, sizeof( header_type ) );
+    if( ::memcmp( header_.magic, magic_(), sizeof( header_.magic ) ) != 0 ) { COMMA_THROW( comma::exception, "\"" << filename << "\" is not a reference index" ); }
+    if( header_.version != version_ ) { COMMA_THROW( comma::exception, "expected reference index version " << version_ << ", got " << header_.version << " in \"" << filename << "\"" ); }
+    const char* p = begin + padded_( sizeof( header_type ) );
+    points_ = reinterpret_cast< const point_t* >( p ); p += padded_( header_.size * sizeof( point_t ) );
+    record_offsets_ = reinterpret_cast< const comma::uint64* >( p ); p += padded_( ( header_.size + 1 ) * sizeof( comma::uint64 ) );
+    keys_ = reinterpret_cast< const key_type* >( p ); p += padded_( header_.cells * sizeof( key_type ) );
+    cell_offsets_ = reinterpret_cast< const comma::uint64* >( p ); p += padded_( ( header_.cells + 1 ) * sizeof( comma::uint64 ) );
+    ranges_ = reinterpret_cast< const double* >( p ); p += padded_( header_.entries * sizeof( double ) );
+    entries_ = reinterpret_cast< const comma::uint64* >( p ); p += padded_( header_.entries * sizeof( comma::uint64 ) );
+    records_ = p; p += padded_( header_.records );
+    if( std::size_t( p - begin ) > size ) { COMMA_THROW( comma::exception, "\"" << filename << "\": expected size " << ( p - begin ) << " bytes, got " << size << " bytes" ); }
+}
+
+inline boost::optional< reference_index::cell > reference_index::find( double bearing, double elevation ) const
+{
+    key_type key = grid_t::index_of( grid_t::point_type( bearing, elevation ), resolution );
+    const key_type* it = std::lower_bound( keys_, keys_ + header_.cells, key );
+    if( it == keys_ + header_.cells || *it != key ) { return boost::none; }
+    std::size_t i = it - keys_;
+    cell c = { entries_ + cell_offsets_[i], entries_ + cell_offsets_[ i + 1 ] };
+    return c;
+}
+
+static bool near_( const point_t& p, const point_t& q, double threshold_square )
+{
+    double db = abs_bearing_distance_( p.bearing(), q.bearing() );
+    double de = p.elevation() - q.elevation();
+    return ( db * db + de * de ) <= threshold_square;
+}
+
+inline const comma::uint64* reference_index::trace( const cell& c, const point_t& p, boost::optional< double > range_threshold ) const
+{
+    const double threshold_square = header_.threshold * header_.threshold;
+    const comma::uint64* it = c.begin;
+    if( range_threshold ) // any reference point nearer than the range band blocks the ray
+    {
+        const double* ranges = ranges_ + ( c.begin - entries_ );
+        const comma::uint64* band = c.begin + ( std::lower_bound( ranges, ranges + ( c.end - c.begin ), p.range() + *range_threshold ) - ranges );
+        for( ; it != band; ++it ) { if( near_( p, points_[ *it ], threshold_square ) ) { return NULL; } }
+    }
+    const comma::uint64* e = NULL; // nearest, since entries are sorted by range
+    boost::optional< point_t > min;
+    boost::optional< point_t > max;
+    for( ; it != c.end; ++it )
     {
-        if( points.size() == points.capacity() ) { points.reserve( 2048 ); } // quick and dirty
-        points.push_back( p );
+        const point_t& q = points_[ *it ];
+        if( !near_( p, q, threshold_square ) ) { continue; }
+        if( min ) // todo: quick and dirty, fix point_tRBE and use extents
+        {
+            min->bearing( bearing_min_( min->bearing(), q.bearing() ) );
+            min->elevation( std::min( min->elevation(), q.elevation() ) );
+            max->bearing( bearing_max_( max->bearing(), q.bearing() ) );
+            max->elevation( std::max( max->elevation(), q.elevation() ) );
+        }
+        else
+        {
+            e = it;
+            min = max = q;
+        }
+        if(    comma::math::less( min->elevation(), p.elevation() )
+            && comma::math::less( p.elevation(), max->elevation() )
+            && bearing_between_( p.bearing(), min->bearing(), max->bearing() ) ) { return e; } // extents only grow, thus no need to look further
     }
+    return NULL;
+}
 
-    const entry* trace( const point_t& p, double threshold, boost::optional< double > range_threshold ) const
+/// batch of input points with their raw records and the reference points blocking them
+struct batch_t
+{
+    std::vector< point_t > points;
+    std::vector< char > records; // raw input records: binary as read or ascii lines without line ending
+    std::vector< std::size_t > offsets; // record i is [ offsets[i], offsets[i+1] ) in records
+    std::vector< const comma::uint64* > blocking; // index of blocking reference point or null
+
+    batch_t() : offsets( 1, 0 ) {}
+    void clear() { points.clear(); records.clear(); offsets.resize( 1 ); blocking.clear(); } // keeps capacity
+    std::size_t size() const { return points.size(); }
+};
+
+static comma::csv::options csv;
+static comma::signal_flag is_shutdown;
+static reference_index reference;
+static boost::optional< double > range_threshold;
+static boost::scoped_ptr< comma::csv::input_stream< point_t > > istream;
+static std::size_t batch_size;
+static boost::posix_time::time_duration latency;
+static comma::io::select input_select;
+static boost::scoped_array< batch_t > batches;
+static ::tbb::concurrent_bounded_queue< batch_t* > free_batches;
+
+static batch_t* read_batch_( ::tbb::flow_control& flow )
+{
+    if( is_shutdown || std::cout.bad() || !std::cin.good() || std::cin.eof() ) { flow.stop(); return NULL; }
+    batch_t* batch = NULL;
+    free_batches.pop( batch );
+    while( batch->size() < batch_size )
     {
-        const entry* e = NULL;
-        static const double threshold_square = threshold * threshold; // static: quick and dirty
-        boost::optional< point_t > min;
-        boost::optional< point_t > max;
-        for( std::size_t i = 0; i < points.size(); ++i )
+        const point_t* p = istream->read();
+        if( !p ) { break; }
+        batch->points.push_back( *p );
+        if( csv.binary() )
         {
-            double db = abs_bearing_distance_( p.bearing(), points[i].point.bearing() );
-            double de = p.elevation() - points[i].point.elevation();
-            if( ( db * db + de * de ) > threshold_square ) { continue; }
-            if( range_threshold && points[i].point.range() < ( p.range() + *range_threshold ) ) { return NULL; }
-            if( min ) // todo: quick and dirty, fix point_tRBE and use extents
-            {
-                if( points[i].point.range() < min->range() )
-                {
-                    min->range( points[i].point.range() );
-                    e = &points[i];
-                }
-                min->bearing( bearing_min_( min->bearing(), points[i].point.bearing() ) );
-                min->elevation( std::min( min->elevation(), points[i].point.elevation() ) );
-                max->bearing( bearing_max_( max->bearing(), points[i].point.bearing() ) );
-                max->elevation( std::max( max->elevation(), points[i].point.elevation() ) );
-            }
-            else
+            const char* begin = istream->binary().last();
+            batch->records.insert( batch->records.end(), begin, begin + csv.format().size() );
+        }
+        else
+        {
+            const std::vector< std::string >& values = istream->ascii().last();
+            for( std::size_t i = 0; i < values.size(); ++i )
             {
-                e = &points[i];
-                min = max = points[i].point;
+                if( i > 0 ) { batch->records.push_back( csv.delimiter ); }
+                batch->records.insert( batch->records.end(), values[i].begin(), values[i].end() );
             }
         }
-        return    !min
-               || !bearing_between_( p.bearing(), min->bearing(), max->bearing() )
-               || !comma::math::less( min->elevation(), p.elevation() )
-               || !comma::math::less( p.elevation(), max->elevation() ) ? NULL : e;
+        batch->offsets.push_back( batch->records.size() );
+        if( batch->size() == batch_size || istream->ready() || std::cin.rdbuf()->in_avail() > 0 ) { continue; }
+        if( input_select.wait( latency ) == 0 ) { break; } // do not wait for a full batch, if input stalls; on end of stream, the next read returns null
     }
-};
+    if( batch->size() > 0 ) { return batch; }
+    free_batches.push( batch );
+    flow.stop();
+    return NULL;
+}
+
+static batch_t* trace_batch_( batch_t* batch )
+{
+    if( !batch ) { return NULL; }
+    batch->blocking.resize( batch->size() );
+    for( std::size_t i = 0; i < batch->size(); ++i )
+    {
+        const point_t& p = batch->points[i];
+        boost::optional< reference_index::cell > c = reference.find( p.bearing(), p.elevation() );
+        batch->blocking[i] = c ? reference.trace( *c, p, range_threshold ) : NULL;
+    }
+    return batch;
+}
+
+static void write_batch_( batch_t* batch )
+{
+    if( !batch ) { return; }
+    static std::string buffer;
+    buffer.clear();
+    for( std::size_t i = 0; i < batch->size(); ++i )
+    {
+        const comma::uint64* q = batch->blocking[i];
+        if( !q ) { continue; }
+        buffer.append( &batch->records[ batch->offsets[i] ], batch->offsets[ i + 1 ] - batch->offsets[i] );
+        if( !csv.binary() ) { buffer += csv.delimiter; }
+        buffer.append( reference.record( *q ), reference.record_size( *q ) );
+        if( !csv.binary() ) { buffer += '\n'; }
+    }
+    if( !buffer.empty() ) { std::cout.write( &buffer[0], buffer.size() ); }
+    std::cout.flush();
+    batch->clear();
+    free_batches.push( batch );
+}
 
 int main( int argc, char** argv )
 {
     try
     {
+        std::ios_base::sync_with_stdio( false ); // so that buffered input is visible to in_avail()
         comma::command_line_options options( argc, argv );
         if( options.exists( "--help,-h" ) ) { usage(); }
         if( options.exists( "--long-help" ) ) { usage( true ); }
         verbose = options.exists( "--verbose,-v" );
-        comma::csv::options csv( options, "range,bearing,elevation" );
+        csv = comma::csv::options( options, "range,bearing,elevation" );
         std::vector< std::string > v = comma::split( csv.fields, ',' );
         for( unsigned int i = 0; i < v.size(); ++i )
         {
@@ -255,90 +506,60 @@ int main( int argc, char** argv )
         }
         csv.fields = comma::join( v, ',' );
         csv.full_xpath = false;
-        double threshold = options.value< double >( "--angle-threshold,-a" );
-        boost::optional< double > range_threshold = options.optional< double >( "--range-threshold,-r" );
-        std::vector< std::string > unnamed = options.unnamed( "--verbose,-v", "--binary,-b,--delimiter,-d,--fields,-f,--range-threshold,-r,--angle-threshold,-a" );
-        if( unnamed.empty() ) { std::cerr << "points-detect-change: please specify file with the reference point cloud" << std::endl; return 1; }
-        if( unnamed.size() > 1 ) { std::cerr << "points-detect-change: expected file with the reference point cloud, got: " << comma::join( unnamed, ' ' ) << std::endl; return 1; }
+        boost::optional< double > angle_threshold = options.optional< double >( "--angle-threshold,-a" );
+        range_threshold = options.optional< double >( "--range-threshold,-r" );
+        batch_size = options.value( "--batch-size", 4096u );
+        if( batch_size == 0 ) { std::cerr << "points-detect-change: expected batch size, got zero" << std::endl; return 1; }
+        latency = boost::posix_time::microseconds( static_cast< long >( options.value( "--latency", 0.01 ) * 1000000 ) );
+        input_select.read().add( 0 );
+        boost::optional< std::string > index_filename = options.optional< std::string >( "--index" );
+        boost::optional< std::string > save_index_filename = options.optional< std::string >( "--save-index" );
+        std::vector< std::string > unnamed = options.unnamed( "--verbose,-v", "--binary,-b,--delimiter,-d,--fields,-f,--range-threshold,-r,--angle-threshold,-a,--index,--save-index,--batch-size,--latency" );
         #ifdef WIN32
-            std::ios::openmode mode = 0;
-            if( csv.binary() )
-            {
-                mode |= std::ios::binary;
-                _setmode( _fileno( stdin ), _O_BINARY );
-                _setmode( _fileno( stdout ), _O_BINARY );
-            }
-            std::ifstream ifs( unnamed[0].c_str(), mode );
-        #else
-            std::ifstream ifs( unnamed[0].c_str() );
+        if( csv.binary() )
+        {
+            _setmode( _fileno( stdin ), _O_BINARY );
+            _setmode( _fileno( stdout ), _O_BINARY );
+        }
         #endif
-        if( !ifs.is_open() ) { std::cerr << "points-detect-change: failed to open \"" << unnamed[0] << "\"" << std::endl; return 1; }
-        comma::csv::input_stream< point_t > ifstream( ifs, csv );
-        typedef snark::voxel_map< cell, 2 > grid_t;
-        resolution = grid_t::point_type( threshold, threshold );
-        grid_t grid( resolution );
-        if( verbose ) { std::cerr << "points-detect-change: loading reference point cloud..." << std::endl; }
-        comma::signal_flag is_shutdown;
-        comma::uint64 index = 0;
-        //{ ProfilerStart( "points-detect-change.prof" );
-        std::deque< std::vector< char > > buffers;
-        while( ifs.good() && !ifs.eof() && !is_shutdown )
+        if( index_filename )
         {
-            const point_t* p = ifstream.read();
-            if( !p ) { break; }
-            cell::entry entry( *p, index );
-            for( int i = -1; i < 2; ++i )
-            {
-                for( int j = -1; j < 2; ++j )
-                {
-                    double bearing = p->bearing() + threshold * i;
-                    if( bearing < -M_PI ) { bearing += ( M_PI * 2 ); }
-                    else if( bearing >= M_PI ) { bearing -= ( M_PI * 2 ); }
-                    double elevation = p->elevation() + threshold * j;
-                    grid_t::iterator it = grid.touch_at( grid_t::point_type( bearing, elevation ) );
-                    it->second.add( entry ); //it->second.add_to_grid( entry );
-                }
-            }
-            buffers.push_back( std::vector< char >() ); // todo: quick and dirty; use memory map instead?
-            if( csv.binary() )
-            {
-                static unsigned int s = ifstream.binary().binary().format().size();
-                buffers.back().resize( s );
-                ::memcpy( &buffers.back()[0], ifstream.binary().last(), s );
-            }
-            else
-            {
-                std::string s = comma::join( ifstream.ascii().last(), csv.delimiter );
-                buffers.back().resize( s.size() );
-                ::memcpy( &buffers.back()[0], &s[0], s.size() );
-            }
-            ++index;
+            if( !unnamed.empty() ) { std::cerr << "points-detect-change: expected either reference point cloud or --index, got both" << std::endl; return 1; }
+            if( save_index_filename ) { std::cerr << "points-detect-change: expected either --index or --save-index, got both" << std::endl; return 1; }
+            if( verbose ) { std::cerr << "points-detect-change: mapping reference index \"" << *index_filename << "\"..." << std::endl; }
+            reference.load( *index_filename );
+            if( angle_threshold && !comma::math::equal( *angle_threshold, reference.threshold() ) ) { std::cerr << "points-detect-change: expected --angle-threshold " << reference.threshold() << " as in \"" << *index_filename << "\", got " << *angle_threshold << std::endl; return 1; }
+            if( reference.binary() != csv.binary() ) { std::cerr << "points-detect-change: reference index \"" << *index_filename << "\" has " << ( reference.binary() ? "binary" : "ascii" ) << " records, but input is " << ( csv.binary() ? "binary" : "ascii" ) << std::endl; return 1; }
+            resolution = grid_t::point_type( reference.threshold(), reference.threshold() );
         }
-        if( verbose ) { std::cerr << "points-detect-change: loaded reference point cloud: " << index << " points in a grid of size " << grid.size() << " voxels" << std::endl; }
-        comma::csv::input_stream< point_t > istream( std::cin, csv );
-        while( std::cin.good() && !std::cin.eof() && !is_shutdown )
+        else
         {
-            const point_t* p = istream.read();
-            if( !p ) { break; }
-            grid_t::const_iterator it = grid.find( grid_t::point_type( p->bearing(), p->elevation() ) );
-            if( it == grid.end() ) { continue; }
-            const cell::entry* q = it->second.trace( *p, threshold, range_threshold );
-            if( !q ) { continue; }
-            if( csv.binary() )
-            {
-                static unsigned int is = istream.binary().binary().format().size();
-                std::cout.write( istream.binary().last(), is );
-                static unsigned int fs = ifstream.binary().binary().format().size();
-                std::cout.write( &buffers[q->index][0], fs );
-            }
-            else
+            if( unnamed.empty() ) { std::cerr << "points-detect-change: please specify file with the reference point cloud" << std::endl; return 1; }
+            if( unnamed.size() > 1 ) { std::cerr << "points-detect-change: expected file with the reference point cloud, got: " << comma::join( unnamed, ' ' ) << std::endl; return 1; }
+            if( !angle_threshold ) { std::cerr << "points-detect-change: please specify --angle-threshold" << std::endl; return 1; }
+            std::ifstream ifs( unnamed[0].c_str(), csv.binary() ? std::ios::in | std::ios::binary : std::ios::in );
+            if( !ifs.is_open() ) { std::cerr << "points-detect-change: failed to open \"" << unnamed[0] << "\"" << std::endl; return 1; }
+            comma::csv::input_stream< point_t > ifstream( ifs, csv );
+            resolution = grid_t::point_type( *angle_threshold, *angle_threshold );
+            if( verbose ) { std::cerr << "points-detect-change: loading reference point cloud..." << std::endl; }
+            reference.build( ifstream, csv, *angle_threshold, is_shutdown );
+            if( is_shutdown ) { std::cerr << "points-detect-change: caught signal" << std::endl; return 1; }
+            if( save_index_filename )
             {
-                std::cout << comma::join( istream.ascii().last(), csv.delimiter )
-                          << csv.delimiter
-                          << std::string( &buffers[q->index][0], buffers[q->index].size() ) << std::endl;
+                reference.save( *save_index_filename );
+                if( verbose ) { std::cerr << "points-detect-change: saved reference index of " << reference.size() << " points in " << reference.cells() << " cells to \"" << *save_index_filename << "\"" << std::endl; }
+                return 0;
             }
         }
-        //} ProfilerStop();
+        if( verbose ) { std::cerr << "points-detect-change: loaded reference point cloud: " << reference.size() << " points in a grid of size " << reference.cells() << " voxels" << std::endl; }
+        istream.reset( new comma::csv::input_stream< point_t >( std::cin, csv ) );
+        unsigned int size = 2 * ::tbb::task_scheduler_init::default_num_threads(); // batches in flight
+        batches.reset( new batch_t[ size ] );
+        for( unsigned int i = 0; i < size; ++i ) { free_batches.push( &batches[i] ); }
+        ::tbb::filter_t< void, batch_t* > read_filter( ::tbb::filter::serial_in_order, &read_batch_ );
+        ::tbb::filter_t< batch_t*, batch_t* > trace_filter( ::tbb::filter::parallel, &trace_batch_ );
+        ::tbb::filter_t< batch_t*, void > write_filter( ::tbb::filter::serial_in_order, &write_batch_ );
+        ::tbb::parallel_pipeline( size, read_filter & trace_filter & write_filter );
         if( is_shutdown ) { std::cerr << "points-detect-change: caught signal" << std::endl; return 1; }
         return 0;
     }
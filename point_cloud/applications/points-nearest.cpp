@@ -0,0 +1,279 @@
+// This file is part of snark, a generic and flexible library for robotics research
+// Copyright (c) 2011 The University of Sydney
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. All advertising materials mentioning features or use of this software
+//    must display the following acknowledgement:
+//    This product includes software developed by the The University of Sydney.
+// 4. Neither the name of the The University of Sydney nor the
+//    names of its contributors may be used to endorse or promote products
+//    derived from this software without specific prior written permission.
+//
+// NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+// GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+// HOLDERS AND CONTRIBUTORS \"AS IS\" AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+// OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+// IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifdef WIN32
+#include <stdio.h>
+#include <fcntl.h>
+#include <io.h>
+#endif
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+#include <boost/optional.hpp>
+#include <comma/application/command_line_options.h>
+#include <comma/application/signal_flag.h>
+#include <comma/base/types.h>
+#include <comma/csv/stream.h>
+#include <comma/visiting/traits.h>
+#include <snark/point_cloud/kd_tree.h>
+#include <snark/visiting/eigen.h>
+
+static void usage()
+{
+    std::cerr << std::endl;
+    std::cerr << "for each point, find its nearest neighbours in the same block" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "usage: cat points.csv | points-nearest [<options>] > nearest.csv" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "output: for each point and each of its neighbours: <point record>,<neighbour record>,<distance>" << std::endl;
+    std::cerr << "        the point itself is not its own neighbour; nearest neighbours first" << std::endl;
+    std::cerr << "        binary output: input format, input format, d" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "<options>" << std::endl;
+    std::cerr << "    --k=<n>: number of nearest neighbours; default: 1" << std::endl;
+    std::cerr << "    --radius=<distance>: max distance to neighbours" << std::endl;
+    std::cerr << "                         if --k not given, output all neighbours within radius in no particular order" << std::endl;
+    std::cerr << "    --leaf-size=<n>: kd-tree leaf size (tuning); default: 8" << std::endl;
+    std::cerr << "    --verbose,-v: more output" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "<fields>" << std::endl;
+    std::cerr << "    required fields: x,y,z" << std::endl;
+    std::cerr << "    default: \"x,y,z\"" << std::endl;
+    std::cerr << "    block: data block id, if present, search in each data block separately" << std::endl;
+    std::cerr << "           if absent, read until the end of file/stream and then search" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << comma::csv::options::usage() << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "examples" << std::endl;
+    std::cerr << "    nearest neighbour of each point in each scan:" << std::endl;
+    std::cerr << "    cat scans.csv | points-nearest --fields=x,y,z,block > nearest.csv" << std::endl;
+    std::cerr << std::endl;
+    std::cerr << "    all neighbours within 0.5 metres:" << std::endl;
+    std::cerr << "    cat scans.bin | points-nearest --fields=t,x,y,z,block --binary=t,3d,ui --radius=0.5 > neighbours.bin" << std::endl;
+    std::cerr << std::endl;
+    exit( -1 );
+}
+
+struct input_t
+{
+    Eigen::Vector3d point;
+    comma::uint32 block;
+
+    input_t() : point( 0, 0, 0 ), block( 0 ) {}
+};
+
+namespace comma { namespace visiting {
+
+template <> struct traits< input_t >
+{
+    template < typename K, typename V > static void visit( const K&, input_t& p, V& v )
+    {
+        v.apply( "point", p.point );
+        v.apply( "block", p.block );
+    }
+
+    template < typename K, typename V > static void visit( const K&, const input_t& p, V& v )
+    {
+        v.apply( "point", p.point );
+        v.apply( "block", p.block );
+    }
+};
+
+} } // namespace comma { namespace visiting {
+
+static comma::csv::options csv;
+static bool verbose;
+static comma::signal_flag is_shutdown;
+
+/// block of points with their raw input records kept back to back, reused from block to block
+struct block_t
+{
+    std::vector< Eigen::Vector3d > points;
+    std::vector< char > records; // raw input records: binary as read or ascii lines without line ending
+    std::vector< std::size_t > offsets; // record i is [ offsets[i], offsets[i+1] ) in records
+    comma::uint32 id;
+
+    block_t() : offsets( 1, 0 ), id( 0 ) {}
+    void clear() { points.clear(); records.clear(); offsets.resize( 1 ); } // keeps capacity
+    std::size_t size() const { return points.size(); }
+    const char* record( std::size_t i ) const { return &records[ offsets[i] ]; }
+    std::size_t record_size( std::size_t i ) const { return offsets[ i + 1 ] - offsets[i]; }
+};
+
+static void append_record_( block_t& block, const input_t& p, comma::csv::input_stream< input_t >& istream )
+{
+    block.points.push_back( p.point );
+    if( csv.binary() )
+    {
+        const char* begin = istream.binary().last();
+        block.records.insert( block.records.end(), begin, begin + csv.format().size() );
+    }
+    else
+    {
+        const std::vector< std::string >& values = istream.ascii().last();
+        for( std::size_t i = 0; i < values.size(); ++i )
+        {
+            if( i > 0 ) { block.records.push_back( csv.delimiter ); }
+            block.records.insert( block.records.end(), values[i].begin(), values[i].end() );
+        }
+    }
+    block.offsets.push_back( block.records.size() );
+}
+
+/// read next block; return false on end of stream
+static bool read_block_( block_t& block, comma::csv::input_stream< input_t >& istream )
+{
+    static boost::optional< input_t > last;
+    static block_t last_record; // quick and dirty: holds the record of the first point of the next block
+    block.clear();
+    if( last )
+    {
+        block.id = last->block;
+        block.points.push_back( last->point );
+        block.records.swap( last_record.records );
+        block.offsets.push_back( block.records.size() );
+        last.reset();
+    }
+    while( !is_shutdown && std::cin.good() && !std::cin.eof() )
+    {
+        const input_t* p = istream.read();
+        if( !p ) { break; }
+        if( block.size() > 0 && p->block != block.id )
+        {
+            last = *p;
+            last_record.clear();
+            append_record_( last_record, *p, istream );
+            break;
+        }
+        block.id = p->block;
+        append_record_( block, *p, istream );
+    }
+    return block.size() > 0;
+}
+
+static const std::size_t output_buffer_size = 1 << 16;
+
+static void flush_( std::string& buffer )
+{
+    if( buffer.empty() ) { return; }
+    std::cout.write( &buffer[0], buffer.size() );
+    buffer.clear();
+}
+
+static void append_( std::string& buffer, const block_t& block, std::size_t i, std::size_t j, double distance )
+{
+    buffer.append( block.record( i ), block.record_size( i ) );
+    if( csv.binary() )
+    {
+        buffer.append( block.record( j ), block.record_size( j ) );
+        buffer.append( reinterpret_cast< const char* >( &distance ), sizeof( double ) );
+    }
+    else
+    {
+        char distance_string[32];
+        buffer += csv.delimiter;
+        buffer.append( block.record( j ), block.record_size( j ) );
+        buffer += csv.delimiter;
+        buffer.append( distance_string, std::sprintf( distance_string, "%.12g", distance ) );
+        buffer += '\n';
+    }
+    if( buffer.size() >= output_buffer_size ) { flush_( buffer ); }
+}
+
+int main( int ac, char** av )
+{
+    try
+    {
+        #ifdef WIN32
+        _setmode( _fileno( stdout ), _O_BINARY );
+        #endif
+        comma::command_line_options options( ac, av );
+        if( options.exists( "--help,-h" ) ) { usage(); }
+        csv = comma::csv::options( options, "x,y,z" );
+        verbose = options.exists( "--verbose,-v" );
+        boost::optional< double > radius = options.optional< double >( "--radius" );
+        boost::optional< std::size_t > k = options.optional< std::size_t >( "--k" );
+        std::size_t leaf_size = options.value( "--leaf-size", 8u );
+        if( !k && !radius ) { k = 1; }
+        if( k && *k == 0 ) { std::cerr << "points-nearest: expected number of nearest neighbours, got zero" << std::endl; usage(); }
+        if( radius && *radius < 0 ) { std::cerr << "points-nearest: expected non-negative radius, got " << *radius << std::endl; usage(); }
+        comma::csv::input_stream< input_t > istream( std::cin, csv );
+        block_t block;
+        std::vector< std::size_t > indices;
+        std::vector< double > squared_distances;
+        std::vector< std::vector< std::size_t > > within;
+        std::string buffer;
+        buffer.reserve( output_buffer_size + 1024 );
+        while( !is_shutdown && read_block_( block, istream ) )
+        {
+            snark::kd_tree< Eigen::Vector3d > tree( block.points.begin(), block.points.end(), leaf_size );
+            if( k )
+            {
+                std::size_t n = *k + 1; // the point itself is among its nearest
+                tree.nearest( block.points.begin(), block.points.end(), n, indices, squared_distances, radius ? *radius : std::numeric_limits< double >::max() );
+                for( std::size_t i = 0; i < block.size(); ++i )
+                {
+                    std::size_t count = 0;
+                    for( std::size_t j = i * n; j < ( i + 1 ) * n && count < *k && indices[j] < block.size(); ++j )
+                    {
+                        if( indices[j] == i ) { continue; }
+                        append_( buffer, block, i, indices[j], std::sqrt( squared_distances[j] ) );
+                        ++count;
+                    }
+                }
+            }
+            else
+            {
+                tree.within( block.points.begin(), block.points.end(), *radius, within );
+                for( std::size_t i = 0; i < block.size(); ++i )
+                {
+                    for( std::size_t j = 0; j < within[i].size(); ++j )
+                    {
+                        if( within[i][j] == i ) { continue; }
+                        append_( buffer, block, i, within[i][j], ( block.points[i] - block.points[ within[i][j] ] ).norm() );
+                    }
+                }
+            }
+            flush_( buffer );
+            std::cout.flush();
+            if( verbose ) { std::cerr << "points-nearest: block " << block.id << ": " << block.size() << " point(s)" << std::endl; }
+        }
+        if( is_shutdown ) { std::cerr << "points-nearest: caught signal" << std::endl; return 1; }
+        return 0;
+    }
+    catch( std::exception& ex ) { std::cerr << "points-nearest: " << ex.what() << std::endl; }
+    catch( ... ) { std::cerr << "points-nearest: unknown exception" << std::endl; }
+    return 1;
+}
@@ -36,13 +36,27 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <io.h>
+#else
+#include <unistd.h>
 #endif
-
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <boost/array.hpp>
+#include <boost/program_options.hpp>
+#include <Eigen/Core>
 #include <comma/application/signal_flag.h>
 #include <comma/base/exception.h>
+#include <comma/csv/ascii.h>
+#include <comma/csv/binary.h>
 #include <comma/csv/stream.h>
 #include <comma/csv/impl/program_options.h>
 #include <comma/math/compare.h>
+#include <comma/string/string.h>
 #include <comma/visiting/traits.h>
 #include <snark/visiting/eigen.h>
 
@@ -54,6 +68,60 @@
 // boost::uniform_real< double > distribution( 0, 1 );
 // boost::variate_generator< boost::mt19937&, boost::uniform_real< double > > r( generator, distribution );
 
+struct plane_t
+{
+    Eigen::Vector3d point;
+    Eigen::Vector3d normal;
+};
+
+/// parse plane given either as point and normal (6 values) or as 3 points (9 values)
+static plane_t make_plane_( const std::string& s, const std::string& point_outside )
+{
+    std::vector< std::string > v = comma::split( s, ',' );
+    plane_t plane;
+    comma::csv::ascii< Eigen::Vector3d > ascii( "x,y,z", ',' );
+    if( v.size() == 6 )
+    {
+        plane.point = ascii.get( v[0] + ',' + v[1] + ',' + v[2] );
+        plane.normal = ascii.get( v[3] + ',' + v[4] + ',' + v[5] );
+    }
+    else if( v.size() == 9 )
+    {
+        plane.point = ascii.get( v[0] + ',' + v[1] + ',' + v[2] ); // quick and dirty
+        Eigen::Vector3d a = ascii.get( v[3] + ',' + v[4] + ',' + v[5] ); // quick and dirty
+        Eigen::Vector3d b = ascii.get( v[6] + ',' + v[7] + ',' + v[8] ); // quick and dirty
+        a -= plane.point;
+        b -= plane.point;
+        if( comma::math::equal( std::abs( a.dot( b ) ), a.norm() * b.norm() ) ) { std::cerr << "points-slice: given points are not corners or a triangle: \"" << s << "\"" << std::endl; }
+        plane.normal = a.cross( b );
+        if( !point_outside.empty() )
+        {
+            Eigen::Vector3d p = ascii.get( point_outside );
+            if( comma::math::equal( plane.normal.dot( p - plane.point ), 0 ) ) { COMMA_THROW( comma::exception, "expected a point not on the plane, got: " << point_outside ); }
+            plane.normal *= plane.normal.dot( p - plane.point ) > 0 ? 1 : -1;
+        }
+    }
+    else
+    {
+        COMMA_THROW( comma::exception, "expected 3 points or point and normal, got: \"" << s << "\"" );
+    }
+    plane.normal.normalize();
+    return plane;
+}
+
+typedef Eigen::Matrix< double, Eigen::Dynamic, 3 > points_type;
+typedef Eigen::Matrix< double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor > distances_type;
+
+static const std::size_t output_buffer_size = 1 << 16;
+
+static void flush_( std::string& buffer )
+{
+    if( buffer.empty() ) { return; }
+    std::cout.write( &buffer[0], buffer.size() );
+    std::cout.flush();
+    buffer.clear();
+}
+
 int main( int argc, char** argv )
 {
 //     for( unsigned int i = 0; i < boost::lexical_cast< unsigned int >( argv[1] ); ++i )
@@ -67,82 +135,132 @@ int main( int argc, char** argv )
 
     try
     {
-        std::string normal_string;
-        std::string points_string;
-        std::string point_outside;
+        std::ios_base::sync_with_stdio( false ); // so that buffered input is visible to in_avail()
+        std::vector< std::string > normal_strings;
+        std::vector< std::string > points_strings;
+        std::vector< std::string > point_outside_strings;
+        std::string planes_filename;
         boost::program_options::options_description description( "options" );
         description.add_options()
             ( "help,h", "display help message" )
-            ( "points,p", boost::program_options::value< std::string >( &points_string )->default_value( "0,0,0" ), "point(s) belonging to the plane, either 3 points, or 1 point, if --normal defined" )
-            ( "point-outside", boost::program_options::value< std::string >( &points_string ), "point on the side of the plane where the normal would point, a convenience option; 3 points are enough" )
-            ( "normal,n", boost::program_options::value< std::string >( &normal_string ), "normal to the plane" );
+            ( "points,p", boost::program_options::value< std::vector< std::string > >( &points_strings )->default_value( std::vector< std::string >( 1, "0,0,0" ), "0,0,0" ), "point(s) belonging to the plane, either 3 points, or 1 point, if --normal defined; repeat for multiple planes" )
+            ( "point-outside", boost::program_options::value< std::vector< std::string > >( &point_outside_strings ), "point on the side of the plane where the normal would point, a convenience option; 3 points are enough; if given once, applies to all the planes, otherwise repeat for each plane" )
+            ( "normal,n", boost::program_options::value< std::vector< std::string > >( &normal_strings ), "normal to the plane; repeat for multiple planes, in the same order as --points" )
+            ( "planes", boost::program_options::value< std::string >( &planes_filename ), "file with planes, one per line, either as point and normal: x,y,z,normal/x,normal/y,normal/z, or as 3 points" );
         description.add( comma::csv::program_options::description( "x,y,z" ) );
         boost::program_options::variables_map vm;
         boost::program_options::store( boost::program_options::parse_command_line( argc, argv, description), vm );
         boost::program_options::notify( vm );
         if ( vm.count( "help" ) )
         {
-            std::cerr << "take points on stdin, append distance from a given plane" << std::endl;
+            std::cerr << "take points on stdin, append distance from given plane(s)" << std::endl;
             std::cerr << std::endl;
             std::cerr << "usage: cat points.csv | points-slice [options] > points_with_distance.csv" << std::endl;
             std::cerr << std::endl;
             std::cerr << "input: points: x,y,z; default: x,y,z" << std::endl;
-            std::cerr << "output: x,y,z,distance" << std::endl;
-            std::cerr << "binary output format: <input_format>,d" << std::endl;
+            std::cerr << "output: x,y,z,distance[,distance...]: distance to each plane, planes on command line first, then planes from --planes file" << std::endl;
+            std::cerr << "binary output format: <input_format>,d[,d...]" << std::endl;
             std::cerr << std::endl;
             std::cerr << description << std::endl;
             std::cerr << std::endl;
+            std::cerr << "examples" << std::endl;
+            std::cerr << "    slices at 1 metre along x and y in a single pass" << std::endl;
+            std::cerr << "    cat points.csv | points-slice --normal=1,0,0 --points=1,0,0 --normal=0,1,0 --points=0,1,0" << std::endl;
+            std::cerr << std::endl;
             return 1;
         }
-        if( vm.count( "points" ) == 0 ) { std::cerr << "points-slice: please specify --points" << std::endl; return 1; }
         comma::csv::options csv = comma::csv::program_options::get( vm );
-        Eigen::Vector3d normal;
-        Eigen::Vector3d point;
-        if( vm.count( "normal" ) )
+        std::vector< plane_t > planes;
+        if( !normal_strings.empty() )
         {
-            normal = comma::csv::ascii< Eigen::Vector3d >( "x,y,z", ',' ).get( normal_string );
-            point = comma::csv::ascii< Eigen::Vector3d >( "x,y,z", ',' ).get( points_string );
+            if( normal_strings.size() != points_strings.size() ) { std::cerr << "points-slice: expected same number of --normal and --points, got " << normal_strings.size() << " and " << points_strings.size() << std::endl; return 1; }
+            for( std::size_t i = 0; i < normal_strings.size(); ++i ) { planes.push_back( make_plane_( points_strings[i] + ',' + normal_strings[i], "" ) ); }
         }
-        else
+        else if( !vm[ "points" ].defaulted() || planes_filename.empty() )
         {
-            boost::array< Eigen::Vector3d, 3 > points; // quick and dirty
-            std::vector< std::string > v = comma::split( points_string, ',' );
-            if( v.size() != 9 ) { std::cerr << "points-slice: expected 3 points, got: \"" << points_string << "\"" << std::endl; return 1; }
-            point = comma::csv::ascii< Eigen::Vector3d >( "x,y,z", ',' ).get( v[0] + ',' + v[1] + ',' + v[2] ); // quick and dirty
-            Eigen::Vector3d a = comma::csv::ascii< Eigen::Vector3d >( "x,y,z", ',' ).get( v[3] + ',' + v[4] + ',' + v[5] ); // quick and dirty
-            Eigen::Vector3d b = comma::csv::ascii< Eigen::Vector3d >( "x,y,z", ',' ).get( v[6] + ',' + v[7] + ',' + v[8] ); // quick and dirty
-            a -= point;
-            b -= point;
-            if( comma::math::equal( std::abs( a.dot( b ) ), a.norm() * b.norm() ) ) { std::cerr << "points-slice: given points are not corners or a triangle: \"" << points_string << "\"" << std::endl; }
-            normal = a.cross( b );
-            if( vm.count( "point-outside" ) )
+            if( point_outside_strings.size() > 1 && point_outside_strings.size() != points_strings.size() ) { std::cerr << "points-slice: expected --point-outside once or once per plane, got " << point_outside_strings.size() << " for " << points_strings.size() << " plane(s)" << std::endl; return 1; }
+            for( std::size_t i = 0; i < points_strings.size(); ++i )
             {
-                Eigen::Vector3d p = comma::csv::ascii< Eigen::Vector3d >( "x,y,z", ',' ).get( point_outside );
-                if( comma::math::equal( a.dot( p - point ), 0 ) ) { std::cerr << "points-slice: expected a point not on the plane, got: " << point_outside << std::endl; return 1; }
-                normal *= normal.dot( p - point ) > 0 ? 1 : -1;
+                std::vector< std::string > v = comma::split( points_strings[i], ',' );
+                if( v.size() != 9 ) { std::cerr << "points-slice: expected 3 points, got: \"" << points_strings[i] << "\"" << std::endl; return 1; }
+                planes.push_back( make_plane_( points_strings[i], point_outside_strings.empty() ? std::string() : point_outside_strings[ point_outside_strings.size() == 1 ? 0 : i ] ) );
             }
         }
-        normal.normalize();
+        if( !planes_filename.empty() )
+        {
+            std::ifstream ifs( planes_filename.c_str() );
+            if( !ifs.is_open() ) { std::cerr << "points-slice: failed to open \"" << planes_filename << "\"" << std::endl; return 1; }
+            std::string line;
+            while( std::getline( ifs, line ) )
+            {
+                line = comma::strip( line );
+                if( line.empty() || line[0] == '#' ) { continue; }
+                planes.push_back( make_plane_( line, point_outside_strings.size() == 1 ? point_outside_strings[0] : std::string() ) );
+            }
+        }
+        if( planes.empty() ) { std::cerr << "points-slice: please specify planes" << std::endl; return 1; }
+        Eigen::Matrix< double, 3, Eigen::Dynamic > normals( 3, planes.size() );
+        Eigen::Matrix< double, 1, Eigen::Dynamic > offsets( planes.size() );
+        for( std::size_t i = 0; i < planes.size(); ++i ) { normals.col( i ) = planes[i].normal; offsets[i] = planes[i].point.dot( planes[i].normal ); }
         #ifdef WIN32
             _setmode( _fileno( stdout ), _O_BINARY ); /// @todo move to a library
         #endif
-        comma::csv::input_stream< Eigen::Vector3d > istream( std::cin, csv );
         comma::signal_flag is_shutdown;
-        while( !is_shutdown && ( istream.ready() || ( !std::cin.eof() && std::cin.good() ) ) )
+        std::string obuf;
+        obuf.reserve( output_buffer_size + 1024 );
+        if( csv.binary() )
         {
-            const Eigen::Vector3d* p = istream.read();
-            if( !p ) { break; }
-            double d = ( *p - point ).dot( normal );
-            if( csv.binary() )
+            #ifdef WIN32
+                _setmode( _fileno( stdin ), _O_BINARY );
+            #endif
+            // read raw records in batches straight from stdin and get distances to all the planes as a single matrix product
+            comma::csv::binary< Eigen::Vector3d > binary( csv );
+            const std::size_t record_size = csv.format().size();
+            const std::size_t batch_size = std::max( std::size_t( 1 ), std::size_t( 65536 ) / record_size );
+            std::vector< char > buffer( batch_size * record_size );
+            points_type points( batch_size, 3 );
+            distances_type distances( batch_size, planes.size() );
+            Eigen::Vector3d p;
+            std::size_t size = 0; // bytes in buffer, including incomplete record
+            while( !is_shutdown && std::cout.good() )
             {
-                std::cout.write( istream.binary().last(), istream.binary().binary().format().size() );
-                std::cout.write( reinterpret_cast< const char* >( &d ), sizeof( double ) );
+                int count = ::read( 0, &buffer[size], buffer.size() - size );
+                if( count <= 0 ) { break; }
+                bool idle = size + count < buffer.size(); // read less than asked: input ran dry for now
+                size += count;
+                std::size_t n = size / record_size;
+                for( std::size_t i = 0; i < n; ++i ) { binary.get( p, &buffer[ i * record_size ] ); points.row( i ) = p.transpose(); }
+                distances.topRows( n ).noalias() = points.topRows( n ) * normals;
+                distances.topRows( n ).rowwise() -= offsets;
+                for( std::size_t i = 0; i < n; ++i )
+                {
+                    obuf.append( &buffer[ i * record_size ], record_size );
+                    obuf.append( reinterpret_cast< const char* >( &distances( i, 0 ) ), planes.size() * sizeof( double ) );
+                    if( obuf.size() >= output_buffer_size ) { flush_( obuf ); }
+                }
+                if( idle ) { flush_( obuf ); }
+                size -= n * record_size;
+                if( size > 0 ) { std::memmove( &buffer[0], &buffer[ n * record_size ], size ); }
             }
-            else
+        }
+        else
+        {
+            comma::csv::input_stream< Eigen::Vector3d > istream( std::cin, csv );
+            Eigen::Matrix< double, 1, Eigen::Dynamic > distances( planes.size() );
+            char buf[32];
+            while( !is_shutdown && ( istream.ready() || ( !std::cin.eof() && std::cin.good() ) ) )
             {
-                std::cout << comma::join( istream.ascii().last(), csv.delimiter ) << csv.delimiter << d << std::endl;
+                const Eigen::Vector3d* p = istream.read();
+                if( !p ) { break; }
+                distances.noalias() = p->transpose() * normals;
+                distances -= offsets;
+                obuf += comma::join( istream.ascii().last(), csv.delimiter );
+                for( std::size_t i = 0; i < planes.size(); ++i ) { obuf += csv.delimiter; obuf.append( buf, std::sprintf( buf, "%g", distances[i] ) ); }
+                obuf += '\n';
+                if( obuf.size() >= output_buffer_size || std::cin.rdbuf()->in_avail() <= 0 ) { flush_( obuf ); }
             }
         }
+        flush_( obuf );
         return 0;
     }
     catch( std::exception& ex )
@@ -38,16 +38,18 @@
 #include <fcntl.h>
 #include <io.h>
 #endif
-#include <deque>
+#include <cstdio>
 #include <iostream>
 #include <limits>
 #include <map>
 #include <sstream>
 #include <vector>
+#include <tbb/concurrent_queue.h>
 #include <tbb/pipeline.h>
 #include <tbb/task_scheduler_init.h>
 #include <boost/array.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/scoped_array.hpp>
 #include <boost/scoped_ptr.hpp>
 #include <boost/thread/mutex.hpp>
 #include <comma/application/command_line_options.h>
@@ -82,6 +84,8 @@ static void usage()
     std::cerr << "        --min-points-per-partition <n>: min number of points in a partition; default: 1" << std::endl;
     std::cerr << "        --resolution <resolution>: default: 0.2 metres" << std::endl;
     std::cerr << "    data flow options:" << std::endl;
+    std::cerr << "        --blocks-in-flight <n>: max number of blocks being read, partitioned and written at the same time; default: 3" << std::endl;
+    std::cerr << "                                blocks are partitioned in parallel, memory use is bounded by the number of blocks" << std::endl;
     std::cerr << "        --discard,-d: if present, partition as many points as possible, discard the rest" << std::endl;
     std::cerr << "        --output-all: output all points, even non-partitioned; the latter with id: max uint32" << std::endl;
     std::cerr << "        --verbose, -v: output progress info" << std::endl;
@@ -152,104 +156,156 @@ template <> struct traits< input_t >
 
 } } // namespace ark { namespace visiting {
 
-struct block_t // quick and dirty, no optimization for now
+/// block of points with their raw input records kept back to back
+/// in a single arena, reused from block to block to avoid allocating per point
+struct block_t
 {
-    typedef std::pair< input_t, std::string > pair_t;
-    typedef std::deque< pair_t > pairs_t;
-
-    boost::scoped_ptr< pairs_t > points;
+    std::vector< input_t > points;
+    std::vector< char > records; // raw input records: binary as read or ascii lines without line ending
+    std::vector< std::size_t > offsets; // record i is [ offsets[i], offsets[i+1] ) in records
     comma::uint32 id;
-    volatile bool empty;
     boost::scoped_ptr< snark::partition > partition;
 
-    block_t() : id( 0 ), empty( true ) {}
-    void clear() { partition.reset(); points.reset(); empty = true; }
+    block_t() : offsets( 1, 0 ), id( 0 ) {}
+    void clear() { partition.reset(); points.clear(); records.clear(); offsets.resize( 1 ); } // keeps capacity
+    std::size_t size() const { return points.size(); }
+    const char* record( std::size_t i ) const { return &records[ offsets[i] ]; }
+    std::size_t record_size( std::size_t i ) const { return offsets[ i + 1 ] - offsets[i]; }
+    void push_back( const input_t& point, const char* record, std::size_t size )
+    {
+        points.push_back( point );
+        records.insert( records.end(), record, record + size );
+        offsets.push_back( records.size() );
+    }
+    void swap_points( block_t& rhs ) { points.swap( rhs.points ); records.swap( rhs.records ); offsets.swap( rhs.offsets ); }
 };
 
 static comma::signal_flag is_shutdown;
 static boost::scoped_ptr< snark::tbb::bursty_reader< block_t* > > bursty_reader;
+static unsigned int blocks_in_flight;
+static boost::scoped_array< block_t > blocks; // the only blocks ever allocated, thus memory is bounded by --blocks-in-flight
+static ::tbb::concurrent_bounded_queue< block_t* > free_blocks; // blocks not being read, partitioned or written
+
+static void append_record_( std::vector< char >& buffer, comma::csv::input_stream< input_t >& istream )
+{
+    buffer.clear();
+    if( csv.binary() )
+    {
+        const char* begin = istream.binary().last();
+        buffer.insert( buffer.end(), begin, begin + csv.format().size() );
+        return;
+    }
+    const std::vector< std::string >& values = istream.ascii().last();
+    for( std::size_t i = 0; i < values.size(); ++i )
+    {
+        if( i > 0 ) { buffer.push_back( csv.delimiter ); }
+        buffer.insert( buffer.end(), values[i].begin(), values[i].end() );
+    }
+}
 
 static block_t* read_block_impl_( ::tbb::flow_control* flow = NULL )
 {
-    static boost::array< block_t, 3 > blocks;
-    static boost::optional< block_t::pair_t > last;
+    static block_t reading; // arena being filled; swapped with a free block once complete
+    static input_t last;
+    static std::vector< char > last_record;
+    static std::vector< char > record;
+    static bool has_last = false;
     static comma::uint32 block_id = 0;
-    block_t::pairs_t* points = new block_t::pairs_t;
     while( true ) // quick and dirty, only if --discard
     {
         static comma::csv::input_stream< input_t > istream( std::cin, csv );
-        points->clear();
+        reading.clear();
+        bool end = false;
         while( true )
         {
-            if( last )
+            if( has_last )
             {
-                block_id = last->first.block;
-                points->push_back( *last );
-                last.reset();
+                block_id = last.block;
+                reading.push_back( last, &last_record[0], last_record.size() );
+                has_last = false;
             }
             if( is_shutdown || std::cout.bad() || std::cin.bad() || std::cin.eof() )
             {
+                if( reading.size() > 0 ) { end = true; break; } // output the last block, stop on the next call
                 if( bursty_reader ) { bursty_reader->stop(); } // quick and dirty, it sucks...
                 if( flow ) { flow->stop(); }
-                break;
+                return NULL;
             }
             const input_t* p = istream.read();
-            if( !p ) { break; }
-            std::string line;
-            if( csv.binary() )
-            {
-                line.resize( csv.format().size() );
-                ::memcpy( &line[0], istream.binary().last(), csv.format().size() );
-            }
-            else
+            if( !p ) { end = true; break; }
+            append_record_( record, istream );
+            if( reading.size() > 0 && p->block != block_id )
             {
-                line = comma::join( istream.ascii().last(), csv.delimiter );
+                last = *p;
+                last_record.swap( record );
+                has_last = true;
+                break;
             }
-            last = std::make_pair( *p, line );
-            if( p->block != block_id ) { break; }
-        }
-        for( unsigned int i = 0; i < blocks.size(); ++i )
-        {
-            if( !blocks[i].empty ) { continue; }
-            blocks[i].clear();
-            blocks[i].id = block_id;
-            blocks[i].points.reset( points );
-            blocks[i].empty = false;
-            return &blocks[i];
+            block_id = p->block;
+            reading.push_back( *p, &record[0], record.size() );
         }
+        block_t* block = NULL;
+        if( discard && !end ) { if( !free_blocks.try_pop( block ) ) { continue; } } // all blocks in flight: discard this one
+        else { free_blocks.pop( block ); }
+        block->id = block_id;
+        block->swap_points( reading );
+        return block;
     }
 }
 
 static block_t* read_block_( ::tbb::flow_control& flow ) { return read_block_impl_( &flow ); }
 static block_t* read_block_bursty_() { return read_block_impl_(); }
 
+static const std::size_t output_buffer_size = 1 << 16;
+
+static void flush_( std::string& buffer )
+{
+    if( buffer.empty() ) { return; }
+    std::cout.write( &buffer[0], buffer.size() );
+    buffer.clear();
+}
+
 static void write_block_( block_t* block )
 {
     if( !block ) { return; } // quick and dirty for now, only if --discard
-    for( std::size_t i = 0; i < block->points->size(); ++i )
+    static std::string buffer;
+    buffer.reserve( output_buffer_size + 1024 );
+    char id_string[16];
+    for( std::size_t i = 0; i < block->size(); ++i )
     {
-        const block_t::pair_t& p = block->points->operator[]( i );
-        if( !( p.first.id && *p.first.id ) && !output_all ) { continue; }
-        comma::uint32 id = p.first.id && *p.first.id ? **p.first.id : std::numeric_limits< comma::uint32 >::max();
-        std::cout.write( &p.second[0], p.second.size() );
-        if( csv.binary() ) { std::cout.write( reinterpret_cast< const char* >( &id ), sizeof( comma::uint32 ) ); }
-        else { std::cout << csv.delimiter << id << std::endl; }
+        const input_t& p = block->points[i];
+        if( !( p.id && *p.id ) && !output_all ) { continue; }
+        comma::uint32 id = p.id && *p.id ? **p.id : std::numeric_limits< comma::uint32 >::max();
+        buffer.append( block->record( i ), block->record_size( i ) );
+        if( csv.binary() )
+        {
+            buffer.append( reinterpret_cast< const char* >( &id ), sizeof( comma::uint32 ) );
+        }
+        else
+        {
+            buffer += csv.delimiter;
+            buffer.append( id_string, std::sprintf( id_string, "%u", id ) );
+            buffer += '\n';
+        }
+        if( buffer.size() >= output_buffer_size ) { flush_( buffer ); }
     }
+    flush_( buffer );
     std::cout.flush();
     block->clear();
+    free_blocks.push( block );
 }
 
 static block_t* partition_( block_t* block )
 {
     if( !block ) { return NULL; } // quick and dirty for now, only if --discard
-    if( block->points->empty() ) { return block; }
+    if( block->points.empty() ) { return block; }
     snark::math::closed_interval< double, 3 > extents;
-    for( std::size_t i = 0; i < block->points->size(); ++i ) { extents.set_hull( block->points->operator[](i).first.point ); }
+    for( std::size_t i = 0; i < block->size(); ++i ) { extents.set_hull( block->points[i].point ); }
     block->partition.reset( new snark::partition( extents, resolution, min_points_per_voxel ) );
-    for( std::size_t i = 0; i < block->points->size(); ++i )
+    for( std::size_t i = 0; i < block->size(); ++i )
     {
-        block_t::pair_t& p = block->points->operator[]( i );
-        if( p.first.flag ) { p.first.id = &block->partition->insert( p.first.point ); }
+        input_t& p = block->points[i];
+        if( p.flag ) { p.id = &block->partition->insert( p.point ); }
     }
     block->partition->commit( min_voxels_per_partition, min_points_per_partition, min_id, min_density );
     return block;
@@ -276,7 +332,11 @@ int main( int ac, char** av )
         discard = options.exists( "--discard,-d" );
         min_id = options.value( "--min-id", 0 );
         output_all = options.exists( "--output-all" );
-        ::tbb::filter_t< block_t*, block_t* > partition_filter( ::tbb::filter::serial_in_order, &partition_ );
+        blocks_in_flight = options.value( "--blocks-in-flight", 3u );
+        if( blocks_in_flight == 0 ) { std::cerr << "points-to-partitions: expected number of blocks in flight, got zero" << std::endl; usage(); }
+        blocks.reset( new block_t[ blocks_in_flight ] );
+        for( unsigned int i = 0; i < blocks_in_flight; ++i ) { free_blocks.push( &blocks[i] ); }
+        ::tbb::filter_t< block_t*, block_t* > partition_filter( ::tbb::filter::parallel, &partition_ );
         ::tbb::filter_t< block_t*, void > write_filter( ::tbb::filter::serial_in_order, &write_block_ );
         #ifdef PROFILE
         ProfilerStart( "points-to-partitions.prof" ); {
@@ -285,14 +345,14 @@ int main( int ac, char** av )
         {
             bursty_reader.reset( new snark::tbb::bursty_reader< block_t* >( &read_block_bursty_ ) );
             ::tbb::filter_t< void, void > filters = bursty_reader->filter() & partition_filter & write_filter;
-            while( bursty_reader->wait() ) { ::tbb::parallel_pipeline( 3, filters ); }
+            while( bursty_reader->wait() ) { ::tbb::parallel_pipeline( blocks_in_flight, filters ); }
             bursty_reader->join();
         }
         else
         {
             ::tbb::filter_t< void, block_t* > read_filter( ::tbb::filter::serial_in_order, &read_block_ );
             ::tbb::filter_t< void, void > filters = read_filter & partition_filter & write_filter;
-            ::tbb::parallel_pipeline( 3, filters );
+            ::tbb::parallel_pipeline( blocks_in_flight, filters );
         }
         #ifdef PROFILE
         ProfilerStop(); }
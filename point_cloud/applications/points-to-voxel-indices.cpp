@@ -31,7 +31,22 @@
 // IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 
+#ifdef WIN32
+#include <stdio.h>
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <boost/array.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/optional.hpp>
 #include <boost/program_options.hpp>
 #include <comma/base/exception.h>
@@ -39,6 +54,7 @@
 #include <comma/application/signal_flag.h>
 #include <comma/base/types.h>
 #include <comma/csv/ascii.h>
+#include <comma/csv/binary.h>
 #include <comma/csv/stream.h>
 #include <comma/csv/impl/program_options.h>
 #include <comma/string/string.h>
@@ -46,22 +62,113 @@
 #include <snark/point_cloud/voxel_map.h>
 #include <snark/visiting/eigen.h>
 
-typedef Eigen::Vector3d input_point;
+struct input_point
+{
+    Eigen::Vector3d point;
+    comma::uint32 block;
+
+    input_point() : point( 0, 0, 0 ), block( 0 ) {}
+};
 
-typedef snark::voxel_map< input_point, 3 >::index_type index_type;
+namespace comma { namespace visiting {
+
+template <> struct traits< input_point >
+{
+    template < typename K, typename V > static void visit( const K&, input_point& p, V& v )
+    {
+        v.apply( "point", p.point );
+        v.apply( "block", p.block );
+    }
+
+    template < typename K, typename V > static void visit( const K&, const input_point& p, V& v )
+    {
+        v.apply( "point", p.point );
+        v.apply( "block", p.block );
+    }
+};
+
+} } // namespace comma { namespace visiting {
+
+typedef snark::voxel_map< Eigen::Vector3d, 3 >::index_type index_type;
+
+/// output buffer written to stdout when full, when its oldest data exceeds latency, or on demand
+class output_buffer
+{
+    public:
+        output_buffer( std::size_t size, const boost::optional< boost::posix_time::time_duration >& latency ) : size_( size ), latency_( latency ) { buffer_.reserve( size + 1024 ); }
+
+        ~output_buffer() { flush(); }
+
+        void write( const char* buf, std::size_t size )
+        {
+            if( latency_ && buffer_.empty() ) { oldest_ = boost::posix_time::microsec_clock::universal_time(); }
+            buffer_.append( buf, size );
+        }
+
+        /// @return true, if buffer is full or its data is older than latency
+        bool due() const
+        {
+            if( buffer_.size() >= size_ ) { return true; }
+            return latency_ && !buffer_.empty() && boost::posix_time::microsec_clock::universal_time() - oldest_ >= *latency_;
+        }
+
+        void flush()
+        {
+            if( buffer_.empty() ) { return; }
+            std::cout.write( &buffer_[0], buffer_.size() );
+            std::cout.flush();
+            buffer_.clear();
+        }
+
+    private:
+        std::string buffer_;
+        std::size_t size_;
+        boost::optional< boost::posix_time::time_duration > latency_;
+        boost::posix_time::ptime oldest_;
+};
+
+/// compute voxel indices for a batch of coordinates along one dimension
+/// @note same result as voxel_map::index_of(), i.e. floor, two coordinates at a time if sse2 is available
+static void index_of_( const double* coordinates, comma::int32* indices, std::size_t size, double origin, double resolution )
+{
+    std::size_t i = 0;
+    #ifdef __SSE2__
+    const __m128d o = _mm_set1_pd( origin );
+    const __m128d r = _mm_set1_pd( resolution );
+    const __m128d one = _mm_set1_pd( 1 );
+    for( ; i + 2 <= size; i += 2 )
+    {
+        __m128d d = _mm_div_pd( _mm_sub_pd( _mm_loadu_pd( coordinates + i ), o ), r );
+        __m128d t = _mm_cvtepi32_pd( _mm_cvttpd_epi32( d ) ); // truncated
+        __m128d f = _mm_sub_pd( t, _mm_and_pd( _mm_cmplt_pd( d, t ), one ) ); // floored
+        _mm_storel_epi64( reinterpret_cast< __m128i* >( indices + i ), _mm_cvttpd_epi32( f ) );
+    }
+    #endif
+    for( ; i < size; ++i )
+    {
+        double d = ( coordinates[i] - origin ) / resolution;
+        comma::int32 t = static_cast< comma::int32 >( d ); // truncated
+        indices[i] = t - ( d < t ); // floored
+    }
+}
 
 int main( int argc, char** argv )
 {
     try
     {
+        std::ios_base::sync_with_stdio( false ); // so that buffered input is visible to in_avail()
         std::string binary;        
         std::string origin_string;
         std::string resolution_string;
+        std::size_t flush_size;
+        double flush_latency;
         boost::program_options::options_description description( "options" );
         description.add_options()
             ( "help,h", "display help message" )
             ( "resolution", boost::program_options::value< std::string >( &resolution_string ), "voxel map resolution, e.g. \"0.2\" or \"0.2,0.2,0.5\"" )
-            ( "origin", boost::program_options::value< std::string >( &origin_string )->default_value( "0,0,0" ), "voxel map origin" );
+            ( "origin", boost::program_options::value< std::string >( &origin_string )->default_value( "0,0,0" ), "voxel map origin" )
+            ( "flush-size", boost::program_options::value< std::size_t >( &flush_size )->default_value( 65536 ), "output is flushed when it reaches this number of bytes, when input runs dry, or at the end of each block; 0: flush after each point" )
+            ( "flush-latency", boost::program_options::value< double >( &flush_latency ), "if present, also flush when buffered output is older than given number of seconds" );
         description.add( comma::csv::program_options::description( "x,y,z" ) );
         boost::program_options::variables_map vm;
         boost::program_options::store( boost::program_options::parse_command_line( argc, argv, description), vm );
@@ -72,7 +179,8 @@ int main( int argc, char** argv )
             std::cerr << std::endl;
             std::cerr << "usage: cat points.csv | points-to-voxel-indices [options] > indexed_points.csv" << std::endl;
             std::cerr << std::endl;
-            std::cerr << "input fields: default: x,y,z" << std::endl;
+            std::cerr << "input fields: x,y,z,block; default: x,y,z" << std::endl;
+            std::cerr << "    block: if present, output is flushed at the end of each block" << std::endl;
             std::cerr << "binary input format: default: 3d" << std::endl;
             std::cerr << std::endl;
             std::cerr << description << std::endl;
@@ -86,38 +194,77 @@ int main( int argc, char** argv )
         comma::csv::ascii< Eigen::Vector3d >().get( origin, origin_string );
         if( resolution_string.find_first_of( ',' ) == std::string::npos ) { resolution_string = resolution_string + ',' + resolution_string + ',' + resolution_string; }
         comma::csv::ascii< Eigen::Vector3d >().get( resolution, resolution_string );
-        comma::csv::input_stream< input_point > istream( std::cin, csv );
+        boost::optional< boost::posix_time::time_duration > latency;
+        if( vm.count( "flush-latency" ) ) { latency = boost::posix_time::microseconds( static_cast< long >( flush_latency * 1000000 ) ); }
+        output_buffer obuf( flush_size, latency );
+        bool has_block = csv.has_field( "block" );
         comma::signal_flag is_shutdown;
         if( csv.binary() )
         {
 #ifdef WIN32
-            _setmode( _fileno( stdout ), _O_BINARY ); 
+            _setmode( _fileno( stdin ), _O_BINARY );
+            _setmode( _fileno( stdout ), _O_BINARY );
 #endif
-            while( !is_shutdown && !std::cin.eof() && std::cin.good() )
+            // read raw records in batches straight from stdin, since comma::csv::input_stream reads one record at a time
+            comma::csv::binary< input_point > binary( csv );
+            const std::size_t record_size = csv.format().size();
+            const std::size_t batch_size = std::max( std::size_t( 1 ), std::size_t( 65536 ) / record_size );
+            std::vector< char > buffer( batch_size * record_size );
+            std::vector< double > coordinates[3];
+            std::vector< comma::int32 > indices[3];
+            std::vector< comma::uint32 > blocks( batch_size );
+            for( unsigned int i = 0; i < 3; ++i ) { coordinates[i].resize( batch_size ); indices[i].resize( batch_size ); }
+            input_point point;
+            boost::optional< comma::uint32 > block;
+            std::size_t size = 0; // bytes in buffer, including incomplete record
+            while( !is_shutdown && std::cout.good() )
             {
-                const input_point* point = istream.read();
-                if( !point ) { break; }
-                index_type index = snark::voxel_map< input_point, 3 >::index_of( *point, origin, resolution );
-                std::cout.write( istream.binary().last(), csv.format().size() );
-                std::cout.write( reinterpret_cast< const char* >( &index[0] ), 3 * sizeof( comma::int32 ) );
-                std::cout.flush();
+                int count = ::read( 0, &buffer[size], buffer.size() - size );
+                if( count <= 0 ) { break; }
+                bool idle = size + count < buffer.size(); // read less than asked: input ran dry for now
+                size += count;
+                std::size_t n = size / record_size;
+                for( std::size_t i = 0; i < n; ++i )
+                {
+                    binary.get( point, &buffer[ i * record_size ] );
+                    for( unsigned int k = 0; k < 3; ++k ) { coordinates[k][i] = point.point[k]; }
+                    blocks[i] = point.block;
+                }
+                for( unsigned int k = 0; k < 3; ++k ) { index_of_( &coordinates[k][0], &indices[k][0], n, origin[k], resolution[k] ); }
+                for( std::size_t i = 0; i < n; ++i )
+                {
+                    if( has_block && block && *block != blocks[i] ) { obuf.flush(); }
+                    block = blocks[i];
+                    index_type index = {{ indices[0][i], indices[1][i], indices[2][i] }};
+                    obuf.write( &buffer[ i * record_size ], record_size );
+                    obuf.write( reinterpret_cast< const char* >( &index[0] ), 3 * sizeof( comma::int32 ) );
+                    if( obuf.due() ) { obuf.flush(); }
+                }
+                if( idle ) { obuf.flush(); }
+                size -= n * record_size;
+                if( size > 0 ) { std::memmove( &buffer[0], &buffer[ n * record_size ], size ); }
             }
         }
         else
         {
+            comma::csv::input_stream< input_point > istream( std::cin, csv );
+            boost::optional< comma::uint32 > block;
+            char buf[64];
             while( !is_shutdown && !std::cin.eof() && std::cin.good() )
             {
                 const input_point* point = istream.read();
                 if( !point ) { break; }
-                index_type index = snark::voxel_map< input_point, 3 >::index_of( *point, origin, resolution );
-                std::cout << comma::join( istream.ascii().last(), csv.delimiter )
-                          << csv.delimiter << index[0]
-                          << csv.delimiter << index[1]
-                          << csv.delimiter << index[2]
-                          << std::endl;
+                if( has_block && block && *block != point->block ) { obuf.flush(); }
+                block = point->block;
+                index_type index = snark::voxel_map< Eigen::Vector3d, 3 >::index_of( point->point, origin, resolution );
+                const std::string& line = comma::join( istream.ascii().last(), csv.delimiter );
+                obuf.write( &line[0], line.size() );
+                obuf.write( buf, std::sprintf( buf, "%c%d%c%d%c%d\n", csv.delimiter, index[0], csv.delimiter, index[1], csv.delimiter, index[2] ) );
+                if( obuf.due() || std::cin.rdbuf()->in_avail() <= 0 ) { obuf.flush(); }
             }
         }
-        if( is_shutdown ) { std::cerr << "points-to-voxels: caught signal" << std::endl; return 1; }
+        obuf.flush();
+        if( is_shutdown ) { std::cerr << "points-to-voxel-indices: caught signal" << std::endl; return 1; }
         return 0;
     }
     catch( std::exception& ex )
@@ -31,9 +31,16 @@
 // IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 
+#include <algorithm>
+#include <cstdio>
+#include <vector>
 #include <boost/array.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/filesystem/operations.hpp>
 #include <boost/optional.hpp>
 #include <boost/program_options.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/unordered_map.hpp>
 #include <comma/base/exception.h>
 #include <comma/application/command_line_options.h>
 #include <comma/application/signal_flag.h>
@@ -43,12 +50,15 @@
 #include <comma/csv/impl/program_options.h>
 #include <comma/visiting/traits.h>
 #include <snark/visiting/eigen.h>
+#include <snark/point_cloud/concurrent_voxel_map.h>
+#include <snark/point_cloud/sliding_window_voxel_map.h>
 #include <snark/point_cloud/voxel_map.h>
 
 struct input_point
 {
     Eigen::Vector3d point;
     comma::uint32 block;
+    boost::posix_time::ptime t;
     
     input_point() : block( 0 ) {}
 };
@@ -67,6 +77,14 @@ struct centroid
         ++size;
         mean = ( mean * ( size - 1 ) + point ) / size;
     }
+    
+    void operator+=( const centroid& rhs )
+    {
+        if( rhs.size == 0 ) { return; }
+        if( size == 0 ) { mean = rhs.mean; size = rhs.size; return; }
+        mean = ( mean * size + rhs.mean * rhs.size ) / ( size + rhs.size );
+        size += rhs.size;
+    }
 };
 
 namespace comma { namespace visiting {
@@ -77,12 +95,14 @@ template <> struct traits< input_point >
     {
         v.apply( "point", p.point );
         v.apply( "block", p.block );
+        v.apply( "t", p.t );
     }
 
     template < typename K, typename V > static void visit( const K&, const input_point& p, V& v )
     {
         v.apply( "point", p.point );
         v.apply( "block", p.block );
+        v.apply( "t", p.t );
     }
 };
 
@@ -117,6 +137,380 @@ std::ostream& operator<<( std::ostream& os, const boost::array< T, Size >& a )
     return os;
 }
     
+typedef snark::voxel_map< centroid, 3 > voxels_type;
+
+/// sums of point counts and coordinates over cubic neighbourhoods of voxels
+///
+/// dense: summed-volume table over the occupied extents of the block, O(1) per neighbourhood
+/// sparse: for extents too large for a dense table (e.g. long thin scans),
+///         prefix sums along z in each occupied column, O((2r+1)^2 log n) per neighbourhood
+///
+/// coordinate sums are accumulated relative to the minimum voxel corner to keep precision
+class neighbourhood_sums
+{
+    public:
+        neighbourhood_sums( const voxels_type& voxels, comma::uint32 radius );
+
+        /// get number of points and sum of their coordinates in the neighbourhood of the given voxel
+        void get( const voxels_type::index_type& index, comma::uint32& size, Eigen::Vector3d& sum ) const;
+
+        bool dense() const { return dense_; }
+
+    private:
+        typedef voxels_type::index_type index_type;
+        typedef boost::array< comma::int32, 2 > column_index_type;
+        struct column_type
+        {
+            std::vector< comma::int32 > z;
+            std::vector< comma::uint32 > sizes; // prefix sums, sizes[i] is sum over z[0..i)
+            std::vector< Eigen::Vector3d > sums; // prefix sums, sums[i] is sum over z[0..i)
+        };
+        typedef boost::unordered_map< column_index_type, column_type, snark::array_hash< column_index_type, 2 > > columns_type;
+        struct entry_type
+        {
+            index_type index;
+            comma::uint32 size;
+            Eigen::Vector3d sum;
+            bool operator<( const entry_type& rhs ) const { return index < rhs.index; }
+        };
+
+        comma::int32 radius_;
+        bool dense_;
+        index_type min_;
+        index_type max_;
+        Eigen::Vector3d offset_;
+        boost::array< std::size_t, 3 > size_; // dense table size, i.e. extents + 1
+        std::vector< comma::uint32 > sizes_; // dense summed-volume table of sizes
+        std::vector< Eigen::Vector3d > sums_; // dense summed-volume table of coordinate sums
+        columns_type columns_;
+
+        std::size_t offset_of_( std::size_t i, std::size_t j, std::size_t k ) const { return ( i * size_[1] + j ) * size_[2] + k; }
+        template < typename T > void integrate_( std::vector< T >& t ) const;
+        template < typename T > T sum_( const std::vector< T >& t, const index_type& begin, const index_type& end ) const;
+};
+
+static const double max_dense_table_size = 1 << 23; // cells, i.e. about 224MB
+static const double max_dense_table_sparsity = 32; // cells per occupied voxel, beyond which dense table is not worth building
+
+inline neighbourhood_sums::neighbourhood_sums( const voxels_type& voxels, comma::uint32 radius ) : radius_( radius ), dense_( false ), offset_( 0, 0, 0 )
+{
+    if( voxels.empty() ) { return; }
+    min_ = max_ = voxels.begin()->first;
+    for( voxels_type::const_iterator it = voxels.begin(); it != voxels.end(); ++it )
+    {
+        for( unsigned int i = 0; i < 3; ++i )
+        {
+            if( it->first[i] < min_[i] ) { min_[i] = it->first[i]; }
+            if( it->first[i] > max_[i] ) { max_[i] = it->first[i]; }
+        }
+    }
+    offset_ = voxels.origin() + Eigen::Vector3d( min_[0], min_[1], min_[2] ).cwiseProduct( voxels.resolution() );
+    double cells = 1;
+    for( unsigned int i = 0; i < 3; ++i ) { cells *= double( max_[i] ) - min_[i] + 2; }
+    dense_ = cells <= max_dense_table_size && cells <= max_dense_table_sparsity * voxels.size() + ( 1 << 16 );
+    if( dense_ )
+    {
+        for( unsigned int i = 0; i < 3; ++i ) { size_[i] = max_[i] - min_[i] + 2; }
+        sizes_.resize( size_[0] * size_[1] * size_[2], 0 );
+        sums_.resize( sizes_.size(), Eigen::Vector3d::Zero() );
+        for( voxels_type::const_iterator it = voxels.begin(); it != voxels.end(); ++it )
+        {
+            std::size_t o = offset_of_( it->first[0] - min_[0] + 1, it->first[1] - min_[1] + 1, it->first[2] - min_[2] + 1 );
+            sizes_[o] = it->second.size;
+            sums_[o] = ( it->second.mean - offset_ ) * it->second.size;
+        }
+        integrate_( sizes_ );
+        integrate_( sums_ );
+        return;
+    }
+    std::vector< entry_type > entries;
+    entries.reserve( voxels.size() );
+    for( voxels_type::const_iterator it = voxels.begin(); it != voxels.end(); ++it )
+    {
+        entry_type entry;
+        entry.index = it->first;
+        entry.size = it->second.size;
+        entry.sum = ( it->second.mean - offset_ ) * it->second.size;
+        entries.push_back( entry );
+    }
+    std::sort( entries.begin(), entries.end() );
+    for( std::size_t i = 0; i < entries.size(); )
+    {
+        column_index_type c = {{ entries[i].index[0], entries[i].index[1] }};
+        column_type& column = columns_[c];
+        column.sizes.push_back( 0 );
+        column.sums.push_back( Eigen::Vector3d::Zero() );
+        for( ; i < entries.size() && entries[i].index[0] == c[0] && entries[i].index[1] == c[1]; ++i )
+        {
+            column.z.push_back( entries[i].index[2] );
+            column.sizes.push_back( column.sizes.back() + entries[i].size );
+            column.sums.push_back( column.sums.back() + entries[i].sum );
+        }
+    }
+}
+
+template < typename T >
+inline void neighbourhood_sums::integrate_( std::vector< T >& t ) const
+{
+    for( std::size_t i = 1; i < size_[0]; ++i ) { for( std::size_t j = 0; j < size_[1]; ++j ) { for( std::size_t k = 0; k < size_[2]; ++k ) { t[ offset_of_( i, j, k ) ] += t[ offset_of_( i - 1, j, k ) ]; } } }
+    for( std::size_t i = 0; i < size_[0]; ++i ) { for( std::size_t j = 1; j < size_[1]; ++j ) { for( std::size_t k = 0; k < size_[2]; ++k ) { t[ offset_of_( i, j, k ) ] += t[ offset_of_( i, j - 1, k ) ]; } } }
+    for( std::size_t i = 0; i < size_[0]; ++i ) { for( std::size_t j = 0; j < size_[1]; ++j ) { for( std::size_t k = 1; k < size_[2]; ++k ) { t[ offset_of_( i, j, k ) ] += t[ offset_of_( i, j, k - 1 ) ]; } } }
+}
+
+template < typename T >
+inline T neighbourhood_sums::sum_( const std::vector< T >& t, const index_type& b, const index_type& e ) const // b: inclusive, e: exclusive, both in table coordinates
+{
+    return t[ offset_of_( e[0], e[1], e[2] ) ]
+         - t[ offset_of_( b[0], e[1], e[2] ) ] - t[ offset_of_( e[0], b[1], e[2] ) ] - t[ offset_of_( e[0], e[1], b[2] ) ]
+         + t[ offset_of_( b[0], b[1], e[2] ) ] + t[ offset_of_( b[0], e[1], b[2] ) ] + t[ offset_of_( e[0], b[1], b[2] ) ]
+         - t[ offset_of_( b[0], b[1], b[2] ) ];
+}
+
+inline void neighbourhood_sums::get( const voxels_type::index_type& index, comma::uint32& size, Eigen::Vector3d& sum ) const
+{
+    size = 0;
+    sum = Eigen::Vector3d::Zero();
+    if( dense_ )
+    {
+        index_type begin;
+        index_type end;
+        for( unsigned int i = 0; i < 3; ++i )
+        {
+            begin[i] = std::max( index[i] - radius_, min_[i] ) - min_[i];
+            end[i] = std::min( index[i] + radius_, max_[i] ) - min_[i] + 1;
+        }
+        size = sum_( sizes_, begin, end );
+        sum = sum_( sums_, begin, end );
+    }
+    else
+    {
+        column_index_type c;
+        for( c[0] = index[0] - radius_; c[0] <= index[0] + radius_; ++c[0] )
+        {
+            for( c[1] = index[1] - radius_; c[1] <= index[1] + radius_; ++c[1] )
+            {
+                columns_type::const_iterator it = columns_.find( c );
+                if( it == columns_.end() ) { continue; }
+                const column_type& column = it->second;
+                std::size_t begin = std::lower_bound( column.z.begin(), column.z.end(), index[2] - radius_ ) - column.z.begin();
+                std::size_t end = std::upper_bound( column.z.begin(), column.z.end(), index[2] + radius_ ) - column.z.begin();
+                size += column.sizes[end] - column.sizes[begin];
+                sum += column.sums[end] - column.sums[begin];
+            }
+        }
+    }
+    sum += offset_ * size;
+}
+
+static void add_( centroid& c, const Eigen::Vector3d& point ) { c += point; }
+
+static void write_( comma::csv::output_stream< centroid >& ostream, const voxels_type::index_type& index, centroid c, comma::uint32 block, const neighbourhood_sums* sums, const Eigen::Vector3d& origin, const Eigen::Vector3d& resolution )
+{
+    c.block = block;
+    c.index = voxels_type::index_of( c.mean, origin, resolution );
+    if( sums )
+    {
+        comma::uint32 size;
+        Eigen::Vector3d sum;
+        sums->get( index, size, sum );
+        c.size += size;
+        c.mean += sum;
+        c.mean /= c.size;
+    }
+    ostream.write( c );
+}
+
+/// out-of-core voxelisation of a block
+///
+/// points are buffered in memory per tile of tile size^3 voxels and,
+/// once the buffers exceed the memory limit, appended to a file per tile
+/// in the scratch directory; at the end of block, tiles are voxelised one
+/// by one in the order of their points in the stream, thus centroids are
+/// exactly the same as if the whole block was voxelised in memory
+///
+/// for neighbourhood sums, the voxels of each tile are first saved and then
+/// each tile gets the voxels of its neighbour tiles within the radius
+class tiles
+{
+    public:
+        typedef voxels_type::index_type index_type;
+
+        tiles( const std::string& directory, comma::uint32 size, std::size_t memory, const Eigen::Vector3d& origin, const Eigen::Vector3d& resolution );
+
+        ~tiles() { clear(); }
+
+        void add( const Eigen::Vector3d& point );
+
+        void write( comma::csv::output_stream< centroid >& ostream, comma::uint32 block, comma::uint32 radius, const comma::signal_flag& is_shutdown );
+
+        void clear();
+
+    private:
+        typedef boost::unordered_map< index_type, std::vector< Eigen::Vector3d >, snark::array_hash< index_type, 3 > > buffers_type;
+        struct voxel_type { index_type index; centroid value; };
+        std::string directory_;
+        comma::int32 size_;
+        std::size_t memory_;
+        Eigen::Vector3d origin_;
+        Eigen::Vector3d resolution_;
+        buffers_type buffers_;
+        std::size_t buffered_;
+        std::vector< index_type > tiles_; // tiles with points spilled to disk, sorted after spill
+
+        index_type tile_of_( const index_type& index ) const;
+        std::string filename_( const index_type& tile, const char* extension ) const;
+        void spill_();
+        void voxelise_( const index_type& tile, voxels_type& voxels ) const;
+        void load_( const index_type& tile, voxels_type& voxels, const index_type& begin, const index_type& end ) const;
+};
+
+inline tiles::tiles( const std::string& directory, comma::uint32 size, std::size_t memory, const Eigen::Vector3d& origin, const Eigen::Vector3d& resolution )
+    : directory_( directory )
+    , size_( size )
+    , memory_( memory )
+    , origin_( origin )
+    , resolution_( resolution )
+    , buffered_( 0 )
+{
+}
+
+inline tiles::index_type tiles::tile_of_( const index_type& index ) const
+{
+    index_type t;
+    for( unsigned int i = 0; i < 3; ++i ) { t[i] = index[i] >= 0 ? index[i] / size_ : -( ( -index[i] - 1 ) / size_ ) - 1; }
+    return t;
+}
+
+inline std::string tiles::filename_( const index_type& tile, const char* extension ) const
+{
+    char name[64];
+    std::sprintf( name, "/%d_%d_%d.%s", tile[0], tile[1], tile[2], extension );
+    return directory_ + name;
+}
+
+inline void tiles::add( const Eigen::Vector3d& point )
+{
+    buffers_[ tile_of_( voxels_type::index_of( point, origin_, resolution_ ) ) ].push_back( point );
+    if( ++buffered_ * sizeof( Eigen::Vector3d ) >= memory_ ) { spill_(); }
+}
+
+inline void tiles::spill_()
+{
+    for( buffers_type::iterator it = buffers_.begin(); it != buffers_.end(); ++it )
+    {
+        if( it->second.empty() ) { continue; }
+        std::string filename = filename_( it->first, "points" );
+        std::FILE* file = std::fopen( filename.c_str(), "ab" );
+        if( !file ) { COMMA_THROW( comma::exception, "failed to open \"" << filename << "\"" ); }
+        std::size_t written = std::fwrite( &it->second[0], sizeof( Eigen::Vector3d ), it->second.size(), file );
+        std::fclose( file );
+        if( written != it->second.size() ) { COMMA_THROW( comma::exception, "failed to write \"" << filename << "\"" ); }
+        tiles_.push_back( it->first );
+    }
+    buffers_.clear(); // release memory, since tiles rarely get points again once the scan moved on
+    buffered_ = 0;
+    std::sort( tiles_.begin(), tiles_.end() );
+    tiles_.erase( std::unique( tiles_.begin(), tiles_.end() ), tiles_.end() );
+}
+
+inline void tiles::voxelise_( const index_type& tile, voxels_type& voxels ) const
+{
+    std::string filename = filename_( tile, "points" );
+    std::FILE* file = std::fopen( filename.c_str(), "rb" );
+    if( !file ) { COMMA_THROW( comma::exception, "failed to open \"" << filename << "\"" ); }
+    std::vector< Eigen::Vector3d > points( 1 << 16 );
+    while( true )
+    {
+        std::size_t size = std::fread( &points[0], sizeof( Eigen::Vector3d ), points.size(), file );
+        for( std::size_t i = 0; i < size; ++i ) { voxels.touch_at( points[i] )->second += points[i]; }
+        if( size < points.size() ) { break; }
+    }
+    std::fclose( file );
+    std::remove( filename.c_str() );
+}
+
+inline void tiles::load_( const index_type& tile, voxels_type& voxels, const index_type& begin, const index_type& end ) const
+{
+    std::string filename = filename_( tile, "voxels" );
+    std::FILE* file = std::fopen( filename.c_str(), "rb" );
+    if( !file ) { return; }
+    voxel_type v;
+    while( std::fread( &v, sizeof( voxel_type ), 1, file ) == 1 )
+    {
+        bool inside = true;
+        for( unsigned int i = 0; i < 3 && inside; ++i ) { inside = begin[i] <= v.index[i] && v.index[i] < end[i]; }
+        if( inside ) { voxels[ v.index ] = v.value; }
+    }
+    std::fclose( file );
+}
+
+inline void tiles::write( comma::csv::output_stream< centroid >& ostream, comma::uint32 block, comma::uint32 radius, const comma::signal_flag& is_shutdown )
+{
+    spill_();
+    if( radius == 0 )
+    {
+        for( std::size_t t = 0; t < tiles_.size() && !is_shutdown; ++t )
+        {
+            voxels_type voxels( origin_, resolution_ );
+            voxelise_( tiles_[t], voxels );
+            for( voxels_type::const_iterator it = voxels.begin(); it != voxels.end(); ++it ) { write_( ostream, it->first, it->second, block, NULL, origin_, resolution_ ); }
+        }
+        clear();
+        return;
+    }
+    for( std::size_t t = 0; t < tiles_.size() && !is_shutdown; ++t )
+    {
+        voxels_type voxels( origin_, resolution_ );
+        voxelise_( tiles_[t], voxels );
+        std::string filename = filename_( tiles_[t], "voxels" );
+        std::FILE* file = std::fopen( filename.c_str(), "wb" );
+        if( !file ) { COMMA_THROW( comma::exception, "failed to open \"" << filename << "\"" ); }
+        for( voxels_type::const_iterator it = voxels.begin(); it != voxels.end(); ++it )
+        {
+            voxel_type v = { it->first, it->second };
+            if( std::fwrite( &v, sizeof( voxel_type ), 1, file ) != 1 ) { std::fclose( file ); COMMA_THROW( comma::exception, "failed to write \"" << filename << "\"" ); }
+        }
+        std::fclose( file );
+    }
+    for( std::size_t t = 0; t < tiles_.size() && !is_shutdown; ++t )
+    {
+        const index_type& tile = tiles_[t];
+        index_type begin; // halo: voxels of the tile and within radius around it
+        index_type end;
+        for( unsigned int i = 0; i < 3; ++i ) { begin[i] = tile[i] * size_ - comma::int32( radius ); end[i] = ( tile[i] + 1 ) * size_ + comma::int32( radius ); }
+        voxels_type voxels( origin_, resolution_ );
+        index_type neighbour;
+        for( neighbour[0] = tile[0] - 1; neighbour[0] <= tile[0] + 1; ++neighbour[0] )
+        {
+            for( neighbour[1] = tile[1] - 1; neighbour[1] <= tile[1] + 1; ++neighbour[1] )
+            {
+                for( neighbour[2] = tile[2] - 1; neighbour[2] <= tile[2] + 1; ++neighbour[2] )
+                {
+                    if( std::binary_search( tiles_.begin(), tiles_.end(), neighbour ) ) { load_( neighbour, voxels, begin, end ); }
+                }
+            }
+        }
+        neighbourhood_sums sums( voxels, radius );
+        for( voxels_type::const_iterator it = voxels.begin(); it != voxels.end(); ++it )
+        {
+            if( tile_of_( it->first ) == tile ) { write_( ostream, it->first, it->second, block, &sums, origin_, resolution_ ); }
+        }
+    }
+    clear();
+}
+
+inline void tiles::clear()
+{
+    buffers_.clear();
+    buffered_ = 0;
+    for( std::size_t t = 0; t < tiles_.size(); ++t )
+    {
+        std::remove( filename_( tiles_[t], "points" ).c_str() );
+        std::remove( filename_( tiles_[t], "voxels" ).c_str() );
+    }
+    tiles_.clear();
+}
+
 int main( int argc, char** argv )
 {
     try
@@ -125,11 +519,19 @@ int main( int argc, char** argv )
         std::string resolution_string;
         boost::program_options::options_description description( "options" );
         comma::uint32 neighbourhood_radius;
+        comma::uint32 tile_size;
+        std::size_t memory;
+        std::string scratch;
+        double window;
         description.add_options()
             ( "help,h", "display help message" )
             ( "resolution", boost::program_options::value< std::string >( &resolution_string ), "voxel map resolution, e.g. \"0.2\" or \"0.2,0.2,0.5\"" )
             ( "origin", boost::program_options::value< std::string >( &origin_string )->default_value( "0,0,0" ), "voxel map origin" )
-            ( "neighbourhood-radius,r", boost::program_options::value< comma::uint32 >( &neighbourhood_radius )->default_value( 0 ), "calculate count of neighbours at given radius" );
+            ( "neighbourhood-radius,r", boost::program_options::value< comma::uint32 >( &neighbourhood_radius )->default_value( 0 ), "calculate count of neighbours at given radius" )
+            ( "tile-size", boost::program_options::value< comma::uint32 >( &tile_size )->default_value( 0 ), "out-of-core mode: if not 0, spill points to scratch files in tiles of given size in voxels (along each axis) and voxelise tile by tile; tile size should be not less than neighbourhood radius" )
+            ( "memory", boost::program_options::value< std::size_t >( &memory )->default_value( 1 << 28 ), "out-of-core mode: max memory for buffered points in bytes; voxelising a tile needs memory for the voxels of the tile (and its neighbours, if --neighbourhood-radius given)" )
+            ( "scratch", boost::program_options::value< std::string >( &scratch ), "out-of-core mode: scratch directory; default: system temporary directory" )
+            ( "window", boost::program_options::value< double >( &window )->default_value( 0 ), "sliding window mode: if not 0, output per block the voxels of the points of the blocks in the window of given size; if input fields have t, size in seconds, otherwise in blocks" );
         description.add( comma::csv::program_options::description( "x,y,z,block" ) );
         boost::program_options::variables_map vm;
         boost::program_options::store( boost::program_options::parse_command_line( argc, argv, description), vm );
@@ -144,6 +546,13 @@ int main( int argc, char** argv )
             std::cerr << "output: voxels with indices, centroids, and weights (number of points): i,j,k,x,y,z,weight[,neighbour count][,block]" << std::endl;
             std::cerr << "binary output format: 3ui,3d,ui[,ui][,ui]" << std::endl;
             std::cerr << std::endl;
+            std::cerr << "out-of-core mode (--tile-size): for blocks that do not fit in memory; output is the same" << std::endl;
+            std::cerr << "    as in memory, but in different order, and neighbourhood means may differ in the last digits" << std::endl;
+            std::cerr << "sliding window mode (--window): for each block, output voxels of the last blocks within the window," << std::endl;
+            std::cerr << "    e.g. for a local map of the last few seconds of a scan; voxels are updated incrementally, not rebuilt per block;" << std::endl;
+            std::cerr << "    time of block is time of its first point, if t field given, otherwise block is counted as one" << std::endl;
+            std::cerr << "    e.g: cat points.csv | points-to-voxels --fields=x,y,z,block,t --resolution=0.2 --window=2.5" << std::endl;
+            std::cerr << std::endl;
             std::cerr << description << std::endl;
             std::cerr << std::endl;
             return 1;
@@ -169,20 +578,86 @@ int main( int argc, char** argv )
             if( csv.binary() ) { output_csv.format( "3ui,3d,ui" ); }
         }
         comma::csv::output_stream< centroid > ostream( std::cout, output_csv );
+        if( tile_size > 0 && window > 0 ) { COMMA_THROW( comma::exception, "--tile-size and --window are mutually exclusive" ); }
+        if( tile_size > 0 && tile_size < neighbourhood_radius ) { COMMA_THROW( comma::exception, "expected tile size not less than neighbourhood radius " << neighbourhood_radius << "; got " << tile_size ); }
         comma::signal_flag is_shutdown;
         unsigned int block = 0;
         const input_point* last = NULL;
+        if( tile_size > 0 )
+        {
+            boost::filesystem::path directory = boost::filesystem::unique_path( ( scratch.empty() ? boost::filesystem::temp_directory_path() : boost::filesystem::path( scratch ) ) / "points-to-voxels.%%%%-%%%%-%%%%" );
+            boost::filesystem::create_directories( directory );
+            try
+            {
+                tiles t( directory.string(), tile_size, memory, origin, resolution );
+                while( !is_shutdown && !std::cin.eof() && std::cin.good() )
+                {
+                    if( last ) { t.add( last->point ); }
+                    while( !is_shutdown && !std::cin.eof() && std::cin.good() )
+                    {
+                        last = istream.read();
+                        if( !last || last->block != block ) { break; }
+                        t.add( last->point );
+                    }
+                    if( is_shutdown ) { break; }
+                    t.write( ostream, block, neighbourhood_radius, is_shutdown );
+                    if( !last ) { break; }
+                    block = last->block;
+                }
+            }
+            catch( ... ) { boost::filesystem::remove_all( directory ); throw; }
+            boost::filesystem::remove_all( directory );
+            if( is_shutdown ) { std::cerr << "points-to-voxels: caught signal" << std::endl; return 1; }
+            return 0;
+        }
+        if( window > 0 )
+        {
+            bool has_time = csv.has_field( "t" );
+            snark::sliding_window_voxel_map< centroid, 3 > voxels( origin, resolution );
+            double count = 0;
+            while( !is_shutdown && !std::cin.eof() && std::cin.good() )
+            {
+                if( !last ) { last = istream.read(); }
+                if( !last ) { break; }
+                block = last->block;
+                double t = has_time ? double( ( last->t - boost::posix_time::from_time_t( 0 ) ).total_microseconds() ) / 1000000 : count++;
+                voxels.touch_at( last->point, t ) += last->point;
+                while( !is_shutdown && !std::cin.eof() && std::cin.good() )
+                {
+                    last = istream.read();
+                    if( !last || last->block != block ) { break; }
+                    voxels.touch_at( last->point, t ) += last->point;
+                }
+                if( is_shutdown ) { break; }
+                voxels.expire( t - window + ( has_time ? 0 : 1 ) );
+                voxels.update();
+                boost::scoped_ptr< neighbourhood_sums > sums;
+                voxels_type totals( origin, resolution );
+                if( neighbourhood_radius > 0 ) // quick and dirty, neighbourhood sums are still calculated from scratch
+                {
+                    for( snark::sliding_window_voxel_map< centroid, 3 >::const_iterator it = voxels.begin(); it != voxels.end(); ++it ) { static_cast< voxels_type::base_type& >( totals ).insert( std::make_pair( it->first, it->second.value ) ); }
+                    sums.reset( new neighbourhood_sums( totals, neighbourhood_radius ) );
+                }
+                for( snark::sliding_window_voxel_map< centroid, 3 >::const_iterator it = voxels.begin(); it != voxels.end(); ++it ) { write_( ostream, it->first, it->second.value, block, sums.get(), origin, resolution ); }
+                std::cout.flush(); // real-time use: output window per block as soon as possible
+            }
+            if( is_shutdown ) { std::cerr << "points-to-voxels: caught signal" << std::endl; return 1; }
+            return 0;
+        }
+        snark::concurrent_voxel_map< centroid, 3 > concurrent_voxels( origin, resolution );
+        std::vector< Eigen::Vector3d > points;
         while( !is_shutdown && !std::cin.eof() && std::cin.good() )
         {
-            snark::voxel_map< centroid, 3 > voxels( origin, resolution );
-            if( last ) { voxels.touch_at( last->point )->second += last->point; }
+            points.clear();
+            if( last ) { points.push_back( last->point ); }
             while( !is_shutdown && !std::cin.eof() && std::cin.good() )
             {
                 last = istream.read();
                 if( !last || last->block != block ) { break; }
-                voxels.touch_at( last->point )->second += last->point;
+                points.push_back( last->point );
             }
             if( is_shutdown ) { break; }
+            concurrent_voxels.insert( points.begin(), points.end(), add_ ); // voxels get points in input order, thus same centroids as if inserted one by one
 //             for( snark::voxel_map< centroid, 3 >::iterator it = voxels.begin(); it != voxels.end(); ++it )
 //             {
 //                 it->second.block = block;
@@ -216,36 +691,21 @@ int main( int argc, char** argv )
 //                 ostream.write( it->second );
 //             }
 
-            for( snark::voxel_map< centroid, 3 >::iterator it = voxels.begin(); it != voxels.end(); ++it )
+            if( neighbourhood_radius > 0 )
             {
-                it->second.block = block;
-                it->second.index = snark::voxel_map< centroid, 3 >::index_of( it->second.mean, origin, resolution );
-                if( neighbourhood_radius == 0 )
-                {
-                    ostream.write( it->second );
-                }
-                else
+                snark::voxel_map< centroid, 3 > voxels( origin, resolution );
+                concurrent_voxels.merge( voxels );
+                neighbourhood_sums sums( voxels, neighbourhood_radius );
+                for( snark::voxel_map< centroid, 3 >::const_iterator it = voxels.begin(); it != voxels.end(); ++it ) { write_( ostream, it->first, it->second, block, &sums, origin, resolution ); }
+            }
+            else
+            {
+                for( unsigned int s = 0; s < concurrent_voxels.shards(); ++s )
                 {
-                    centroid c = it->second;
-                    snark::voxel_map< centroid, 3 >::index_type index;
-                    snark::voxel_map< centroid, 3 >::index_type begin = {{ it->first[0] - neighbourhood_radius, it->first[1] - neighbourhood_radius, it->first[2] - neighbourhood_radius }};
-                    snark::voxel_map< centroid, 3 >::index_type end = {{ it->first[0] + neighbourhood_radius + 1, it->first[1] + neighbourhood_radius + 1, it->first[2] + neighbourhood_radius + 1 }};
-                    for( index[0] = begin[0]; index[0] < end[0]; ++index[0] )                        
-                    {
-                        for( index[1] = begin[1]; index[1] < end[1]; ++index[1] )
-                        {
-                            for( index[2] = begin[2]; index[2] < end[2]; ++index[2] )
-                            {
-                                snark::voxel_map< centroid, 3 >::const_iterator nit = voxels.find( index );
-                                if( nit == voxels.end() ) { continue; }
-                                c.size += nit->second.size;
-                                c.mean += ( nit->second.mean * nit->second.size );
-                            }
-                        }
-                    }
-                    c.mean /= c.size;
-                    ostream.write( c );
+                    const snark::voxel_map< centroid, 3 >& shard = concurrent_voxels.shard( s );
+                    for( snark::voxel_map< centroid, 3 >::const_iterator it = shard.begin(); it != shard.end(); ++it ) { write_( ostream, it->first, it->second, block, NULL, origin, resolution ); }
                 }
+                concurrent_voxels.clear();
             }
             if( !last ) { break; }
             block = last->block;
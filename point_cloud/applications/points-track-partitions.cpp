@@ -37,9 +37,11 @@
 #include <io.h>
 #endif
 
+#include <algorithm>
 #include <deque>
 #include <iostream>
-#include <map>
+#include <vector>
+#include <boost/array.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/optional.hpp>
 #include <boost/shared_ptr.hpp>
@@ -49,7 +51,6 @@
 #include <comma/csv/stream.h>
 #include <comma/visiting/traits.h>
 #include <snark/math/interval.h>
-#include <snark/point_cloud/voted_tracking.h>
 #include <snark/point_cloud/voxel_map.h>
 #include <snark/visiting/eigen.h>
 
@@ -115,14 +116,11 @@ template <> struct traits< input_t >
 class voxel
 {
     public:
-        voxel() : size_( 0 ), sum_( 0, 0, 0 ), id_( 0 ), count_( 0 ) {}
+        voxel() : size_( 0 ), sum_( 0, 0, 0 ), id_( 0 ), count_( 0 ), inline_size_( 0 ) {}
 
         void add( const input_t& p )
         {
-            unsigned int count = 1;
-            map_t_::iterator it = map_.find( p.id );
-            if( it == map_.end() ) { map_[ p.id ] = 1; }
-            else { count = ++( it->second ); }
+            unsigned int count = ++votes_( p.id );
             if( count > count_ ) { id_ = p.id; count_ = count; }
             ++size_;
             sum_ += p.point;
@@ -136,31 +134,62 @@ class voxel
         void set( comma::uint32 v ) { id_ = v; }
 
     private:
-        typedef std::map< comma::uint32, unsigned int > map_t_;
-        map_t_ map_;
+        typedef std::pair< comma::uint32, unsigned int > vote_t_;
+        enum { inline_votes_size_ = 3 }; // most voxels get votes for very few ids
         unsigned int size_;
         Eigen::Vector3d sum_;
         comma::uint32 id_;
         unsigned int count_;
+        unsigned int inline_size_;
+        boost::array< vote_t_, inline_votes_size_ > inline_votes_;
+        std::vector< vote_t_ > votes_overflow_;
+
+        unsigned int& votes_( comma::uint32 id )
+        {
+            for( unsigned int i = 0; i < inline_size_; ++i ) { if( inline_votes_[i].first == id ) { return inline_votes_[i].second; } }
+            if( inline_size_ < inline_votes_size_ ) { inline_votes_[ inline_size_ ] = vote_t_( id, 0 ); return inline_votes_[ inline_size_++ ].second; }
+            for( std::size_t i = 0; i < votes_overflow_.size(); ++i ) { if( votes_overflow_[i].first == id ) { return votes_overflow_[i].second; } }
+            votes_overflow_.push_back( vote_t_( id, 0 ) );
+            return votes_overflow_.back().second;
+        }
 };
 
-typedef std::deque< std::pair< voxel*, boost::optional< comma::uint32 > > > partition_t;
-typedef std::map< comma::uint32, partition_t > partition_map;
-struct id_element // quick and dirty
+/// voxel of the current block with its partition id and id of the previous block voxel at its mean
+struct vote_t
 {
-    comma::uint32 id;
-    partition_t* partition;
-    id_element() : id( 0 ), partition( NULL ) {}
-    id_element( comma::uint32 id, partition_t* partition ) : id( id ), partition( partition ) {}
+    comma::uint32 current;
+    bool has_previous;
+    comma::uint32 previous;
+    ::voxel* voxel;
+
+    bool operator<( const vote_t& rhs ) const
+    {
+        if( current != rhs.current ) { return current < rhs.current; }
+        if( has_previous != rhs.has_previous ) { return rhs.has_previous; }
+        return previous < rhs.previous;
+    }
 };
-typedef std::multimap< comma::uint32, id_element > id_map;
 
-static boost::optional< comma::uint32 > get_previous_id( partition_t::const_iterator it ) { return it->second; }
+/// partition of the current block with its voted id
+struct match_t
+{
+    comma::uint32 voted; // id voted for
+    comma::uint32 current;
+    comma::uint32 id; // id finally assigned
+    std::size_t begin; // partition voxels are [begin, end) in votes
+    std::size_t end;
+
+    std::size_t size() const { return end - begin; }
+    bool operator<( const match_t& rhs ) const { return voted < rhs.voted || ( voted == rhs.voted && current < rhs.current ); }
+};
 
-std::pair< boost::shared_ptr< snark::voxel_map< voxel, 3 > >, boost::shared_ptr< snark::voxel_map< voxel, 3 > > > voxels;
+typedef snark::voxel_map< voxel, 3 > voxels_t;
+std::pair< boost::shared_ptr< voxels_t >, boost::shared_ptr< voxels_t > > voxels;
 typedef std::pair< input_t, std::string > pair_t;
 typedef std::deque< pair_t > points_t;
 static points_t points;
+static std::vector< vote_t > votes; // reused from block to block
+static std::vector< match_t > matches; // reused from block to block
 static comma::uint32 vacant = 0;
 static comma::csv::options csv;
 static bool verbose;
@@ -168,54 +197,75 @@ static Eigen::Vector3d origin;
 static Eigen::Vector3d resolution;
 static comma::signal_flag is_shutdown;
 
-static void match() // todo: refactor this bloody mess, once voxel grid is refactored!
+/// match partitions of the current block to the previous one by voting
+///
+/// the sparse matrix of ( current id, previous id ) votes is built by sorting the voxels,
+/// after which each partition gets the previous id with most votes (the smallest of equals)
+/// or a vacant id; if several partitions got the same id, the largest partition keeps it
+/// and the rest get vacant ids
+static void match()
 {
-    partition_map partitions;
-    for( snark::voxel_map< voxel, 3 >::iterator it = voxels.second->begin(); it != voxels.second->end(); ++it )
+    votes.clear();
+    for( voxels_t::iterator it = voxels.second->begin(); it != voxels.second->end(); ++it )
     {
-        comma::uint32 current_id = it->second.id();
-        boost::optional< comma::uint32 > previous_id;
-        snark::voxel_map< voxel, 3 >::const_iterator v = voxels.first->find( it->second.mean() );
-        if( v != voxels.first->end() ) { previous_id = v->second.id(); }
-        partitions[ current_id ].push_back( std::make_pair( &it->second, previous_id ) );
+        vote_t v;
+        v.current = it->second.id();
+        voxels_t::const_iterator previous = voxels.first->find( it->second.mean() );
+        v.has_previous = previous != voxels.first->end();
+        v.previous = v.has_previous ? previous->second.id() : 0;
+        v.voxel = &it->second;
+        votes.push_back( v );
     }
-    id_map ids;
-    for( partition_map::iterator it = partitions.begin(); it != partitions.end(); ++it )
+    std::sort( votes.begin(), votes.end() );
+    matches.clear();
+    for( std::size_t i = 0; i < votes.size(); ) // partitions in ascending order of current id
     {
-        comma::uint32 id = snark::voted_tracking( it->second.begin(), it->second.end(), get_previous_id, vacant );
-        if( id == vacant ) { ++vacant; }
-        ids.insert( std::make_pair( id, id_element( id, &( it->second ) ) ) );
+        match_t m;
+        m.current = votes[i].current;
+        m.begin = i;
+        std::size_t count = 0;
+        comma::uint32 voted = 0;
+        while( i < votes.size() && votes[i].current == m.current )
+        {
+            std::size_t j = i++;
+            if( !votes[j].has_previous ) { continue; }
+            for( ; i < votes.size() && votes[i].current == m.current && votes[i].previous == votes[j].previous; ++i );
+            if( i - j > count ) { count = i - j; voted = votes[j].previous; }
+        }
+        m.end = i;
+        m.voted = count > 0 ? voted : vacant;
+        if( m.voted == vacant ) { ++vacant; }
+        m.id = m.voted;
+        matches.push_back( m );
     }
-    id_map::iterator largest;
-    for( id_map::iterator it = ids.begin(); it != ids.end(); ) // quick and dirty
+    std::sort( matches.begin(), matches.end() );
+    for( std::size_t i = 0; i < matches.size(); )
     {
-        largest = it++;
-        for( ; it != ids.end() && it->first == largest->first; ++it )
+        std::size_t largest = i++;
+        for( ; i < matches.size() && matches[i].voted == matches[largest].voted; ++i )
         {
-            if( largest->second.partition->size() >= it->second.partition->size() )
+            if( matches[largest].size() >= matches[i].size() )
             {
-                it->second.id = vacant++;
+                matches[i].id = vacant++;
             }
             else
             {
-                largest->second.id = vacant++;
-                largest = it;
+                matches[largest].id = vacant++;
+                largest = i;
             }
         }
     }
-    for( id_map::iterator it = ids.begin(); it != ids.end(); ++it ) // quick and dirty
+    for( std::size_t i = 0; i < matches.size(); ++i )
     {
-        for( partition_t::iterator j = it->second.partition->begin(); j != it->second.partition->end(); ++j )
-        {
-            j->first->set( it->second.id );
-        }
+        for( std::size_t j = matches[i].begin; j < matches[i].end; ++j ) { votes[j].voxel->set( matches[i].id ); }
     }
 }
 
 static void read_block_() // todo: implement generic reading block
 {
     points.clear();
-    voxels.second.reset( new snark::voxel_map< voxel, 3 >( origin, resolution ) );
+    if( voxels.second ) { voxels.second->clear(); } // reuse the map of the block before previous
+    else { voxels.second.reset( new voxels_t( origin, resolution ) ); }
     static boost::optional< pair_t > last;
     static comma::uint32 block_id = 0;
     static comma::csv::input_stream< input_t > istream( std::cin, csv );
@@ -224,7 +274,7 @@ static void read_block_() // todo: implement generic reading block
         if( last )
         {
             block_id = last->first.block;
-            snark::voxel_map< voxel, 3 >::iterator it = voxels.second->touch_at( last->first.point );
+            voxels_t::iterator it = voxels.second->touch_at( last->first.point );
             it->second.add( last->first );
             last->first.voxel = &it->second;
             points.push_back( *last );
@@ -0,0 +1,317 @@
+// This file is part of snark, a generic and flexible library for robotics research
+// Copyright (c) 2011 The University of Sydney
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. All advertising materials mentioning features or use of this software
+//    must display the following acknowledgement:
+//    This product includes software developed by the The University of Sydney.
+// 4. Neither the name of the The University of Sydney nor the
+//    names of its contributors may be used to endorse or promote products
+//    derived from this software without specific prior written permission.
+//
+// NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+// GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+// HOLDERS AND CONTRIBUTORS \"AS IS\" AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+// OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+// IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#ifndef SNARK_POINT_CLOUD_CONCURRENT_VOXEL_MAP_H
+#define SNARK_POINT_CLOUD_CONCURRENT_VOXEL_MAP_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <boost/noncopyable.hpp>
+#include <comma/base/exception.h>
+#include <boost/scoped_array.hpp>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/spin_mutex.h>
+#include <snark/point_cloud/voxel_map.h>
+
+namespace snark {
+
+/// voxel map split into shards that can be written concurrently
+///
+/// the shard of a voxel is chosen by the high bits of its (mixed) index hash,
+/// thus shards are independent from the hash buckets inside of each shard
+///
+/// two ways to write:
+///     - touch_at( point, f ): apply f to the voxel under the lock of its shard, from any thread
+///     - insert( begin, end, f ): bulk insert in parallel, a task per shard, no locks; since
+///       each voxel gets its points in the order of the input, the result is deterministic
+///       and the same as of inserting points one by one into voxel_map (e.g. for running means)
+template < typename V, unsigned int D, typename P = Eigen::Matrix< double, D, 1 > >
+class concurrent_voxel_map : public boost::noncopyable
+{
+    public:
+        /// number of dimensions
+        enum { dimensions = D };
+
+        /// voxel map type of a shard
+        typedef voxel_map< V, D, P > map_type;
+
+        /// voxel type
+        typedef V voxel_type;
+
+        /// point type
+        typedef P point_type;
+
+        /// index type
+        typedef typename map_type::index_type index_type;
+
+        /// constructor
+        /// @param shards number of shards, rounded up to power of 2
+        concurrent_voxel_map( const point_type& origin, const point_type& resolution, unsigned int shards = 64 );
+
+        /// apply f( voxel_type& ) to the voxel at the given point, creating the voxel, if it does not exist; thread-safe
+        template < typename F > void touch_at( const point_type& point, F f );
+
+        /// insert points in parallel applying f( voxel_type&, const point_type& ) to the voxel of each point
+        /// (f is called from several threads, but never for the same shard at the same time)
+        /// @param begin, end random access iterators to points
+        template < typename It, typename F > void insert( It begin, It end, F f );
+
+        /// move all the voxels to a single voxel map (merge step), leaving the shards empty;
+        /// the map must not have any of the voxels already, otherwise comma::exception is thrown (use merge( map, combine ))
+        void merge( map_type& map );
+
+        /// same as merge( map ), but if the map already has a voxel, combine( voxel_type& existing, const voxel_type& voxel ) is called
+        template < typename F > void merge( map_type& map, F combine );
+
+        /// clear all shards
+        void clear();
+
+        /// return total number of voxels, not thread-safe
+        std::size_t size() const;
+
+        /// return number of shards
+        unsigned int shards() const { return shards_; }
+
+        /// return shard, e.g. for iterating through voxels
+        map_type& shard( unsigned int i ) { return *shards_data_[i].map; }
+
+        /// return shard, e.g. for iterating through voxels
+        const map_type& shard( unsigned int i ) const { return *shards_data_[i].map; }
+
+        /// return shard of voxel index
+        unsigned int shard_of( const index_type& index ) const;
+
+        /// return origin
+        const point_type& origin() const { return origin_; }
+
+        /// return resolution
+        const point_type& resolution() const { return resolution_; }
+
+    private:
+        struct shard_type_
+        {
+            ::tbb::spin_mutex mutex;
+            map_type* map;
+            char padding[64]; // quick and dirty: keep mutexes of neighbour shards in different cache lines
+            shard_type_() : map( NULL ) {}
+            ~shard_type_() { delete map; }
+        };
+        point_type origin_;
+        point_type resolution_;
+        unsigned int shards_;
+        unsigned int shift_;
+        boost::scoped_array< shard_type_ > shards_data_;
+
+        template < typename It, typename F > struct insert_;
+        template < typename It > struct count_;
+        struct scatter_;
+        struct disjoint_;
+};
+
+template < typename V, unsigned int D, typename P >
+inline concurrent_voxel_map< V, D, P >::concurrent_voxel_map( const point_type& origin, const point_type& resolution, unsigned int shards )
+    : origin_( origin )
+    , resolution_( resolution )
+    , shards_( 1 )
+    , shift_( 32 )
+{
+    while( shards_ < shards && shift_ > 0 ) { shards_ <<= 1; --shift_; }
+    shards_data_.reset( new shard_type_[ shards_ ] );
+    for( unsigned int i = 0; i < shards_; ++i ) { shards_data_[i].map = new map_type( origin, resolution ); }
+}
+
+template < typename V, unsigned int D, typename P >
+inline unsigned int concurrent_voxel_map< V, D, P >::shard_of( const index_type& index ) const
+{
+    if( shards_ == 1 ) { return 0; }
+    comma::uint32 h = static_cast< comma::uint32 >( snark::array_hash< index_type, D >()( index ) ) * 2654435761u; // knuth multiplicative mixing, so that high bits depend on all the bits
+    return h >> shift_;
+}
+
+template < typename V, unsigned int D, typename P >
+template < typename F >
+inline void concurrent_voxel_map< V, D, P >::touch_at( const point_type& point, F f )
+{
+    index_type index = map_type::index_of( point, origin_, resolution_ );
+    shard_type_& s = shards_data_[ shard_of( index ) ];
+    ::tbb::spin_mutex::scoped_lock lock( s.mutex );
+    f( ( *s.map )[ index ] );
+}
+
+template < typename V, unsigned int D, typename P >
+template < typename It, typename F >
+struct concurrent_voxel_map< V, D, P >::insert_
+{
+    concurrent_voxel_map* map;
+    It begin;
+    F f;
+    const std::vector< comma::uint32 >* offsets; // points of shard i are order[ offsets[i], offsets[i+1] )
+    const std::vector< comma::uint32 >* order;
+    const std::vector< index_type >* indices;
+
+    void operator()( const ::tbb::blocked_range< unsigned int >& r ) const
+    {
+        for( unsigned int s = r.begin(); s < r.end(); ++s )
+        {
+            map_type& m = *map->shards_data_[s].map;
+            for( comma::uint32 k = ( *offsets )[s]; k < ( *offsets )[ s + 1 ]; ++k )
+            {
+                comma::uint32 i = ( *order )[k];
+                f( m[ ( *indices )[i] ], begin[i] );
+            }
+        }
+    }
+};
+
+/// first pass of insert(): voxel indices, shards, and number of points in each shard for a chunk of points
+template < typename V, unsigned int D, typename P >
+template < typename It >
+struct concurrent_voxel_map< V, D, P >::count_
+{
+    const concurrent_voxel_map* map;
+    It begin;
+    std::size_t size;
+    std::size_t grain;
+    std::vector< index_type >* indices;
+    std::vector< comma::uint32 >* shard_of_point;
+    std::vector< comma::uint32 >* counts; // counts[ chunk * shards + shard ]
+
+    void operator()( const ::tbb::blocked_range< std::size_t >& r ) const
+    {
+        for( std::size_t c = r.begin(); c < r.end(); ++c )
+        {
+            comma::uint32* count = &( *counts )[ c * map->shards_ ];
+            for( std::size_t i = c * grain; i < std::min( ( c + 1 ) * grain, size ); ++i )
+            {
+                ( *indices )[i] = map_type::index_of( begin[i], map->origin_, map->resolution_ );
+                ( *shard_of_point )[i] = map->shard_of( ( *indices )[i] );
+                ++count[ ( *shard_of_point )[i] ];
+            }
+        }
+    }
+};
+
+/// second pass of insert(): put points of a chunk in their places in order by shard
+template < typename V, unsigned int D, typename P >
+struct concurrent_voxel_map< V, D, P >::scatter_
+{
+    unsigned int shards;
+    std::size_t size;
+    std::size_t grain;
+    const std::vector< comma::uint32 >* shard_of_point;
+    std::vector< comma::uint32 >* next; // next[ chunk * shards + shard ]: where the next point of the chunk in the shard goes
+    std::vector< comma::uint32 >* order;
+
+    void operator()( const ::tbb::blocked_range< std::size_t >& r ) const
+    {
+        for( std::size_t c = r.begin(); c < r.end(); ++c )
+        {
+            comma::uint32* n = &( *next )[ c * shards ];
+            for( std::size_t i = c * grain; i < std::min( ( c + 1 ) * grain, size ); ++i ) { ( *order )[ n[ ( *shard_of_point )[i] ]++ ] = i; }
+        }
+    }
+};
+
+template < typename V, unsigned int D, typename P >
+template < typename It, typename F >
+inline void concurrent_voxel_map< V, D, P >::insert( It begin, It end, F f )
+{
+    std::size_t size = end - begin;
+    if( size == 0 ) { return; }
+    static const std::size_t grain = 16384;
+    std::size_t chunks = ( size + grain - 1 ) / grain;
+    std::vector< index_type > indices( size );
+    std::vector< comma::uint32 > shard_of_point( size );
+    std::vector< comma::uint32 > counts( chunks * shards_, 0 );
+    count_< It > counter = { this, begin, size, grain, &indices, &shard_of_point, &counts };
+    ::tbb::parallel_for( ::tbb::blocked_range< std::size_t >( 0, chunks ), counter );
+    std::vector< comma::uint32 > offsets( shards_ + 1, 0 ); // counting sort by shard: points of shard s, chunk by chunk, thus stable, i.e. points keep input order in each shard
+    comma::uint32 offset = 0;
+    for( unsigned int s = 0; s < shards_; ++s )
+    {
+        offsets[s] = offset;
+        for( std::size_t c = 0; c < chunks; ++c ) { comma::uint32& n = counts[ c * shards_ + s ]; comma::uint32 count = n; n = offset; offset += count; } // counts become starting positions
+    }
+    offsets[ shards_ ] = offset;
+    std::vector< comma::uint32 > order( size );
+    scatter_ scatter = { shards_, size, grain, &shard_of_point, &counts, &order };
+    ::tbb::parallel_for( ::tbb::blocked_range< std::size_t >( 0, chunks ), scatter );
+    insert_< It, F > inserter = { this, begin, f, &offsets, &order, &indices };
+    ::tbb::parallel_for( ::tbb::blocked_range< unsigned int >( 0, shards_ ), inserter );
+}
+
+template < typename V, unsigned int D, typename P >
+struct concurrent_voxel_map< V, D, P >::disjoint_
+{
+    void operator()( voxel_type&, const voxel_type& ) const { COMMA_THROW( comma::exception, "merge: voxel already exists in target map; use merge( map, combine )" ); }
+};
+
+template < typename V, unsigned int D, typename P >
+inline void concurrent_voxel_map< V, D, P >::merge( map_type& map ) { merge( map, disjoint_() ); }
+
+template < typename V, unsigned int D, typename P >
+template < typename F >
+inline void concurrent_voxel_map< V, D, P >::merge( map_type& map, F combine )
+{
+    map.rehash( std::ceil( ( map.size() + size() ) / map.max_load_factor() ) );
+    for( unsigned int s = 0; s < shards_; ++s )
+    {
+        map_type& m = *shards_data_[s].map;
+        for( typename map_type::const_iterator it = m.begin(); it != m.end(); ++it )
+        {
+            std::pair< typename map_type::iterator, bool > r = static_cast< typename map_type::base_type& >( map ).insert( *it );
+            if( !r.second ) { combine( r.first->second, it->second ); }
+        }
+        m.clear();
+    }
+}
+
+template < typename V, unsigned int D, typename P >
+inline void concurrent_voxel_map< V, D, P >::clear()
+{
+    for( unsigned int s = 0; s < shards_; ++s ) { shards_data_[s].map->clear(); }
+}
+
+template < typename V, unsigned int D, typename P >
+inline std::size_t concurrent_voxel_map< V, D, P >::size() const
+{
+    std::size_t size = 0;
+    for( unsigned int s = 0; s < shards_; ++s ) { size += shards_data_[s].map->size(); }
+    return size;
+}
+
+} // namespace snark {
+
+#endif // SNARK_POINT_CLOUD_CONCURRENT_VOXEL_MAP_H
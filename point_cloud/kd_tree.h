@@ -0,0 +1,291 @@
+// This file is part of snark, a generic and flexible library for robotics research
+// Copyright (c) 2011 The University of Sydney
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. All advertising materials mentioning features or use of this software
+//    must display the following acknowledgement:
+//    This product includes software developed by the The University of Sydney.
+// 4. Neither the name of the The University of Sydney nor the
+//    names of its contributors may be used to endorse or promote products
+//    derived from this software without specific prior written permission.
+//
+// NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+// GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+// HOLDERS AND CONTRIBUTORS \"AS IS\" AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+// OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+// IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#ifndef SNARK_POINT_CLOUD_KD_TREE_H
+#define SNARK_POINT_CLOUD_KD_TREE_H
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <utility>
+#include <vector>
+#include <Eigen/Core>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_invoke.h>
+
+namespace snark {
+
+/// static kd-tree for nearest neighbour and radius search
+///
+/// the tree is implicit: points are stored in a single array permuted so that
+/// the median of any subrange [begin, end) is the node splitting it, with the
+/// split dimension (the one of the largest spread) stored alongside;
+/// subranges of at most leaf size points are scanned linearly
+///
+/// build is O(n log n) and runs in parallel for large subranges; queries
+/// return indices of the points in the original array
+template < typename P = Eigen::Vector3d >
+class kd_tree
+{
+    public:
+        /// point type
+        typedef P point_type;
+
+        /// scalar type
+        typedef typename P::Scalar scalar_type;
+
+        /// number of dimensions
+        enum { dimensions = P::RowsAtCompileTime };
+
+        /// constructor
+        template < typename It > kd_tree( It begin, It end, std::size_t leaf_size = 8 );
+
+        /// return number of points
+        std::size_t size() const { return nodes_.size(); }
+
+        /// return true, if there are no points
+        bool empty() const { return nodes_.empty(); }
+
+        /// get up to k nearest neighbours of a point, nearest first
+        /// @param indices indices of neighbours in the original array
+        /// @param squared_distances squared distances to the neighbours
+        /// @param max_distance only neighbours not further than max distance
+        void nearest( const point_type& p, std::size_t k, std::vector< std::size_t >& indices, std::vector< scalar_type >& squared_distances, scalar_type max_distance = std::numeric_limits< scalar_type >::max() ) const;
+
+        /// get indices of the points not further than radius from a point, in no particular order
+        void within( const point_type& p, scalar_type radius, std::vector< std::size_t >& indices ) const;
+
+        /// batched nearest(), runs in parallel; results of i-th query are at [ i * k, ( i + 1 ) * k ),
+        /// missing neighbours (if size() < k or beyond max distance) are marked by index size()
+        template < typename It > void nearest( It begin, It end, std::size_t k, std::vector< std::size_t >& indices, std::vector< scalar_type >& squared_distances, scalar_type max_distance = std::numeric_limits< scalar_type >::max() ) const;
+
+        /// batched within(), runs in parallel; results of i-th query are in indices[i]
+        template < typename It > void within( It begin, It end, scalar_type radius, std::vector< std::vector< std::size_t > >& indices ) const;
+
+    private:
+        typedef std::pair< scalar_type, std::size_t > candidate_type_;
+        struct node_type_
+        {
+            point_type point;
+            std::size_t index; // in the original array
+        };
+        struct less_;
+        std::vector< node_type_, Eigen::aligned_allocator< node_type_ > > nodes_; // points in tree order
+        std::vector< unsigned char > dimensions_; // split dimension of node i, if it is a node
+        std::size_t leaf_size_;
+        enum { parallel_grain_ = 1 << 14 };
+
+        struct build_;
+        void build_range_( std::size_t begin, std::size_t end );
+        void nearest_( std::size_t begin, std::size_t end, const point_type& p, std::size_t k, scalar_type& worst, std::vector< candidate_type_ >& heap ) const;
+        void within_( std::size_t begin, std::size_t end, const point_type& p, scalar_type radius_square, std::vector< std::size_t >& indices ) const;
+        template < typename It > struct nearest_batch_;
+        template < typename It > struct within_batch_;
+};
+
+template < typename P >
+struct kd_tree< P >::less_
+{
+    unsigned int dimension;
+    bool operator()( const node_type_& lhs, const node_type_& rhs ) const { return lhs.point[ dimension ] < rhs.point[ dimension ]; }
+};
+
+template < typename P >
+struct kd_tree< P >::build_
+{
+    kd_tree* tree;
+    std::size_t begin;
+    std::size_t end;
+    void operator()() const { tree->build_range_( begin, end ); }
+};
+
+template < typename P >
+template < typename It >
+inline kd_tree< P >::kd_tree( It begin, It end, std::size_t leaf_size ) : leaf_size_( leaf_size < 1 ? 1 : leaf_size )
+{
+    for( std::size_t i = 0; begin != end; ++begin, ++i ) { node_type_ n; n.point = *begin; n.index = i; nodes_.push_back( n ); }
+    dimensions_.resize( nodes_.size(), 0 );
+    build_range_( 0, nodes_.size() );
+}
+
+template < typename P >
+inline void kd_tree< P >::build_range_( std::size_t begin, std::size_t end )
+{
+    if( end - begin <= leaf_size_ ) { return; }
+    point_type min = nodes_[begin].point;
+    point_type max = nodes_[begin].point;
+    for( std::size_t i = begin + 1; i < end; ++i ) { min = min.cwiseMin( nodes_[i].point ); max = max.cwiseMax( nodes_[i].point ); }
+    less_ less;
+    ( max - min ).maxCoeff( &less.dimension );
+    std::size_t middle = begin + ( end - begin ) / 2;
+    std::nth_element( nodes_.begin() + begin, nodes_.begin() + middle, nodes_.begin() + end, less );
+    dimensions_[ middle ] = less.dimension;
+    if( end - begin < parallel_grain_ ) { build_range_( begin, middle ); build_range_( middle + 1, end ); return; }
+    build_ left = { this, begin, middle };
+    build_ right = { this, middle + 1, end };
+    ::tbb::parallel_invoke( left, right );
+}
+
+template < typename P >
+inline void kd_tree< P >::nearest_( std::size_t begin, std::size_t end, const point_type& p, std::size_t k, scalar_type& worst, std::vector< candidate_type_ >& heap ) const
+{
+    if( end - begin <= leaf_size_ )
+    {
+        for( std::size_t i = begin; i < end; ++i )
+        {
+            scalar_type d = ( nodes_[i].point - p ).squaredNorm();
+            if( d > worst ) { continue; }
+            if( heap.size() == k ) { std::pop_heap( heap.begin(), heap.end() ); heap.pop_back(); }
+            heap.push_back( candidate_type_( d, i ) );
+            std::push_heap( heap.begin(), heap.end() );
+            if( heap.size() == k ) { worst = heap.front().first; }
+        }
+        return;
+    }
+    std::size_t middle = begin + ( end - begin ) / 2;
+    scalar_type diff = p[ dimensions_[ middle ] ] - nodes_[ middle ].point[ dimensions_[ middle ] ];
+    if( diff < 0 ) { nearest_( begin, middle, p, k, worst, heap ); }
+    else { nearest_( middle + 1, end, p, k, worst, heap ); }
+    if( diff * diff > worst ) { return; }
+    nearest_( middle, middle + 1, p, k, worst, heap );
+    if( diff < 0 ) { nearest_( middle + 1, end, p, k, worst, heap ); }
+    else { nearest_( begin, middle, p, k, worst, heap ); }
+}
+
+template < typename P >
+inline void kd_tree< P >::nearest( const point_type& p, std::size_t k, std::vector< std::size_t >& indices, std::vector< scalar_type >& squared_distances, scalar_type max_distance ) const
+{
+    indices.clear();
+    squared_distances.clear();
+    if( k == 0 || nodes_.empty() ) { return; }
+    std::vector< candidate_type_ > heap;
+    heap.reserve( k + 1 );
+    scalar_type worst = max_distance == std::numeric_limits< scalar_type >::max() ? max_distance : max_distance * max_distance;
+    nearest_( 0, nodes_.size(), p, k, worst, heap );
+    std::sort_heap( heap.begin(), heap.end() );
+    for( std::size_t i = 0; i < heap.size(); ++i ) { indices.push_back( nodes_[ heap[i].second ].index ); squared_distances.push_back( heap[i].first ); }
+}
+
+template < typename P >
+inline void kd_tree< P >::within_( std::size_t begin, std::size_t end, const point_type& p, scalar_type radius_square, std::vector< std::size_t >& indices ) const
+{
+    if( end - begin <= leaf_size_ )
+    {
+        for( std::size_t i = begin; i < end; ++i ) { if( ( nodes_[i].point - p ).squaredNorm() <= radius_square ) { indices.push_back( nodes_[i].index ); } }
+        return;
+    }
+    std::size_t middle = begin + ( end - begin ) / 2;
+    scalar_type diff = p[ dimensions_[ middle ] ] - nodes_[ middle ].point[ dimensions_[ middle ] ];
+    if( diff <= 0 || diff * diff <= radius_square ) { within_( begin, middle, p, radius_square, indices ); }
+    if( ( nodes_[ middle ].point - p ).squaredNorm() <= radius_square ) { indices.push_back( nodes_[ middle ].index ); }
+    if( diff >= 0 || diff * diff <= radius_square ) { within_( middle + 1, end, p, radius_square, indices ); }
+}
+
+template < typename P >
+inline void kd_tree< P >::within( const point_type& p, scalar_type radius, std::vector< std::size_t >& indices ) const
+{
+    indices.clear();
+    if( nodes_.empty() || radius < 0 ) { return; }
+    within_( 0, nodes_.size(), p, radius * radius, indices );
+}
+
+template < typename P >
+template < typename It >
+struct kd_tree< P >::nearest_batch_
+{
+    const kd_tree* tree;
+    It begin;
+    std::size_t k;
+    scalar_type max_distance;
+    std::size_t* indices;
+    scalar_type* squared_distances;
+
+    void operator()( const ::tbb::blocked_range< std::size_t >& r ) const
+    {
+        std::vector< std::size_t > i;
+        std::vector< scalar_type > d;
+        It it = begin;
+        std::advance( it, r.begin() );
+        for( std::size_t q = r.begin(); q < r.end(); ++q, ++it )
+        {
+            tree->nearest( *it, k, i, d, max_distance );
+            std::copy( i.begin(), i.end(), indices + q * k );
+            std::copy( d.begin(), d.end(), squared_distances + q * k );
+        }
+    }
+};
+
+template < typename P >
+template < typename It >
+inline void kd_tree< P >::nearest( It begin, It end, std::size_t k, std::vector< std::size_t >& indices, std::vector< scalar_type >& squared_distances, scalar_type max_distance ) const
+{
+    std::size_t size = std::distance( begin, end );
+    indices.assign( size * k, nodes_.size() );
+    squared_distances.assign( size * k, std::numeric_limits< scalar_type >::max() );
+    if( size == 0 || k == 0 ) { return; }
+    nearest_batch_< It > batch = { this, begin, k, max_distance, &indices[0], &squared_distances[0] };
+    ::tbb::parallel_for( ::tbb::blocked_range< std::size_t >( 0, size, 256 ), batch );
+}
+
+template < typename P >
+template < typename It >
+struct kd_tree< P >::within_batch_
+{
+    const kd_tree* tree;
+    It begin;
+    scalar_type radius;
+    std::vector< std::vector< std::size_t > >* indices;
+
+    void operator()( const ::tbb::blocked_range< std::size_t >& r ) const
+    {
+        It it = begin;
+        std::advance( it, r.begin() );
+        for( std::size_t q = r.begin(); q < r.end(); ++q, ++it ) { tree->within( *it, radius, ( *indices )[q] ); }
+    }
+};
+
+template < typename P >
+template < typename It >
+inline void kd_tree< P >::within( It begin, It end, scalar_type radius, std::vector< std::vector< std::size_t > >& indices ) const
+{
+    std::size_t size = std::distance( begin, end );
+    indices.resize( size );
+    if( size == 0 ) { return; }
+    within_batch_< It > batch = { this, begin, radius, &indices };
+    ::tbb::parallel_for( ::tbb::blocked_range< std::size_t >( 0, size, 256 ), batch );
+}
+
+} // namespace snark {
+
+#endif // SNARK_POINT_CLOUD_KD_TREE_H
@@ -0,0 +1,150 @@
+// This file is part of snark, a generic and flexible library for robotics research
+// Copyright (c) 2011 The University of Sydney
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. All advertising materials mentioning features or use of this software
+//    must display the following acknowledgement:
+//    This product includes software developed by the The University of Sydney.
+// 4. Neither the name of the The University of Sydney nor the
+//    names of its contributors may be used to endorse or promote products
+//    derived from this software without specific prior written permission.
+//
+// NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+// GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+// HOLDERS AND CONTRIBUTORS \"AS IS\" AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+// OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+// IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#ifndef SNARK_POINT_CLOUD_MAPPED_VOXEL_MAP_H
+#define SNARK_POINT_CLOUD_MAPPED_VOXEL_MAP_H
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <comma/base/exception.h>
+#include <snark/point_cloud/voxel_map.h>
+
+namespace snark {
+
+/// read-only voxel map memory-mapped from a file written by voxel_map::write()
+///
+/// nothing is loaded or hashed: voxels are looked up by binary search
+/// on the sorted indices, thus opening even huge maps is instant
+/// and the pages are shared between processes using the same map
+///
+/// @note voxel type should be trivially copyable and its alignment not exceed 8 bytes
+template < typename V, unsigned int D, typename P = Eigen::Matrix< double, D, 1 > >
+class mapped_voxel_map : public boost::noncopyable
+{
+    public:
+        /// number of dimensions
+        enum { dimensions = D };
+
+        /// voxel type
+        typedef V voxel_type;
+
+        /// point type
+        typedef P point_type;
+
+        /// index type
+        typedef typename voxel_map< V, D, P >::index_type index_type;
+
+        /// constructor
+        mapped_voxel_map( const std::string& filename );
+
+        /// return number of voxels
+        std::size_t size() const { return size_; }
+
+        /// return true, if there are no voxels
+        bool empty() const { return size_ == 0; }
+
+        /// return origin
+        const point_type& origin() const { return origin_; }
+
+        /// return resolution
+        const point_type& resolution() const { return resolution_; }
+
+        /// return index of the point, same as voxel_map::index_of()
+        index_type index_of( const point_type& point ) const { return voxel_map< V, D, P >::index_of( point, origin_, resolution_ ); }
+
+        /// find voxel by point; return null, if not found
+        const voxel_type* find( const point_type& point ) const { return find( index_of( point ) ); }
+
+        /// find voxel by index; return null, if not found
+        const voxel_type* find( const index_type& index ) const;
+
+        /// return i-th voxel index, indices are in ascending lexicographic order
+        const index_type& index( std::size_t i ) const { return indices_[i]; }
+
+        /// return i-th voxel
+        const voxel_type& voxel( std::size_t i ) const { return voxels_[i]; }
+
+    private:
+        boost::interprocess::file_mapping mapping_;
+        boost::interprocess::mapped_region region_;
+        std::size_t size_;
+        point_type origin_;
+        point_type resolution_;
+        const index_type* indices_;
+        const voxel_type* voxels_;
+};
+
+template < typename V, unsigned int D, typename P >
+inline mapped_voxel_map< V, D, P >::mapped_voxel_map( const std::string& filename )
+    : mapping_( filename.c_str(), boost::interprocess::read_only )
+    , region_( mapping_, boost::interprocess::read_only )
+{
+    typedef typename point_type::Scalar scalar_type;
+    const char* begin = reinterpret_cast< const char* >( region_.get_address() );
+    std::size_t size = region_.get_size();
+    impl::voxel_map_header header;
+    if( size < sizeof( impl::voxel_map_header ) ) { COMMA_THROW( comma::exception, "\"" << filename << "\" is not a voxel map: file too short" ); }
+    ::memcpy( &header, begin, sizeof( impl::voxel_map_header ) );
+    if( ::memcmp( header.magic, impl::voxel_map_header::magic_value(), sizeof( header.magic ) ) != 0 ) { COMMA_THROW( comma::exception, "\"" << filename << "\" is not a voxel map" ); }
+    if( header.version != impl::voxel_map_header::version_value ) { COMMA_THROW( comma::exception, "expected voxel map version " << impl::voxel_map_header::version_value << ", got " << header.version << " in \"" << filename << "\"" ); }
+    if( header.dimensions != D ) { COMMA_THROW( comma::exception, "expected voxel map of " << D << " dimensions, got " << header.dimensions << " in \"" << filename << "\"" ); }
+    if( header.scalar_size != sizeof( scalar_type ) ) { COMMA_THROW( comma::exception, "expected scalar size " << sizeof( scalar_type ) << ", got " << header.scalar_size << " in \"" << filename << "\"" ); }
+    if( header.voxel_size != sizeof( voxel_type ) ) { COMMA_THROW( comma::exception, "expected voxel size " << sizeof( voxel_type ) << ", got " << header.voxel_size << " in \"" << filename << "\"" ); }
+    size_ = header.size;
+    const char* p = begin + sizeof( impl::voxel_map_header );
+    const char* end = p + impl::voxel_map_header::padded( 2 * D * sizeof( scalar_type ) )
+                        + impl::voxel_map_header::padded( size_ * sizeof( index_type ) )
+                        + size_ * sizeof( voxel_type );
+    if( std::size_t( end - begin ) > size ) { COMMA_THROW( comma::exception, "\"" << filename << "\": expected at least " << ( end - begin ) << " bytes, got " << size << " bytes" ); }
+    for( unsigned int i = 0; i < D; ++i, p += sizeof( scalar_type ) ) { ::memcpy( &origin_[i], p, sizeof( scalar_type ) ); }
+    for( unsigned int i = 0; i < D; ++i, p += sizeof( scalar_type ) ) { ::memcpy( &resolution_[i], p, sizeof( scalar_type ) ); }
+    p = begin + sizeof( impl::voxel_map_header ) + impl::voxel_map_header::padded( 2 * D * sizeof( scalar_type ) );
+    indices_ = reinterpret_cast< const index_type* >( p );
+    voxels_ = reinterpret_cast< const voxel_type* >( p + impl::voxel_map_header::padded( size_ * sizeof( index_type ) ) );
+}
+
+template < typename V, unsigned int D, typename P >
+inline const V* mapped_voxel_map< V, D, P >::find( const typename mapped_voxel_map< V, D, P >::index_type& index ) const
+{
+    const index_type* it = std::lower_bound( indices_, indices_ + size_, index );
+    return it == indices_ + size_ || *it != index ? NULL : voxels_ + ( it - indices_ );
+}
+
+} // namespace snark {
+
+#endif // SNARK_POINT_CLOUD_MAPPED_VOXEL_MAP_H
@@ -0,0 +1,217 @@
+// This file is part of snark, a generic and flexible library for robotics research
+// Copyright (c) 2011 The University of Sydney
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. All advertising materials mentioning features or use of this software
+//    must display the following acknowledgement:
+//    This product includes software developed by the The University of Sydney.
+// 4. Neither the name of the The University of Sydney nor the
+//    names of its contributors may be used to endorse or promote products
+//    derived from this software without specific prior written permission.
+//
+// NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+// GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+// HOLDERS AND CONTRIBUTORS \"AS IS\" AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+// OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+// IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+
+#ifndef SNARK_POINT_CLOUD_SLIDING_WINDOW_VOXEL_MAP_H
+#define SNARK_POINT_CLOUD_SLIDING_WINDOW_VOXEL_MAP_H
+
+#include <deque>
+#include <utility>
+#include <vector>
+#include <comma/base/exception.h>
+#include <snark/point_cloud/voxel_map.h>
+
+namespace snark {
+
+/// voxel map over a sliding window of blocks of points, e.g. the last few seconds of a scan
+///
+/// each voxel keeps a timestamped accumulator per block of the window that hit it
+/// and their total; adding a block touches only the voxels of its points and expiring
+/// a block only the voxels it hit, thus there is no rebuild of the whole map per block
+///
+/// usage:
+///     map.touch_at( point, t ) += point; // for each point of the block with time t
+///     map.expire( t - window ); // drop blocks older than the window
+///     map.update(); // refresh totals of changed voxels
+///     for( it = map.begin(); it != map.end(); ++it ) { ... it->second.value ... }
+///
+/// voxel type V: default-constructible, with V::operator+=( const V& ) to combine accumulators
+template < typename V, unsigned int D, typename T = double, typename P = Eigen::Matrix< double, D, 1 > >
+class sliding_window_voxel_map
+{
+    public:
+        /// number of dimensions
+        enum { dimensions = D };
+
+        /// voxel accumulator type
+        typedef V voxel_type;
+
+        /// time type
+        typedef T time_type;
+
+        /// point type
+        typedef P point_type;
+
+        /// voxel of the window
+        struct cell_type
+        {
+            /// total of the accumulators, valid after update()
+            voxel_type value;
+
+            /// accumulators of the blocks, in ascending order of time
+            std::vector< std::pair< time_type, voxel_type > > accumulators;
+
+            cell_type() : changed_( false ) {}
+
+            private:
+                friend class sliding_window_voxel_map;
+                bool changed_;
+        };
+
+        /// voxel map type
+        typedef voxel_map< cell_type, D, P > map_type;
+
+        /// index type
+        typedef typename map_type::index_type index_type;
+
+        /// const iterator type
+        typedef typename map_type::const_iterator const_iterator;
+
+        /// constructor
+        sliding_window_voxel_map( const point_type& origin, const point_type& resolution );
+
+        /// return accumulator of the block with the given time for the voxel at the given point
+        /// @param t time of the block; a greater time than of the last block starts a new block;
+        ///          throws, if less than the time of the last block
+        voxel_type& touch_at( const point_type& point, const time_type& t );
+
+        /// remove accumulators of blocks with time less than t
+        void expire( const time_type& t );
+
+        /// recalculate totals of the voxels changed since the last update, remove empty voxels
+        void update();
+
+        /// find voxel by index
+        const_iterator find( const index_type& index ) const { return map_.find( index ); }
+
+        /// iterators through voxels
+        const_iterator begin() const { return map_.begin(); }
+        const_iterator end() const { return map_.end(); }
+
+        /// number of voxels
+        std::size_t size() const { return map_.size(); }
+
+        /// number of blocks in the window
+        std::size_t blocks() const { return blocks_.size(); }
+
+        /// indices of the voxels changed by the last update(), including removed
+        const std::vector< index_type >& changed() const { return updated_; }
+
+        /// voxel map of the window
+        const map_type& voxels() const { return map_; }
+
+        /// return origin
+        const point_type& origin() const { return map_.origin(); }
+
+        /// return resolution
+        const point_type& resolution() const { return map_.resolution(); }
+
+    private:
+        struct block_type_
+        {
+            time_type time;
+            std::vector< index_type > indices; // voxels hit by the block
+            block_type_( const time_type& time ) : time( time ) {}
+        };
+        map_type map_;
+        std::deque< block_type_ > blocks_;
+        std::vector< index_type > changed_;
+        std::vector< index_type > updated_;
+
+        void changed_at_( const index_type& index, cell_type& cell );
+};
+
+template < typename V, unsigned int D, typename T, typename P >
+inline sliding_window_voxel_map< V, D, T, P >::sliding_window_voxel_map( const point_type& origin, const point_type& resolution ) : map_( origin, resolution ) {}
+
+template < typename V, unsigned int D, typename T, typename P >
+inline void sliding_window_voxel_map< V, D, T, P >::changed_at_( const index_type& index, cell_type& cell )
+{
+    if( cell.changed_ ) { return; }
+    cell.changed_ = true;
+    changed_.push_back( index );
+}
+
+template < typename V, unsigned int D, typename T, typename P >
+inline typename sliding_window_voxel_map< V, D, T, P >::voxel_type& sliding_window_voxel_map< V, D, T, P >::touch_at( const point_type& point, const time_type& t )
+{
+    if( blocks_.empty() || blocks_.back().time < t ) { blocks_.push_back( block_type_( t ) ); }
+    else if( t < blocks_.back().time ) { COMMA_THROW( comma::exception, "expected time not less than the time of the last block; got time going back" ); }
+    typename map_type::iterator it = map_.touch_at( point );
+    cell_type& cell = it->second;
+    changed_at_( it->first, cell );
+    if( cell.accumulators.empty() || cell.accumulators.back().first < t )
+    {
+        cell.accumulators.push_back( std::make_pair( t, voxel_type() ) );
+        blocks_.back().indices.push_back( it->first );
+    }
+    return cell.accumulators.back().second;
+}
+
+template < typename V, unsigned int D, typename T, typename P >
+inline void sliding_window_voxel_map< V, D, T, P >::expire( const time_type& t )
+{
+    while( !blocks_.empty() && blocks_.front().time < t )
+    {
+        const block_type_& block = blocks_.front();
+        for( std::size_t i = 0; i < block.indices.size(); ++i )
+        {
+            typename map_type::iterator it = map_.find( block.indices[i] );
+            cell_type& cell = it->second;
+            cell.accumulators.erase( cell.accumulators.begin() ); // oldest block is always first, and there are only few blocks per voxel
+            changed_at_( it->first, cell );
+        }
+        blocks_.pop_front();
+    }
+}
+
+template < typename V, unsigned int D, typename T, typename P >
+inline void sliding_window_voxel_map< V, D, T, P >::update()
+{
+    updated_.clear();
+    for( std::size_t i = 0; i < changed_.size(); ++i )
+    {
+        typename map_type::iterator it = map_.find( changed_[i] );
+        cell_type& cell = it->second;
+        updated_.push_back( it->first );
+        if( cell.accumulators.empty() ) { map_.erase( it ); continue; }
+        cell.changed_ = false;
+        cell.value = cell.accumulators[0].second;
+        for( std::size_t j = 1; j < cell.accumulators.size(); ++j ) { cell.value += cell.accumulators[j].second; }
+    }
+    changed_.clear();
+}
+
+} // namespace snark {
+
+#endif // SNARK_POINT_CLOUD_SLIDING_WINDOW_VOXEL_MAP_H
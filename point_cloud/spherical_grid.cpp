@@ -1,4 +1,8 @@
+#include <algorithm>
 #include <cmath>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <comma/base/exception.h>
 #include <comma/math/compare.h>
 #include "./spherical_grid.h"
@@ -72,6 +76,83 @@ bearing_elevation_grid::index::type bearing_elevation_grid::index::operator()( c
     return i;
 }
 
+std::size_t bearing_elevation_grid::index::bearing_size() const { return M_PI * 2 / resolution_.b(); }
+
+/// same as rounded( d[k] / divisor ) for each k
+static void rounded( const double* d, double divisor, std::size_t* r, std::size_t size )
+{
+    std::size_t k = 0;
+    #ifdef __SSE2__
+    // floor and ceil via truncation to int32 and comparison, exact for |d / divisor| < 2^31
+    if( M_PI * 2 / divisor < ( 1 << 30 ) )
+    {
+        const __m128d div = _mm_set1_pd( divisor );
+        const __m128d epsilon = _mm_set1_pd( 1e-6 );
+        const __m128d one = _mm_set1_pd( 1.0 );
+        double v[2];
+        for( ; k + 2 <= size; k += 2 )
+        {
+            __m128d x = _mm_div_pd( _mm_loadu_pd( d + k ), div );
+            __m128d t = _mm_cvtepi32_pd( _mm_cvttpd_epi32( x ) );
+            __m128d f = _mm_sub_pd( t, _mm_and_pd( _mm_cmpgt_pd( t, x ), one ) );
+            __m128d c = _mm_add_pd( t, _mm_and_pd( _mm_cmplt_pd( t, x ), one ) );
+            __m128d m = _mm_cmplt_pd( _mm_sub_pd( c, x ), epsilon );
+            _mm_storeu_pd( v, _mm_or_pd( _mm_and_pd( m, c ), _mm_andnot_pd( m, f ) ) );
+            r[k] = static_cast< std::size_t >( v[0] );
+            r[ k + 1 ] = static_cast< std::size_t >( v[1] );
+        }
+    }
+    #endif
+    for( ; k < size; ++k ) { r[k] = rounded( d[k] / divisor ); }
+}
+
+void bearing_elevation_grid::index::operator()( const double* bearings, const double* elevations, std::size_t size, type* indices ) const
+{
+    enum { batch = 256 };
+    double db[ batch ];
+    double de[ batch ];
+    std::size_t ib[ batch ];
+    std::size_t ie[ batch ];
+    std::size_t max_bearing_index = bearing_size();
+    for( std::size_t offset = 0; offset < size; offset += batch )
+    {
+        std::size_t n = std::min( std::size_t( batch ), size - offset );
+        for( std::size_t k = 0; k < n; ++k ) // normalisation stays scalar to be exactly the same as in snark::bearing_elevation
+        {
+            snark::bearing_elevation v( bearings[ offset + k ], elevations[ offset + k ] );
+            db[k] = v.b() - begin_.b();
+            if( comma::math::less( db[k], 0 ) ) { db[k] += M_PI * 2; } // quick and dirty
+            de[k] = v.e() - begin_.e();
+            if( comma::math::less( de[k], 0 ) ) { COMMA_THROW( comma::exception, "expected elevation greater than " << begin_.e() << "; got " << v.e() ); }
+        }
+        rounded( db, resolution_.b(), ib, n );
+        rounded( de, resolution_.e(), ie, n );
+        for( std::size_t k = 0; k < n; ++k )
+        {
+            type& i = indices[ offset + k ];
+            i[0] = ib[k] >= max_bearing_index ? ib[k] - max_bearing_index : ib[k]; // quick and dirty
+            i[1] = ie[k];
+        }
+    }
+}
+
+unsigned int bearing_elevation_grid::index::neighbours( const type& i, boost::array< type, 9 >& indices ) const
+{
+    std::size_t size = bearing_size();
+    std::size_t bearings[3] = { i[0] == 0 ? size - 1 : i[0] - 1, i[0], i[0] + 1 >= size ? 0 : i[0] + 1 };
+    unsigned int valid = 0;
+    for( unsigned int b = 0, n = 0; b < 3; ++b )
+    {
+        for( unsigned int e = 0; e < 3; ++e, ++n )
+        {
+            indices[n][0] = bearings[b];
+            indices[n][1] = i[1] + e - 1;
+            if( e > 0 || i[1] > 0 ) { valid |= 1 << n; }
+        }
+    }
+    return valid;
+}
+
 snark::bearing_elevation bearing_elevation_grid::index::bearing_elevation( const type& i ) const
 {
     return snark::bearing_elevation( begin_.b() + resolution_.b() * i[0], begin_.e() + resolution_.e() * i[1] );
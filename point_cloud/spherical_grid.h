@@ -31,6 +31,21 @@ struct bearing_elevation_grid
             /// @return index relative to begin with given resolution
             type operator()( const snark::bearing_elevation& v ) const;
 
+            /// batched operator(): get indices for arrays of bearings and elevations,
+            /// the result is exactly the same as from operator() for each of them
+            void operator()( const double* bearings, const double* elevations, std::size_t size, type* indices ) const;
+
+            /// get index of the cell and of its 8 neighbours without recomputing them from bearing and elevation
+            /// @param indices neighbours row by row: [0]: bearing - 1, elevation - 1; [4]: the cell itself; [8]: bearing + 1, elevation + 1
+            /// @return bitmask of valid neighbours (bit i for indices[i]): bearing wraps around, but elevation below begin is not valid
+            unsigned int neighbours( const type& i, boost::array< type, 9 >& indices ) const;
+
+            /// same as neighbours( operator()( v ), indices )
+            unsigned int neighbours( const snark::bearing_elevation& v, boost::array< type, 9 >& indices ) const { return neighbours( operator()( v ), indices ); }
+
+            /// @return number of bearing cells, after which bearing index wraps around
+            std::size_t bearing_size() const;
+
             /// @return bearing, elevation for given index
             snark::bearing_elevation bearing_elevation( const type& i ) const;
 
@@ -0,0 +1,158 @@
+// This file is part of snark, a generic and flexible library for robotics research
+// Copyright (c) 2011 The University of Sydney
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. All advertising materials mentioning features or use of this software
+//    must display the following acknowledgement:
+//    This product includes software developed by the The University of Sydney.
+// 4. Neither the name of the The University of Sydney nor the
+//    names of its contributors may be used to endorse or promote products
+//    derived from this software without specific prior written permission.
+//
+// NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+// GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+// HOLDERS AND CONTRIBUTORS \"AS IS\" AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+// OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+// IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <cstdlib>
+#include <vector>
+#include <gtest/gtest.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#include <snark/point_cloud/concurrent_voxel_map.h>
+#include "random_points.h"
+
+namespace snark { namespace test {
+
+struct centroid
+{
+    Eigen::Vector3d mean;
+    unsigned int size;
+    centroid() : mean( 0, 0, 0 ), size( 0 ) {}
+};
+
+static void add( centroid& c, const Eigen::Vector3d& p ) { ++c.size; c.mean = ( c.mean * ( c.size - 1 ) + p ) / c.size; } // order-dependent on purpose
+
+static void increment( unsigned int& count ) { ++count; }
+
+typedef std::vector< Eigen::Vector3d, Eigen::aligned_allocator< Eigen::Vector3d > > points_type;
+
+TEST( concurrent_voxel_map, shards )
+{
+    concurrent_voxel_map< int, 3 > m( Eigen::Vector3d( 0, 0, 0 ), Eigen::Vector3d( 1, 1, 1 ), 50 );
+    EXPECT_EQ( 64u, m.shards() );
+    EXPECT_EQ( 1u, ( concurrent_voxel_map< int, 3 >( Eigen::Vector3d( 0, 0, 0 ), Eigen::Vector3d( 1, 1, 1 ), 1 ).shards() ) );
+    std::vector< unsigned int > counts( m.shards(), 0 );
+    concurrent_voxel_map< int, 3 >::index_type index;
+    for( index[0] = -10; index[0] < 10; ++index[0] )
+    {
+        for( index[1] = -10; index[1] < 10; ++index[1] )
+        {
+            for( index[2] = -10; index[2] < 10; ++index[2] ) { ++counts[ m.shard_of( index ) ]; }
+        }
+    }
+    for( unsigned int i = 0; i < counts.size(); ++i ) { EXPECT_LT( 0u, counts[i] ); EXPECT_GT( 8000u / 64 * 2, counts[i] ); }
+}
+
+struct touch
+{
+    concurrent_voxel_map< unsigned int, 3 >* map;
+    const points_type* points;
+    void operator()( const ::tbb::blocked_range< std::size_t >& r ) const { for( std::size_t i = r.begin(); i < r.end(); ++i ) { map->touch_at( ( *points )[i], increment ); } }
+};
+
+TEST( concurrent_voxel_map, touch_at )
+{
+    std::srand( 1 );
+    points_type points = random_points< Eigen::Vector3d >( 100000, -10, 10 );
+    concurrent_voxel_map< unsigned int, 3 > m( Eigen::Vector3d( 0.5, 0.5, 0.5 ), Eigen::Vector3d( 2, 2, 2 ) );
+    touch t = { &m, &points };
+    ::tbb::parallel_for( ::tbb::blocked_range< std::size_t >( 0, points.size(), 100 ), t );
+    voxel_map< unsigned int, 3 > expected( Eigen::Vector3d( 0.5, 0.5, 0.5 ), Eigen::Vector3d( 2, 2, 2 ) );
+    for( std::size_t i = 0; i < points.size(); ++i ) { ++expected.touch_at( points[i] )->second; }
+    EXPECT_EQ( expected.size(), m.size() );
+    voxel_map< unsigned int, 3 > merged( Eigen::Vector3d( 0.5, 0.5, 0.5 ), Eigen::Vector3d( 2, 2, 2 ) );
+    m.merge( merged );
+    EXPECT_EQ( 0u, m.size() );
+    EXPECT_EQ( expected.size(), merged.size() );
+    for( voxel_map< unsigned int, 3 >::const_iterator it = expected.begin(); it != expected.end(); ++it )
+    {
+        voxel_map< unsigned int, 3 >::const_iterator found = merged.find( it->first );
+        ASSERT_TRUE( found != merged.end() );
+        EXPECT_EQ( it->second, found->second );
+    }
+}
+
+TEST( concurrent_voxel_map, insert )
+{
+    std::srand( 2 );
+    points_type points = random_points< Eigen::Vector3d >( 200000, -10, 10 );
+    concurrent_voxel_map< centroid, 3 > m( Eigen::Vector3d( 0, 0, 0 ), Eigen::Vector3d( 0.5, 0.5, 0.5 ), 16 );
+    m.insert( points.begin(), points.end(), add );
+    voxel_map< centroid, 3 > expected( Eigen::Vector3d( 0, 0, 0 ), Eigen::Vector3d( 0.5, 0.5, 0.5 ) );
+    for( std::size_t i = 0; i < points.size(); ++i ) { add( expected.touch_at( points[i] )->second, points[i] ); }
+    EXPECT_EQ( expected.size(), m.size() );
+    for( unsigned int s = 0; s < m.shards(); ++s )
+    {
+        for( voxel_map< centroid, 3 >::const_iterator it = m.shard( s ).begin(); it != m.shard( s ).end(); ++it )
+        {
+            EXPECT_EQ( s, m.shard_of( it->first ) );
+            voxel_map< centroid, 3 >::const_iterator found = expected.find( it->first );
+            ASSERT_TRUE( found != expected.end() );
+            EXPECT_EQ( found->second.size, it->second.size );
+            EXPECT_EQ( found->second.mean, it->second.mean ); // exactly, since points come in the same order
+        }
+    }
+    m.clear();
+    EXPECT_EQ( 0u, m.size() );
+    m.insert( points.begin(), points.begin(), add );
+    EXPECT_EQ( 0u, m.size() );
+}
+
+static void plus( unsigned int& existing, const unsigned int& voxel ) { existing += voxel; }
+
+TEST( concurrent_voxel_map, merge )
+{
+    std::srand( 3 );
+    points_type points = random_points< Eigen::Vector3d >( 50000, -10, 10 );
+    concurrent_voxel_map< unsigned int, 3 > m( Eigen::Vector3d( 0, 0, 0 ), Eigen::Vector3d( 1, 1, 1 ) );
+    voxel_map< unsigned int, 3 > merged( Eigen::Vector3d( 0, 0, 0 ), Eigen::Vector3d( 1, 1, 1 ) );
+    voxel_map< unsigned int, 3 > expected( Eigen::Vector3d( 0, 0, 0 ), Eigen::Vector3d( 1, 1, 1 ) );
+    for( std::size_t i = 0; i < points.size(); ++i )
+    {
+        m.touch_at( points[i], increment );
+        if( i % 2 == 0 ) { ++merged.touch_at( points[i] )->second; }
+        ++expected.touch_at( points[i] )->second;
+        if( i % 2 == 0 ) { ++expected.touch_at( points[i] )->second; }
+    }
+    m.merge( merged, plus );
+    EXPECT_EQ( 0u, m.size() );
+    EXPECT_EQ( expected.size(), merged.size() );
+    for( voxel_map< unsigned int, 3 >::const_iterator it = expected.begin(); it != expected.end(); ++it )
+    {
+        voxel_map< unsigned int, 3 >::const_iterator found = merged.find( it->first );
+        ASSERT_TRUE( found != merged.end() );
+        EXPECT_EQ( it->second, found->second );
+    }
+    m.touch_at( points[0], increment );
+    EXPECT_THROW( m.merge( merged ), comma::exception );
+}
+
+} } // namespace snark { namespace test {
@@ -0,0 +1,161 @@
+// This file is part of snark, a generic and flexible library for robotics research
+// Copyright (c) 2011 The University of Sydney
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. All advertising materials mentioning features or use of this software
+//    must display the following acknowledgement:
+//    This product includes software developed by the The University of Sydney.
+// 4. Neither the name of the The University of Sydney nor the
+//    names of its contributors may be used to endorse or promote products
+//    derived from this software without specific prior written permission.
+//
+// NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+// GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+// HOLDERS AND CONTRIBUTORS \"AS IS\" AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+// OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+// IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+#include <gtest/gtest.h>
+#include <snark/point_cloud/kd_tree.h>
+#include "random_points.h"
+
+namespace snark { namespace test {
+
+template < typename P >
+static void expect_nearest( const std::vector< P, Eigen::aligned_allocator< P > >& points, const P& p, std::size_t k, const std::vector< std::size_t >& indices, const std::vector< double >& squared_distances )
+{
+    std::vector< double > expected;
+    for( std::size_t i = 0; i < points.size(); ++i ) { expected.push_back( ( points[i] - p ).squaredNorm() ); }
+    std::sort( expected.begin(), expected.end() );
+    std::size_t size = std::min( k, points.size() );
+    ASSERT_EQ( size, indices.size() );
+    ASSERT_EQ( size, squared_distances.size() );
+    for( std::size_t i = 0; i < size; ++i )
+    {
+        EXPECT_DOUBLE_EQ( expected[i], squared_distances[i] );
+        EXPECT_DOUBLE_EQ( squared_distances[i], ( points[ indices[i] ] - p ).squaredNorm() );
+    }
+}
+
+TEST( kd_tree, empty )
+{
+    std::vector< Eigen::Vector3d > points;
+    kd_tree< Eigen::Vector3d > tree( points.begin(), points.end() );
+    EXPECT_TRUE( tree.empty() );
+    std::vector< std::size_t > indices;
+    std::vector< double > squared_distances;
+    tree.nearest( Eigen::Vector3d( 0, 0, 0 ), 3, indices, squared_distances );
+    EXPECT_TRUE( indices.empty() );
+    tree.within( Eigen::Vector3d( 0, 0, 0 ), 1.0, indices );
+    EXPECT_TRUE( indices.empty() );
+}
+
+TEST( kd_tree, nearest_3d )
+{
+    std::srand( 1 );
+    std::vector< Eigen::Vector3d, Eigen::aligned_allocator< Eigen::Vector3d > > points = random_points< Eigen::Vector3d >( 5000, 0, 10 );
+    points.push_back( points[10] ); // duplicates
+    points.push_back( points[10] );
+    kd_tree< Eigen::Vector3d > tree( points.begin(), points.end() );
+    EXPECT_EQ( points.size(), tree.size() );
+    std::vector< Eigen::Vector3d, Eigen::aligned_allocator< Eigen::Vector3d > > queries = random_points< Eigen::Vector3d >( 100, 0, 12 );
+    queries.push_back( points[10] );
+    std::vector< std::size_t > indices;
+    std::vector< double > squared_distances;
+    for( std::size_t i = 0; i < queries.size(); ++i )
+    {
+        tree.nearest( queries[i], 1, indices, squared_distances );
+        expect_nearest( points, queries[i], 1, indices, squared_distances );
+        tree.nearest( queries[i], 7, indices, squared_distances );
+        expect_nearest( points, queries[i], 7, indices, squared_distances );
+    }
+    tree.nearest( points[10], 3, indices, squared_distances );
+    ASSERT_EQ( 3u, indices.size() );
+    EXPECT_EQ( 0, squared_distances[2] );
+    tree.nearest( queries[0], 5, indices, squared_distances, 0.0 );
+    EXPECT_TRUE( indices.empty() );
+}
+
+TEST( kd_tree, nearest_2d )
+{
+    std::srand( 2 );
+    std::vector< Eigen::Vector2d, Eigen::aligned_allocator< Eigen::Vector2d > > points = random_points< Eigen::Vector2d >( 3000, 0, 1 );
+    kd_tree< Eigen::Vector2d > tree( points.begin(), points.end(), 1 );
+    std::vector< Eigen::Vector2d, Eigen::aligned_allocator< Eigen::Vector2d > > queries = random_points< Eigen::Vector2d >( 100, 0, 1 );
+    std::vector< std::size_t > indices;
+    std::vector< double > squared_distances;
+    for( std::size_t i = 0; i < queries.size(); ++i )
+    {
+        tree.nearest( queries[i], 4, indices, squared_distances );
+        expect_nearest( points, queries[i], 4, indices, squared_distances );
+    }
+    std::vector< Eigen::Vector2d, Eigen::aligned_allocator< Eigen::Vector2d > > few( points.begin(), points.begin() + 3 );
+    kd_tree< Eigen::Vector2d > small( few.begin(), few.end() );
+    small.nearest( queries[0], 5, indices, squared_distances );
+    expect_nearest( few, queries[0], 5, indices, squared_distances );
+}
+
+TEST( kd_tree, within )
+{
+    std::srand( 3 );
+    std::vector< Eigen::Vector3d, Eigen::aligned_allocator< Eigen::Vector3d > > points = random_points< Eigen::Vector3d >( 5000, 0, 10 );
+    kd_tree< Eigen::Vector3d > tree( points.begin(), points.end() );
+    std::vector< Eigen::Vector3d, Eigen::aligned_allocator< Eigen::Vector3d > > queries = random_points< Eigen::Vector3d >( 100, 0, 10 );
+    std::vector< std::size_t > indices;
+    for( std::size_t i = 0; i < queries.size(); ++i )
+    {
+        tree.within( queries[i], 1.5, indices );
+        std::sort( indices.begin(), indices.end() );
+        std::vector< std::size_t > expected;
+        for( std::size_t j = 0; j < points.size(); ++j ) { if( ( points[j] - queries[i] ).norm() <= 1.5 ) { expected.push_back( j ); } }
+        EXPECT_EQ( expected, indices );
+    }
+}
+
+TEST( kd_tree, batched )
+{
+    std::srand( 4 );
+    std::vector< Eigen::Vector3d, Eigen::aligned_allocator< Eigen::Vector3d > > points = random_points< Eigen::Vector3d >( 50000, 0, 100 );
+    kd_tree< Eigen::Vector3d > tree( points.begin(), points.end() );
+    std::vector< Eigen::Vector3d, Eigen::aligned_allocator< Eigen::Vector3d > > queries = random_points< Eigen::Vector3d >( 2000, 0, 100 );
+    std::vector< std::size_t > indices;
+    std::vector< double > squared_distances;
+    tree.nearest( queries.begin(), queries.end(), 3, indices, squared_distances );
+    ASSERT_EQ( queries.size() * 3, indices.size() );
+    std::vector< std::vector< std::size_t > > within;
+    tree.within( queries.begin(), queries.end(), 2.0, within );
+    ASSERT_EQ( queries.size(), within.size() );
+    std::vector< std::size_t > i;
+    std::vector< double > d;
+    for( std::size_t q = 0; q < queries.size(); ++q )
+    {
+        tree.nearest( queries[q], 3, i, d );
+        EXPECT_TRUE( std::equal( i.begin(), i.end(), indices.begin() + q * 3 ) );
+        EXPECT_TRUE( std::equal( d.begin(), d.end(), squared_distances.begin() + q * 3 ) );
+        tree.within( queries[q], 2.0, i );
+        EXPECT_EQ( i, within[q] );
+    }
+    tree.nearest( queries.begin(), queries.begin() + 1, 3, indices, squared_distances, 0.0 );
+    EXPECT_EQ( tree.size(), indices[0] );
+}
+
+} } // namespace snark { namespace test {
@@ -0,0 +1,126 @@
+// This file is part of snark, a generic and flexible library for robotics research
+// Copyright (c) 2011 The University of Sydney
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 1. Redistributions of source code must retain the above copyright
+//    notice, this list of conditions and the following disclaimer.
+// 2. Redistributions in binary form must reproduce the above copyright
+//    notice, this list of conditions and the following disclaimer in the
+//    documentation and/or other materials provided with the distribution.
+// 3. All advertising materials mentioning features or use of this software
+//    must display the following acknowledgement:
+//    This product includes software developed by the The University of Sydney.
+// 4. Neither the name of the The University of Sydney nor the
+//    names of its contributors may be used to endorse or promote products
+//    derived from this software without specific prior written permission.
+//
+// NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+// GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+// HOLDERS AND CONTRIBUTORS \"AS IS\" AND ANY EXPRESS OR IMPLIED
+// WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+// MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+// BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+// OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+// IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+
+#include <cstdlib>
+#include <vector>
+#include <gtest/gtest.h>
+#include <snark/point_cloud/sliding_window_voxel_map.h>
+#include "random_points.h"
+
+namespace snark { namespace test {
+
+struct accumulator
+{
+    Eigen::Vector3d sum;
+    unsigned int size;
+    accumulator() : sum( 0, 0, 0 ), size( 0 ) {}
+    void operator+=( const Eigen::Vector3d& p ) { sum += p; ++size; }
+    void operator+=( const accumulator& rhs ) { sum += rhs.sum; size += rhs.size; }
+};
+
+typedef sliding_window_voxel_map< accumulator, 3 > window_type;
+
+typedef voxel_map< accumulator, 3 > map_type;
+
+typedef std::vector< Eigen::Vector3d, Eigen::aligned_allocator< Eigen::Vector3d > > points_type;
+
+TEST( sliding_window_voxel_map, same_as_rebuild )
+{
+    std::srand( 1 );
+    std::vector< points_type > blocks( 12 );
+    for( unsigned int i = 0; i < blocks.size(); ++i ) { blocks[i] = random_points< Eigen::Vector3d >( 200, 0, 10 ); }
+    window_type window( Eigen::Vector3d( 0, 0, 0 ), Eigen::Vector3d( 1, 1, 1 ) );
+    const double size = 3;
+    for( unsigned int b = 0; b < blocks.size(); ++b )
+    {
+        double t = b * 0.1;
+        for( unsigned int i = 0; i < blocks[b].size(); ++i ) { window.touch_at( blocks[b][i], t ) += blocks[b][i]; }
+        window.expire( t - ( size - 0.5 ) * 0.1 );
+        window.update();
+        map_type expected( Eigen::Vector3d( 0, 0, 0 ), Eigen::Vector3d( 1, 1, 1 ) );
+        for( unsigned int c = b < size ? 0 : b - size + 1; c <= b; ++c )
+        {
+            for( unsigned int i = 0; i < blocks[c].size(); ++i ) { expected.touch_at( blocks[c][i] )->second += blocks[c][i]; }
+        }
+        EXPECT_EQ( b < size ? b + 1 : size, window.blocks() );
+        EXPECT_EQ( expected.size(), window.size() );
+        for( map_type::const_iterator it = expected.begin(); it != expected.end(); ++it )
+        {
+            window_type::const_iterator wit = window.find( it->first );
+            ASSERT_TRUE( wit != window.end() );
+            EXPECT_EQ( it->second.size, wit->second.value.size );
+            EXPECT_NEAR( 0, ( it->second.sum - wit->second.value.sum ).norm(), 1e-9 );
+        }
+    }
+}
+
+TEST( sliding_window_voxel_map, expire )
+{
+    window_type window( Eigen::Vector3d( 0, 0, 0 ), Eigen::Vector3d( 1, 1, 1 ) );
+    window.touch_at( Eigen::Vector3d( 0.5, 0.5, 0.5 ), 1 ) += Eigen::Vector3d( 0.5, 0.5, 0.5 );
+    window.touch_at( Eigen::Vector3d( 0.6, 0.6, 0.6 ), 1 ) += Eigen::Vector3d( 0.6, 0.6, 0.6 );
+    window.touch_at( Eigen::Vector3d( 1.5, 0.5, 0.5 ), 2 ) += Eigen::Vector3d( 1.5, 0.5, 0.5 );
+    window.touch_at( Eigen::Vector3d( 0.7, 0.7, 0.7 ), 2 ) += Eigen::Vector3d( 0.7, 0.7, 0.7 );
+    window.update();
+    EXPECT_EQ( 2u, window.size() );
+    EXPECT_EQ( 2u, window.blocks() );
+    EXPECT_EQ( 2u, window.changed().size() );
+    window_type::index_type first = {{ 0, 0, 0 }};
+    window_type::index_type second = {{ 1, 0, 0 }};
+    EXPECT_EQ( 3u, window.find( first )->second.value.size );
+    EXPECT_EQ( 2u, window.find( first )->second.accumulators.size() );
+    window.expire( 2 );
+    window.update();
+    EXPECT_EQ( 1u, window.blocks() );
+    EXPECT_EQ( 1u, window.changed().size() );
+    EXPECT_EQ( 1u, window.find( first )->second.value.size );
+    EXPECT_NEAR( 0.7, window.find( first )->second.value.sum.x(), 1e-12 );
+    EXPECT_EQ( 1u, window.find( second )->second.value.size );
+    window.expire( 3 );
+    window.update();
+    EXPECT_EQ( 0u, window.blocks() );
+    EXPECT_EQ( 0u, window.size() );
+    EXPECT_EQ( 2u, window.changed().size() );
+    window.update();
+    EXPECT_TRUE( window.changed().empty() );
+}
+
+TEST( sliding_window_voxel_map, time_going_back )
+{
+    window_type window( Eigen::Vector3d( 0, 0, 0 ), Eigen::Vector3d( 1, 1, 1 ) );
+    window.touch_at( Eigen::Vector3d( 0.5, 0.5, 0.5 ), 2 );
+    EXPECT_THROW( window.touch_at( Eigen::Vector3d( 0.5, 0.5, 0.5 ), 1 ), comma::exception );
+}
+
+} } // namespace snark { namespace test {
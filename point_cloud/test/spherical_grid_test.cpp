@@ -32,6 +32,8 @@
 
 #include <gtest/gtest.h>
 #include <cmath>
+#include <cstdlib>
+#include <vector>
 #include <snark/point_cloud/spherical_grid.h>
 
 namespace snark {
@@ -379,4 +381,68 @@ TEST( elevation_index, get_bounds )
     }
 }
 
+TEST( spherical_grid, bearing_elevation_grid_batched_index )
+{
+    std::vector< double > bearings;
+    std::vector< double > elevations;
+    double step = 1.25 * one_degree;
+    for( int i = -300; i < 300; ++i ) // around and exactly on cell boundaries, including wraparound
+    {
+        const double offsets[] = { 0, 1e-7, -1e-7, 1e-5, -1e-5, step / 2 };
+        for( unsigned int j = 0; j < sizeof( offsets ) / sizeof( double ); ++j )
+        {
+            bearings.push_back( i * step + offsets[j] );
+            elevations.push_back( ( i % 72 ) * step + offsets[j] );
+        }
+    }
+    std::srand( 1 );
+    for( unsigned int i = 0; i < 10000; ++i )
+    {
+        bearings.push_back( ( double( std::rand() ) / RAND_MAX - 0.5 ) * 4 * M_PI );
+        elevations.push_back( ( double( std::rand() ) / RAND_MAX - 0.5 ) * M_PI );
+    }
+    const bearing_elevation_grid::index indices[] = { bearing_elevation_grid::index( step ), bearing_elevation_grid::index( one_degree, 0.3 * one_degree ), bearing_elevation_grid::index( -M_PI / 3, -M_PI / 2, 0.7 * one_degree ) };
+    for( unsigned int k = 0; k < sizeof( indices ) / sizeof( bearing_elevation_grid::index ); ++k )
+    {
+        std::vector< bearing_elevation_grid::index::type > batched( bearings.size() );
+        indices[k]( &bearings[0], &elevations[0], bearings.size(), &batched[0] );
+        for( std::size_t i = 0; i < bearings.size(); ++i ) { EXPECT_EQ( indices[k]( bearings[i], elevations[i] ), batched[i] ) << "bearing: " << bearings[i] << " elevation: " << elevations[i]; }
+        indices[k]( &bearings[0], &elevations[0], 3, &batched[0] ); // odd size
+        for( std::size_t i = 0; i < 3; ++i ) { EXPECT_EQ( indices[k]( bearings[i], elevations[i] ), batched[i] ); }
+    }
+}
+
+TEST( spherical_grid, bearing_elevation_grid_neighbours )
+{
+    bearing_elevation_grid::index index( one_degree );
+    EXPECT_EQ( 360u, index.bearing_size() );
+    boost::array< bearing_elevation_grid::index::type, 9 > n;
+    {
+        unsigned int valid = index.neighbours( bearing_elevation( 10.5 * one_degree, 20.5 * one_degree ), n );
+        EXPECT_EQ( 0x1ffu, valid );
+        for( int b = -1, i = 0; b <= 1; ++b )
+        {
+            for( int e = -1; e <= 1; ++e, ++i ) { EXPECT_EQ( index( bearing_elevation( ( 10.5 + b ) * one_degree, ( 20.5 + e ) * one_degree ) ), n[i] ); }
+        }
+    }
+    {
+        bearing_elevation_grid::index::type i = {{ 0, 0 }};
+        unsigned int valid = index.neighbours( i, n );
+        EXPECT_EQ( 0x1ffu & ~( 1u | 8u | 64u ), valid );
+        EXPECT_EQ( 359u, n[0][0] );
+        EXPECT_EQ( 359u, n[1][0] );
+        EXPECT_EQ( 0u, n[1][1] );
+        EXPECT_EQ( 0u, n[4][0] );
+        EXPECT_EQ( 1u, n[7][0] );
+        EXPECT_EQ( 1u, n[8][1] );
+    }
+    {
+        bearing_elevation_grid::index::type i = {{ 359, 5 }};
+        index.neighbours( i, n );
+        EXPECT_EQ( 358u, n[0][0] );
+        EXPECT_EQ( 0u, n[8][0] );
+        EXPECT_EQ( index( bearing_elevation( M_PI + 0.5 * one_degree, -M_PI / 2 + 6.5 * one_degree ) ), n[8] );
+    }
+}
+
 } // namespace snark {
@@ -32,6 +32,7 @@
 
 
 #include <stdlib.h>
+#include <sstream>
 #include <vector>
 #include <gtest/gtest.h>
 #include <snark/point_cloud/voxel_grid.h>
@@ -100,6 +101,29 @@ TEST( voxel_grid, test )
     }
 }
 
+TEST( voxel_grid, write_read )
+{
+    extents_type e( point( -1, -2, 0 ), point( 10, 10, 5 ) );
+    snark::voxel_grid< int > grid( e, point( 0.5, 0.5, 0.25 ), true );
+    *grid.touch_at( point( -1, -2, 0 ) ) = 1;
+    *grid.touch_at( point( 3.3, 4.4, 2.2 ) ) = 2;
+    *grid.touch_at( point( 10, 10, 5 ) ) = 3;
+    std::stringstream stream;
+    grid.write( stream );
+    snark::voxel_grid< int > read( extents_type( point( 0, 0, 0 ), point( 1, 1, 1 ) ), point( 1, 1, 1 ) );
+    read.read( stream );
+    EXPECT_EQ( grid.extents().min(), read.extents().min() );
+    EXPECT_EQ( grid.extents().max(), read.extents().max() );
+    EXPECT_EQ( grid.resolution(), read.resolution() );
+    EXPECT_EQ( grid.size(), read.size() );
+    unsigned int count = 0;
+    for( snark::voxel_grid< int >::const_iterator it = read.begin(); it != read.end(); ++it, ++count ) { EXPECT_EQ( *it, grid( it() ) ); }
+    EXPECT_EQ( 3u, count );
+    EXPECT_EQ( 2, *read.touch_at( point( 3.3, 4.4, 2.2 ) ) );
+    std::stringstream garbage( "not a voxel grid at all, not at all, not at all" );
+    EXPECT_THROW( read.read( garbage ), comma::exception );
+}
+
 } } // namespace snark {  namespace test {
 
 int main(int argc, char *argv[])
@@ -31,6 +31,10 @@
 // IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <snark/point_cloud/mapped_voxel_map.h>
 #include <snark/point_cloud/voxel_map.h>
 #include <gtest/gtest.h>
 
@@ -164,5 +168,106 @@ TEST( voxel_map, neighbourhood )
     }
 }
 
-} }
+template < typename Map >
+static void expect_equal( const Map& expected, const Map& actual )
+{
+    EXPECT_EQ( expected.origin(), actual.origin() );
+    EXPECT_EQ( expected.resolution(), actual.resolution() );
+    EXPECT_EQ( expected.size(), actual.size() );
+    for( typename Map::const_iterator it = expected.begin(); it != expected.end(); ++it )
+    {
+        typename Map::const_iterator found = actual.find( it->first );
+        EXPECT_TRUE( found != actual.end() );
+        if( found != actual.end() ) { EXPECT_EQ( it->second, found->second ); }
+    }
+}
+
+TEST( voxel_map, write_read_3d )
+{
+    map_type m( map_type::point_type( 0.5, -1, 2 ), map_type::point_type( 0.3, 0.3, 0.5 ) );
+    for( int i = -50; i < 50; ++i ) { m.touch_at( map_type::point_type( i * 0.7, i * 0.11, -i * 0.3 ) )->second = i; }
+    std::stringstream stream;
+    m.write( stream );
+    map_type read( map_type::point_type( 1, 1, 1 ) );
+    read.touch_at( map_type::point_type( 1000, 1000, 1000 ) )->second = 1000;
+    read.read( stream );
+    expect_equal( m, read );
+    map_type empty( map_type::point_type( 1, 1, 1 ) );
+    std::stringstream empty_stream;
+    empty.write( empty_stream );
+    read.read( empty_stream );
+    expect_equal( empty, read );
+    std::stringstream garbage( "not a voxel map at all, not at all, not at all" );
+    EXPECT_THROW( read.read( garbage ), comma::exception );
+    expect_equal( empty, read );
+    map_type before( map_type::point_type( 2, 2, 2 ), map_type::point_type( 1, 1, 1 ) );
+    before.touch_at( map_type::point_type( 3, 3, 3 ) )->second = 3;
+    read = before;
+    std::string s = stream.str();
+    std::stringstream truncated( s.substr( 0, s.size() - 16 ) );
+    EXPECT_THROW( read.read( truncated ), comma::exception );
+    expect_equal( before, read );
+}
 
+TEST( voxel_map, write_read_2d )
+{
+    typedef voxel_map< double, 2 > map_2d_type;
+    map_2d_type m( map_2d_type::point_type( -3, 7 ), map_2d_type::point_type( 0.25, 0.5 ) );
+    for( int i = -50; i < 50; ++i ) { m.touch_at( map_2d_type::point_type( i * 0.7, i * i * 0.01 ) )->second = i * 0.5; }
+    std::stringstream stream;
+    m.write( stream );
+    map_2d_type read( map_2d_type::point_type( 1, 1 ) );
+    read.read( stream );
+    expect_equal( m, read );
+    std::stringstream stream_3d;
+    map_type( map_type::point_type( 1, 1, 1 ) ).write( stream_3d );
+    EXPECT_THROW( read.read( stream_3d ), comma::exception );
+}
+
+template < typename Map >
+static void expect_mapped( const Map& m )
+{
+    const char* filename = "voxel_map_test.bin";
+    {
+        std::ofstream ofs( filename, std::ios::out | std::ios::binary | std::ios::trunc );
+        m.write( ofs );
+    }
+    {
+        mapped_voxel_map< typename Map::voxel_type, Map::dimensions > mapped( filename );
+        EXPECT_EQ( m.origin(), mapped.origin() );
+        EXPECT_EQ( m.resolution(), mapped.resolution() );
+        EXPECT_EQ( m.size(), mapped.size() );
+        for( typename Map::const_iterator it = m.begin(); it != m.end(); ++it )
+        {
+            const typename Map::voxel_type* v = mapped.find( it->first );
+            EXPECT_TRUE( v != NULL );
+            if( v ) { EXPECT_EQ( it->second, *v ); }
+        }
+        for( std::size_t i = 1; i < mapped.size(); ++i ) { EXPECT_TRUE( mapped.index( i - 1 ) < mapped.index( i ) ); }
+    }
+    {
+        mapped_voxel_map< typename Map::voxel_type, Map::dimensions > mapped( filename );
+        typename Map::point_type p = m.origin() - m.resolution() * 1000;
+        EXPECT_TRUE( mapped.find( p ) == NULL );
+        if( !m.empty() ) { EXPECT_EQ( m.begin()->second, *mapped.find( m.begin()->first ) ); }
+    }
+    std::remove( filename );
+}
+
+TEST( voxel_map, mapped )
+{
+    {
+        map_type m( map_type::point_type( 0.3, 0.3, 0.3 ) );
+        for( int i = -50; i < 50; ++i ) { m.touch_at( map_type::point_type( i * 0.7, i * 0.11, -i * 0.3 ) )->second = i; }
+        expect_mapped( m );
+        expect_mapped( map_type( map_type::point_type( 1, 1, 1 ) ) );
+    }
+    {
+        typedef voxel_map< double, 2 > map_2d_type;
+        map_2d_type m( map_2d_type::point_type( -3, 7 ), map_2d_type::point_type( 0.25, 0.5 ) );
+        for( int i = -50; i < 50; ++i ) { m.touch_at( map_2d_type::point_type( i * 0.7, i * i * 0.01 ) )->second = i * 0.5; }
+        expect_mapped( m );
+    }
+}
+
+} }
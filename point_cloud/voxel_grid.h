@@ -35,10 +35,15 @@
 #define SNARK_PERCEPTION_VOXELGRID_HEADER_GUARD
 
 #include <cmath>
+#include <cstring>
+#include <iostream>
 #include <map>
+#include <vector>
 #include <boost/none_t.hpp>
 #include <Eigen/Core>
 #include <boost/optional.hpp>
+#include <comma/base/exception.h>
+#include <comma/base/types.h>
 #include <snark/math/interval.h>
 #include <snark/point_cloud/impl/pin_screen.h>
 
@@ -95,6 +100,12 @@ class voxel_grid : public pin_screen< V >
         const column_type* column( const point_type& p ) const;
         //column_type* column( const point_type& p ); // no non-const class in pin_screen for now
 
+        /// write grid in binary, voxel type should be trivially copyable
+        void write( std::ostream& os ) const;
+
+        /// read grid written by write(), replaces extents, resolution and voxels
+        void read( std::istream& is );
+
         using typename pin_screen< voxel_type >::iterator;
         using typename pin_screen< voxel_type >::const_iterator;
         using typename pin_screen< voxel_type >::neighbourhood_iterator;
@@ -121,6 +132,24 @@ inline static Eigen::Matrix< std::size_t, 1, 2 > size( const math::closed_interv
     return Eigen::Matrix< std::size_t, 1, 2 >( std::ceil( diff.x() / r.x() ), std::ceil( diff.y() / r.y() ) );
 }
 
+/// binary voxel grid file header
+///
+/// file layout: header, extents min, extents max, resolution,
+/// voxel indices as 3 x uint64, voxels; each section is padded to 8 bytes
+struct voxel_grid_header
+{
+    char magic[8];
+    comma::uint32 version;
+    comma::uint32 dimensions;
+    comma::uint32 scalar_size;
+    comma::uint32 voxel_size;
+    comma::uint64 size;
+
+    static const char* magic_value() { return "snarkvxg"; }
+    enum { version_value = 1 };
+    static std::size_t padded( std::size_t size ) { return ( size + 7 ) / 8 * 8; }
+};
+
 } // namespace detail {
 
 template < typename V, typename P >
@@ -189,6 +218,61 @@ const typename voxel_grid< V, P >::column_type* voxel_grid< V, P >::column( cons
     return &this->pin_screen< V >::column( index.x(), index.y() );
 }
 
+template < typename V, typename P >
+inline void voxel_grid< V, P >::write( std::ostream& os ) const
+{
+    typedef typename P::Scalar scalar_type;
+    static const char zeroes[8] = { 0 };
+    detail::voxel_grid_header header;
+    ::memset( &header, 0, sizeof( detail::voxel_grid_header ) );
+    ::memcpy( header.magic, detail::voxel_grid_header::magic_value(), sizeof( header.magic ) );
+    header.version = detail::voxel_grid_header::version_value;
+    header.dimensions = 3;
+    header.scalar_size = sizeof( scalar_type );
+    header.voxel_size = sizeof( voxel_type );
+    std::vector< comma::uint64 > indices;
+    for( const_iterator it = this->begin(); it != this->end(); ++it ) { index_type i = it(); indices.push_back( i[0] ); indices.push_back( i[1] ); indices.push_back( i[2] ); }
+    header.size = indices.size() / 3;
+    os.write( reinterpret_cast< const char* >( &header ), sizeof( detail::voxel_grid_header ) );
+    for( unsigned int i = 0; i < 3; ++i ) { os.write( reinterpret_cast< const char* >( &extents_.min()[i] ), sizeof( scalar_type ) ); }
+    for( unsigned int i = 0; i < 3; ++i ) { os.write( reinterpret_cast< const char* >( &extents_.max()[i] ), sizeof( scalar_type ) ); }
+    for( unsigned int i = 0; i < 3; ++i ) { os.write( reinterpret_cast< const char* >( &resolution_[i] ), sizeof( scalar_type ) ); }
+    os.write( zeroes, detail::voxel_grid_header::padded( 9 * sizeof( scalar_type ) ) - 9 * sizeof( scalar_type ) );
+    if( !indices.empty() ) { os.write( reinterpret_cast< const char* >( &indices[0] ), indices.size() * sizeof( comma::uint64 ) ); }
+    for( const_iterator it = this->begin(); it != this->end(); ++it ) { os.write( reinterpret_cast< const char* >( &( *it ) ), sizeof( voxel_type ) ); }
+    os.write( zeroes, detail::voxel_grid_header::padded( header.size * sizeof( voxel_type ) ) - header.size * sizeof( voxel_type ) );
+    if( !os.good() ) { COMMA_THROW( comma::exception, "failed to write voxel grid" ); }
+}
+
+template < typename V, typename P >
+inline void voxel_grid< V, P >::read( std::istream& is )
+{
+    typedef typename P::Scalar scalar_type;
+    detail::voxel_grid_header header;
+    is.read( reinterpret_cast< char* >( &header ), sizeof( detail::voxel_grid_header ) );
+    if( is.gcount() != sizeof( detail::voxel_grid_header ) ) { COMMA_THROW( comma::exception, "failed to read voxel grid header" ); }
+    if( ::memcmp( header.magic, detail::voxel_grid_header::magic_value(), sizeof( header.magic ) ) != 0 ) { COMMA_THROW( comma::exception, "not a voxel grid" ); }
+    if( header.version != detail::voxel_grid_header::version_value ) { COMMA_THROW( comma::exception, "expected voxel grid version " << detail::voxel_grid_header::version_value << ", got " << header.version ); }
+    if( header.dimensions != 3 ) { COMMA_THROW( comma::exception, "expected voxel grid of 3 dimensions, got " << header.dimensions ); }
+    if( header.scalar_size != sizeof( scalar_type ) ) { COMMA_THROW( comma::exception, "expected scalar size " << sizeof( scalar_type ) << ", got " << header.scalar_size ); }
+    if( header.voxel_size != sizeof( voxel_type ) ) { COMMA_THROW( comma::exception, "expected voxel size " << sizeof( voxel_type ) << ", got " << header.voxel_size ); }
+    point_type min;
+    point_type max;
+    point_type resolution;
+    for( unsigned int i = 0; i < 3; ++i ) { is.read( reinterpret_cast< char* >( &min[i] ), sizeof( scalar_type ) ); }
+    for( unsigned int i = 0; i < 3; ++i ) { is.read( reinterpret_cast< char* >( &max[i] ), sizeof( scalar_type ) ); }
+    for( unsigned int i = 0; i < 3; ++i ) { is.read( reinterpret_cast< char* >( &resolution[i] ), sizeof( scalar_type ) ); }
+    is.ignore( detail::voxel_grid_header::padded( 9 * sizeof( scalar_type ) ) - 9 * sizeof( scalar_type ) );
+    std::vector< comma::uint64 > indices( header.size * 3 );
+    if( header.size > 0 ) { is.read( reinterpret_cast< char* >( &indices[0] ), indices.size() * sizeof( comma::uint64 ) ); }
+    std::vector< voxel_type > voxels( header.size );
+    if( header.size > 0 ) { is.read( reinterpret_cast< char* >( &voxels[0] ), header.size * sizeof( voxel_type ) ); }
+    is.ignore( detail::voxel_grid_header::padded( header.size * sizeof( voxel_type ) ) - header.size * sizeof( voxel_type ) );
+    if( !is.good() ) { COMMA_THROW( comma::exception, "failed to read voxel grid of " << header.size << " voxel(s)" ); }
+    *this = voxel_grid( interval_type( min, max ), resolution ); // extents were written already adjusted
+    for( std::size_t i = 0; i < voxels.size(); ++i ) { this->touch( indices[ i * 3 ], indices[ i * 3 + 1 ], indices[ i * 3 + 2 ] ) = voxels[i]; }
+}
+
 // template < typename V, typename P >
 // typename voxel_grid< V, P >::column_type* voxel_grid< V, P >::column( const point_type& p )
 // {
@@ -34,10 +34,16 @@
 #ifndef SNARK_POINT_CLOUD_VOXELMAP_H
 #define SNARK_POINT_CLOUD_VOXELMAP_H
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <vector>
 #include <boost/array.hpp>
 #include <boost/functional/hash.hpp>
 #include <boost/unordered_map.hpp>
 #include <Eigen/Core>
+#include <comma/base/exception.h>
 #include <comma/base/types.h>
 
 namespace snark {
@@ -56,6 +62,28 @@ struct array_hash : public std::unary_function< Array, std::size_t >
     }
 };
 
+namespace impl {
+
+/// binary voxel map file header
+///
+/// file layout: header, origin, resolution, voxel indices in ascending
+/// lexicographic order, voxels in the same order; each section is padded to 8 bytes
+struct voxel_map_header
+{
+    char magic[8];
+    comma::uint32 version;
+    comma::uint32 dimensions;
+    comma::uint32 scalar_size;
+    comma::uint32 voxel_size;
+    comma::uint64 size;
+
+    static const char* magic_value() { return "snarkvxm"; }
+    enum { version_value = 1 };
+    static std::size_t padded( std::size_t size ) { return ( size + 7 ) / 8 * 8; }
+};
+
+} // namespace impl {
+
 /// unordered voxel map
 ///
 /// it may be a much better choice than voxel grid, whenever
@@ -125,9 +153,16 @@ class voxel_map : public boost::unordered_map< boost::array< comma::int32, D >,
         /// return resolution
         const point_type& resolution() const;
 
+        /// write map in binary, voxel type should be trivially copyable
+        void write( std::ostream& os ) const;
+
+        /// read map written by write(), replaces origin, resolution and voxels
+        void read( std::istream& is );
+
     private:
         point_type origin_;
         point_type resolution_;
+        static bool less_( const typename base_type::value_type* lhs, const typename base_type::value_type* rhs ) { return lhs->first < rhs->first; }
 };
 
 template < typename V, unsigned int D, typename P >
@@ -225,6 +260,68 @@ inline const typename voxel_map< V, D, P >::point_type& voxel_map< V, D, P >::or
 template < typename V, unsigned int D, typename P >
 inline const typename voxel_map< V, D, P >::point_type& voxel_map< V, D, P >::resolution() const { return resolution_; }
 
+template < typename V, unsigned int D, typename P >
+inline void voxel_map< V, D, P >::write( std::ostream& os ) const
+{
+    typedef typename point_type::Scalar scalar_type;
+    static const char zeroes[8] = { 0 };
+    std::vector< const typename base_type::value_type* > voxels;
+    voxels.reserve( this->size() );
+    for( const_iterator it = this->begin(); it != this->end(); ++it ) { voxels.push_back( &( *it ) ); }
+    std::sort( voxels.begin(), voxels.end(), less_ );
+    impl::voxel_map_header header;
+    ::memset( &header, 0, sizeof( impl::voxel_map_header ) );
+    ::memcpy( header.magic, impl::voxel_map_header::magic_value(), sizeof( header.magic ) );
+    header.version = impl::voxel_map_header::version_value;
+    header.dimensions = D;
+    header.scalar_size = sizeof( scalar_type );
+    header.voxel_size = sizeof( voxel_type );
+    header.size = voxels.size();
+    os.write( reinterpret_cast< const char* >( &header ), sizeof( impl::voxel_map_header ) );
+    for( unsigned int i = 0; i < D; ++i ) { os.write( reinterpret_cast< const char* >( &origin_[i] ), sizeof( scalar_type ) ); }
+    for( unsigned int i = 0; i < D; ++i ) { os.write( reinterpret_cast< const char* >( &resolution_[i] ), sizeof( scalar_type ) ); }
+    os.write( zeroes, impl::voxel_map_header::padded( 2 * D * sizeof( scalar_type ) ) - 2 * D * sizeof( scalar_type ) );
+    for( std::size_t i = 0; i < voxels.size(); ++i ) { os.write( reinterpret_cast< const char* >( &voxels[i]->first[0] ), sizeof( index_type ) ); }
+    os.write( zeroes, impl::voxel_map_header::padded( voxels.size() * sizeof( index_type ) ) - voxels.size() * sizeof( index_type ) );
+    for( std::size_t i = 0; i < voxels.size(); ++i ) { os.write( reinterpret_cast< const char* >( &voxels[i]->second ), sizeof( voxel_type ) ); }
+    os.write( zeroes, impl::voxel_map_header::padded( voxels.size() * sizeof( voxel_type ) ) - voxels.size() * sizeof( voxel_type ) );
+    if( !os.good() ) { COMMA_THROW( comma::exception, "failed to write voxel map" ); }
+}
+
+template < typename V, unsigned int D, typename P >
+inline void voxel_map< V, D, P >::read( std::istream& is )
+{
+    typedef typename point_type::Scalar scalar_type;
+    impl::voxel_map_header header;
+    is.read( reinterpret_cast< char* >( &header ), sizeof( impl::voxel_map_header ) );
+    if( is.gcount() != sizeof( impl::voxel_map_header ) ) { COMMA_THROW( comma::exception, "failed to read voxel map header" ); }
+    if( ::memcmp( header.magic, impl::voxel_map_header::magic_value(), sizeof( header.magic ) ) != 0 ) { COMMA_THROW( comma::exception, "not a voxel map" ); }
+    if( header.version != impl::voxel_map_header::version_value ) { COMMA_THROW( comma::exception, "expected voxel map version " << impl::voxel_map_header::version_value << ", got " << header.version ); }
+    if( header.dimensions != D ) { COMMA_THROW( comma::exception, "expected voxel map of " << D << " dimensions, got " << header.dimensions ); }
+    if( header.scalar_size != sizeof( scalar_type ) ) { COMMA_THROW( comma::exception, "expected scalar size " << sizeof( scalar_type ) << ", got " << header.scalar_size ); }
+    if( header.voxel_size != sizeof( voxel_type ) ) { COMMA_THROW( comma::exception, "expected voxel size " << sizeof( voxel_type ) << ", got " << header.voxel_size ); }
+    point_type origin; // read into locals, so that the map is unchanged, if reading fails
+    point_type resolution;
+    for( unsigned int i = 0; i < D; ++i ) { is.read( reinterpret_cast< char* >( &origin[i] ), sizeof( scalar_type ) ); }
+    for( unsigned int i = 0; i < D; ++i ) { is.read( reinterpret_cast< char* >( &resolution[i] ), sizeof( scalar_type ) ); }
+    is.ignore( impl::voxel_map_header::padded( 2 * D * sizeof( scalar_type ) ) - 2 * D * sizeof( scalar_type ) );
+    std::vector< index_type > indices( header.size );
+    if( header.size > 0 ) { is.read( reinterpret_cast< char* >( &indices[0] ), header.size * sizeof( index_type ) ); }
+    is.ignore( impl::voxel_map_header::padded( header.size * sizeof( index_type ) ) - header.size * sizeof( index_type ) );
+    std::vector< voxel_type > voxels( header.size );
+    if( header.size > 0 ) { is.read( reinterpret_cast< char* >( &voxels[0] ), header.size * sizeof( voxel_type ) ); }
+    is.ignore( impl::voxel_map_header::padded( header.size * sizeof( voxel_type ) ) - header.size * sizeof( voxel_type ) );
+    if( !is.good() ) { COMMA_THROW( comma::exception, "failed to read voxel map of " << header.size << " voxel(s)" ); }
+    for( unsigned int i = 0; i < D; ++i ) { if( !( resolution[i] > 0 ) ) { COMMA_THROW( comma::exception, "expected positive voxel map resolution, got " << resolution[i] << " for dimension " << i ); } }
+    base_type map;
+    map.rehash( std::ceil( header.size / map.max_load_factor() ) );
+    for( std::size_t i = 0; i < indices.size(); ++i ) { map.insert( std::make_pair( indices[i], voxels[i] ) ); }
+    if( map.size() != header.size ) { COMMA_THROW( comma::exception, "expected " << header.size << " unique voxel indices in voxel map, got " << map.size() ); }
+    this->base_type::swap( map );
+    origin_ = origin;
+    resolution_ = resolution;
+}
+
 } // namespace snark {
 
 #endif // SNARK_POINT_CLOUD_VOXELMAP_H
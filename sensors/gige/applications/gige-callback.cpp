@@ -241,6 +241,10 @@ int main( int argc, char** argv )
             std::vector< snark::cv_mat::filter > cvMatFilters = snark::cv_mat::filters::make( filters );
             for( std::size_t i = 0; i < cvMatFilters.size(); ++i )
             {
+                if( cvMatFilters[i].serial_function ) // state update of stateful filters (e.g. max, min) in order of frames
+                {
+                    imageFilters = imageFilters & tbb::filter_t< Pair, Pair >( tbb::filter::serial_in_order, boost::bind( cvMatFilters[i].serial_function, _1 ) );
+                }
                 tbb::filter::mode mode = tbb::filter::serial_in_order;
                 if( cvMatFilters[i].parallel )
                 {
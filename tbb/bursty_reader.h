@@ -35,6 +35,7 @@
 #define SNARK_TBB_BURSTY_READER_H_
 
 #include <snark/tbb/queue.h>
+#include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/thread.hpp>
 #include <tbb/pipeline.h>
 
@@ -50,30 +51,54 @@ struct bursty_reader_traits
 
 /// helper class to run a tbb pipeline with bursty data
 /// the pipeline has to be closed when no data is received to prevent the main thread to spin
+///
+/// if the queue size exceeds given size, the reader drops either the oldest queued items (newest_wins)
+/// or the incoming items (oldest_wins); if latency budget given, items queued for longer than it get dropped
 template< typename T >
 class bursty_reader
 {
 public:
+    enum policy { newest_wins, oldest_wins };
+
+    /// counts of items
+    struct statistics_type
+    {
+        statistics_type() : read( 0 ), dropped( 0 ), expired( 0 ) {}
+        std::size_t read; /// items passed downstream
+        std::size_t dropped; /// items dropped, since the queue exceeded size
+        std::size_t expired; /// items dropped, since queued for longer than latency budget
+    };
+
     bursty_reader( boost::function0< T > read, unsigned int size = 0 );
     bursty_reader( boost::function0< T > read, unsigned int size, unsigned int capacity );
+    bursty_reader( boost::function0< T > read, unsigned int size, unsigned int capacity, policy p, boost::posix_time::time_duration budget = boost::posix_time::not_a_date_time );
     ~bursty_reader();
 
     bool wait();
     void stop();
     void join();
     ::tbb::filter_t< void, T >& filter() { return m_read_filter; }
+    bool pop( T& t );
+    bool pop( T& t, boost::posix_time::ptime& queued );
+    statistics_type statistics() const;
 
 private:
+    typedef std::pair< boost::posix_time::ptime, T > entry; /// item with the time it was queued
     T read( ::tbb::flow_control& flow );
+    bool pop_( entry& e );
     void push();
     void push_thread();
 
-    queue< T > m_queue;
+    queue< entry > m_queue;
     unsigned int m_size;
+    policy m_policy;
+    boost::posix_time::time_duration m_budget;
     bool m_running;
     boost::scoped_ptr< boost::thread > m_thread;
     boost::function0< T > m_read;
     ::tbb::filter_t< void, T > m_read_filter;
+    mutable boost::mutex m_mutex;
+    statistics_type m_statistics;
 };
 
 
@@ -83,6 +108,8 @@ private:
 template< typename T >
 bursty_reader< T >::bursty_reader( boost::function0< T > read, unsigned int size ):
     m_size( size ),
+    m_policy( newest_wins ),
+    m_budget( boost::posix_time::not_a_date_time ),
     m_running( true ),
     m_read( read ),
     m_read_filter( ::tbb::filter::serial_in_order, boost::bind( &bursty_reader< T >::read, this, _1 ) )
@@ -98,6 +125,27 @@ template< typename T >
 bursty_reader< T >::bursty_reader( boost::function0< T > read, unsigned int size, unsigned int capacity ):
     m_queue( capacity ),
     m_size( size ),
+    m_policy( newest_wins ),
+    m_budget( boost::posix_time::not_a_date_time ),
+    m_running( true ),
+    m_read( read ),
+    m_read_filter( ::tbb::filter::serial_in_order, boost::bind( &bursty_reader< T >::read, this, _1 ) )
+{
+    m_thread.reset( new boost::thread( boost::bind( &bursty_reader< T >::push_thread, this ) ) );
+}
+
+/// constructor
+/// @param read the user-provided read functor that outputs the data
+/// @param size maximum input queue size before discarding data, 0 means infinite
+/// @param capacity maximum input queue size before the reader thread blocks, 0 means infinite
+/// @param p which items to drop, if the queue exceeds size
+/// @param budget max time an item can spend in the queue, not_a_date_time means infinite
+template< typename T >
+bursty_reader< T >::bursty_reader( boost::function0< T > read, unsigned int size, unsigned int capacity, policy p, boost::posix_time::time_duration budget ):
+    m_queue( capacity ),
+    m_size( size ),
+    m_policy( p ),
+    m_budget( budget ),
     m_running( true ),
     m_read( read ),
     m_read_filter( ::tbb::filter::serial_in_order, boost::bind( &bursty_reader< T >::read, this, _1 ) )
@@ -142,40 +190,77 @@ void bursty_reader< T >::join()
     m_thread.reset();
 }
 
-/// try to pop a frame from the queue
-/// @param flow pipeline flow control used to stop the pipeline when the queue is empty
+/// return counts of items read and dropped so far
 template< typename T >
-T bursty_reader< T >::read( ::tbb::flow_control& flow )
+typename bursty_reader< T >::statistics_type bursty_reader< T >::statistics() const
+{
+    boost::mutex::scoped_lock lock( m_mutex );
+    return m_statistics;
+}
+
+/// pop an item, dropping items as required by size and latency budget
+/// @return false, if queue is empty
+template< typename T >
+bool bursty_reader< T >::pop_( entry& e )
 {
-    if( m_queue.empty() )
+    std::size_t dropped = 0;
+    std::size_t expired = 0;
+    bool popped = false;
+    if( m_policy == newest_wins && m_size > 0 )
     {
-        flow.stop();
-        return T();
+        while( m_queue.size() > m_size ) { m_queue.pop( e ); ++dropped; }
     }
-    if( m_size > 0 )
+    while( !m_queue.empty() )
     {
-        T t;
-        unsigned int n = 0;
-        while( m_queue.size() > m_size )
-        {
-            m_queue.pop( t );
-            n++;
-        }
-//         if( n > 0 ) TODO how to warn the user that data is discarded ?
-//         {
-//             std::cerr << "warning: discarded " << n << " frame(s)" << std::endl;
-//         }
+        m_queue.pop( e );
+        if( m_budget.is_not_a_date_time() || !bursty_reader_traits< T >::valid( e.second ) || boost::posix_time::microsec_clock::universal_time() - e.first <= m_budget ) { popped = true; break; }
+        ++expired;
     }
-    T t;
-    m_queue.pop( t );
-    if( !bursty_reader_traits< T >::valid( t ) )
+    boost::mutex::scoped_lock lock( m_mutex );
+    m_statistics.dropped += dropped;
+    m_statistics.expired += expired;
+    if( popped && bursty_reader_traits< T >::valid( e.second ) ) { ++m_statistics.read; }
+    return popped;
+}
+
+/// try to pop a frame from the queue
+/// @param flow pipeline flow control used to stop the pipeline when the queue is empty
+template< typename T >
+T bursty_reader< T >::read( ::tbb::flow_control& flow )
+{
+    entry e;
+    if( !pop_( e ) || !bursty_reader_traits< T >::valid( e.second ) )
     {
         flow.stop();
         return T();
     }
-    return t;
+    return e.second;
 }
 
+/// blocking read, for consumers other than tbb pipeline, e.g. a flow graph
+/// @param t the popped item
+/// @return false, if the reader has stopped and the queue is empty or the item is invalid
+template< typename T >
+bool bursty_reader< T >::pop( T& t )
+{
+    boost::posix_time::ptime queued;
+    return pop( t, queued );
+}
+
+/// same as pop( t ), but also output the time the item was queued
+template< typename T >
+bool bursty_reader< T >::pop( T& t, boost::posix_time::ptime& queued )
+{
+    while( wait() )
+    {
+        entry e;
+        if( !pop_( e ) ) { continue; }
+        t = e.second;
+        queued = e.first;
+        return bursty_reader_traits< T >::valid( t );
+    }
+    return false;
+}
 
 /// read an element from the source and push it to the queue
 template< typename T >
@@ -185,11 +270,16 @@ void bursty_reader< T >::push()
     if( !bursty_reader_traits< T >::valid( t ) )
     {
         m_running = false;
-        m_queue.push( T() ); // HACK to signal m_queue.wait
+        m_queue.push( entry( boost::posix_time::microsec_clock::universal_time(), T() ) ); // HACK to signal m_queue.wait
+    }
+    else if( m_policy == oldest_wins && m_size > 0 && m_queue.size() >= m_size )
+    {
+        boost::mutex::scoped_lock lock( m_mutex );
+        ++m_statistics.dropped;
     }
     else
     {
-        m_queue.push( t );
+        m_queue.push( entry( boost::posix_time::microsec_clock::universal_time(), t ) );
     }
 }
 
@@ -91,7 +91,7 @@ class queue
 {
 public:
     queue() {}
-    queue( unsigned int capacity ) { m_queue.set_capacity( capacity ); }
+    queue( unsigned int capacity ) { if( capacity > 0 ) { m_queue.set_capacity( capacity ); } } // 0: unlimited
     ~queue() {}
 
     void push( const T& t ) { m_queue.push( t ); ++counter_; }